@@ -0,0 +1,49 @@
+#!/usr/bin/env python2
+# Copyright (c) 2014 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test headers-first sync between two nodes: a fresh node catching up,
+# and a node reorganising onto a longer chain it learns through headers.
+#
+from test_framework import BitcoinTestFramework
+from util import *
+
+class HeadersSyncTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self):
+        self.nodes = start_nodes(2, self.options.tmpdir, [["-debug"], ["-debug"]])
+        self.is_network_split = False
+
+    def run_test(self):
+        # A node that starts from genesis fetches the headers first
+        self.nodes[0].setgenerate(True, 50)
+        connect_nodes_bi(self.nodes, 0, 1)
+        sync_blocks(self.nodes)
+        assert_equal(self.nodes[1].getbestblockhash(), self.nodes[0].getbestblockhash())
+        peer = self.nodes[1].getpeerinfo()[0]
+        assert_equal(peer['synced_headers'], 50)
+
+        # Build competing chains while apart and join them again
+        stop_nodes(self.nodes)
+        wait_bitcoinds()
+        self.setup_network()
+        self.nodes[0].setgenerate(True, 20)
+        self.nodes[1].setgenerate(True, 10)
+        connect_nodes_bi(self.nodes, 0, 1)
+        sync_blocks(self.nodes)
+        assert_equal(self.nodes[1].getblockcount(), 70)
+        assert_equal(self.nodes[1].getbestblockhash(), self.nodes[0].getbestblockhash())
+
+        tips = self.nodes[1].getchaintips()
+        assert_equal(len(tips), 2)
+        assert_equal(tips[1]['branchlen'], 10)
+        assert_equal(tips[1]['status'], 'valid-fork')
+
+if __name__ == '__main__':
+    HeadersSyncTest().main()
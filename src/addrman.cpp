@@ -10,6 +10,9 @@
 #include "serialize.h"
 #include "streams.h"
 
+#include <algorithm>
+#include <limits>
+
 using namespace std;
 
 int CAddrInfo::GetTriedBucket(const uint256& nKey) const
@@ -75,9 +78,22 @@ double CAddrInfo::GetChance(int64_t nNow) const
     return fChance;
 }
 
+CAddrMan::CNetAddrHasher::CNetAddrHasher()
+{
+    k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    k1 = GetRand(std::numeric_limits<uint64_t>::max());
+}
+
+size_t CAddrMan::CNetAddrHasher::operator()(const CNetAddr& addr) const
+{
+    struct in6_addr ip6;
+    addr.GetIn6Addr(&ip6);
+    return CSipHasher(k0, k1).Write((const unsigned char*)&ip6, sizeof(ip6)).Finalize();
+}
+
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
 {
-    std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
+    boost::unordered_map<CNetAddr, int, CNetAddrHasher>::iterator it = mapAddr.find(addr);
     if (it == mapAddr.end())
         return NULL;
     if (pnId)
@@ -95,6 +111,7 @@ CAddrInfo* CAddrMan::Create(const CAddress& addr, const CNetAddr& addrSource, in
     mapAddr[addr] = nId;
     mapInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
+    nChanges++;
     if (pnId)
         *pnId = nId;
     return &mapInfo[nId];
@@ -132,6 +149,7 @@ void CAddrMan::Delete(int nId)
     mapAddr.erase(info);
     mapInfo.erase(nId);
     nNew--;
+    nChanges++;
 }
 
 void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
@@ -139,25 +157,43 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
     // if there is an entry in the specified bucket, delete it.
     if (vvNew[nUBucket][nUBucketPos] != -1) {
         int nIdDelete = vvNew[nUBucket][nUBucketPos];
-        CAddrInfo& infoDelete = mapInfo[nIdDelete];
-        assert(infoDelete.nRefCount > 0);
-        infoDelete.nRefCount--;
-        vvNew[nUBucket][nUBucketPos] = -1;
-        if (infoDelete.nRefCount == 0) {
+        UnsetNew(nUBucket, nUBucketPos);
+        if (mapInfo[nIdDelete].nRefCount == 0) {
             Delete(nIdDelete);
         }
     }
 }
 
+void CAddrMan::SetNew(int nUBucket, int nUBucketPos, int nId)
+{
+    assert(vvNew[nUBucket][nUBucketPos] == -1);
+    CAddrInfo& info = mapInfo[nId];
+    vvNew[nUBucket][nUBucketPos] = nId;
+    info.vNewBuckets.push_back(nUBucket);
+    info.nRefCount++;
+    nChanges++;
+}
+
+void CAddrMan::UnsetNew(int nUBucket, int nUBucketPos)
+{
+    int nId = vvNew[nUBucket][nUBucketPos];
+    assert(nId != -1);
+    CAddrInfo& info = mapInfo[nId];
+    assert(info.nRefCount > 0);
+    std::vector<int>::iterator it = std::find(info.vNewBuckets.begin(), info.vNewBuckets.end(), nUBucket);
+    assert(it != info.vNewBuckets.end());
+    info.vNewBuckets.erase(it);
+    info.nRefCount--;
+    vvNew[nUBucket][nUBucketPos] = -1;
+    nChanges++;
+}
+
 void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 {
-    // remove the entry from all new buckets
-    for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
-        int pos = info.GetBucketPosition(nKey, true, bucket);
-        if (vvNew[bucket][pos] == nId) {
-            vvNew[bucket][pos] = -1;
-            info.nRefCount--;
-        }
+    // remove the entry from all new buckets it is in
+    while (!info.vNewBuckets.empty()) {
+        int bucket = info.vNewBuckets.back();
+        UnsetNew(bucket, info.GetBucketPosition(nKey, true, bucket));
     }
     nNew--;
 
@@ -186,8 +222,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
         assert(vvNew[nUBucket][nUBucketPos] == -1);
 
         // Enter it into the new set again.
-        infoOld.nRefCount = 1;
-        vvNew[nUBucket][nUBucketPos] = nIdEvict;
+        SetNew(nUBucket, nUBucketPos, nIdEvict);
         nNew++;
     }
     assert(vvTried[nKBucket][nKBucketPos] == -1);
@@ -195,6 +230,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
     vvTried[nKBucket][nKBucketPos] = nId;
     nTried++;
     info.fInTried = true;
+    nChanges++;
 }
 
 void CAddrMan::Good_(const CService& addr, int64_t nTime)
@@ -216,6 +252,7 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     info.nLastSuccess = nTime;
     info.nLastTry = nTime;
     info.nAttempts = 0;
+    nChanges++;
     // nTime is not updated here, to avoid leaking information about
     // currently-connected peers.
 
@@ -223,21 +260,9 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     if (info.fInTried)
         return;
 
-    // find a bucket it is in now
-    int nRnd = GetRandInt(ADDRMAN_NEW_BUCKET_COUNT);
-    int nUBucket = -1;
-    for (unsigned int n = 0; n < ADDRMAN_NEW_BUCKET_COUNT; n++) {
-        int nB = (n + nRnd) % ADDRMAN_NEW_BUCKET_COUNT;
-        int nBpos = info.GetBucketPosition(nKey, true, nB);
-        if (vvNew[nB][nBpos] == nId) {
-            nUBucket = nB;
-            break;
-        }
-    }
-
-    // if no bucket is found, something bad happened;
+    // if it is in no new bucket, something bad happened;
     // TODO: maybe re-add the node, but for now, just bail out
-    if (nUBucket == -1)
+    if (info.vNewBuckets.empty())
         return;
 
     LogPrint("addrman", "Moving %s to tried\n", addr.ToString());
@@ -259,11 +284,16 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         // periodically update nTime
         bool fCurrentlyOnline = (GetAdjustedTime() - addr.nTime < 24 * 60 * 60);
         int64_t nUpdateInterval = (fCurrentlyOnline ? 60 * 60 : 24 * 60 * 60);
-        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty))
+        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty)) {
             pinfo->nTime = max((int64_t)0, addr.nTime - nTimePenalty);
+            nChanges++;
+        }
 
         // add services
-        pinfo->nServices |= addr.nServices;
+        if ((pinfo->nServices | addr.nServices) != pinfo->nServices) {
+            pinfo->nServices |= addr.nServices;
+            nChanges++;
+        }
 
         // do not update if no new information is present
         if (!addr.nTime || (pinfo->nTime && addr.nTime <= pinfo->nTime))
@@ -303,8 +333,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         }
         if (fInsert) {
             ClearNew(nUBucket, nUBucketPos);
-            pinfo->nRefCount++;
-            vvNew[nUBucket][nUBucketPos] = nId;
+            SetNew(nUBucket, nUBucketPos, nId);
         } else {
             if (pinfo->nRefCount == 0) {
                 Delete(nId);
@@ -331,6 +360,7 @@ void CAddrMan::Attempt_(const CService& addr, int64_t nTime)
     // update info
     info.nLastTry = nTime;
     info.nAttempts++;
+    nChanges++;
 }
 
 CAddress CAddrMan::Select_()
@@ -395,6 +425,8 @@ int CAddrMan::Check_()
                 return -3;
             if (!info.nRefCount)
                 return -4;
+            if (info.vNewBuckets.size() != (size_t)info.nRefCount)
+                return -20;
             mapNew[n] = info.nRefCount;
         }
         if (mapAddr[info] != n)
@@ -487,6 +519,8 @@ void CAddrMan::Connected_(const CService& addr, int64_t nTime)
 
     // update info
     int64_t nUpdateInterval = 20 * 60;
-    if (nTime - info.nTime > nUpdateInterval)
+    if (nTime - info.nTime > nUpdateInterval) {
         info.nTime = nTime;
+        nChanges++;
+    }
 }
@@ -7,6 +7,7 @@
 #ifndef BITCOIN_ADDRMAN_H
 #define BITCOIN_ADDRMAN_H
 
+#include "hash.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -19,6 +20,8 @@
 #include <stdint.h>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 /** 
  * Extended statistics about a CAddress 
  */
@@ -40,6 +43,9 @@ private:
     //! reference count in new sets (memory only)
     int nRefCount;
 
+    //! the new buckets that reference this entry, nRefCount of them (memory only)
+    std::vector<int> vNewBuckets;
+
     //! in tried set? (memory only)
     bool fInTried;
 
@@ -66,6 +72,7 @@ public:
         nLastTry = 0;
         nAttempts = 0;
         nRefCount = 0;
+        vNewBuckets.clear();
         fInTried = false;
         nRandomPos = -1;
     }
@@ -182,8 +189,19 @@ private:
     //! table with information about all nIds
     std::map<int, CAddrInfo> mapInfo;
 
+    //! Salted hash of a network address, so that peers cannot pick addresses that collide in mapAddr
+    class CNetAddrHasher
+    {
+    private:
+        uint64_t k0, k1;
+
+    public:
+        CNetAddrHasher();
+        size_t operator()(const CNetAddr& addr) const;
+    };
+
     //! find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    boost::unordered_map<CNetAddr, int, CNetAddrHasher> mapAddr;
 
     //! randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -200,6 +218,9 @@ private:
     //! list of "new" buckets
     int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
+    //! number of modifications to the tables, used to skip rewriting peers.dat when nothing changed (memory only)
+    uint64_t nChanges;
+
 protected:
     //! Find an entry.
     CAddrInfo* Find(const CNetAddr& addr, int* pnId = NULL);
@@ -220,6 +241,12 @@ protected:
     //! Clear a position in a "new" table. This is the only place where entries are actually deleted.
     void ClearNew(int nUBucket, int nUBucketPos);
 
+    //! Store nId at an empty position in a "new" table and count the reference.
+    void SetNew(int nUBucket, int nUBucketPos, int nId);
+
+    //! Empty a position in a "new" table, without deleting the entry that was there.
+    void UnsetNew(int nUBucket, int nUBucketPos);
+
     //! Mark an entry "good", possibly moving it from "new" to "tried".
     void Good_(const CService& addr, int64_t nTime);
 
@@ -358,8 +385,7 @@ public:
                 int nUBucket = info.GetNewBucket(nKey);
                 int nUBucketPos = info.GetBucketPosition(nKey, true, nUBucket);
                 if (vvNew[nUBucket][nUBucketPos] == -1) {
-                    vvNew[nUBucket][nUBucketPos] = n;
-                    info.nRefCount++;
+                    SetNew(nUBucket, nUBucketPos, n);
                 }
             }
         }
@@ -397,8 +423,7 @@ public:
                     CAddrInfo& info = mapInfo[nIndex];
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
                     if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
-                        info.nRefCount++;
-                        vvNew[bucket][nUBucketPos] = nIndex;
+                        SetNew(bucket, nUBucketPos, nIndex);
                     }
                 }
             }
@@ -445,9 +470,10 @@ public:
         nIdCount = 0;
         nTried = 0;
         nNew = 0;
+        nChanges++;
     }
 
-    CAddrMan()
+    CAddrMan() : nChanges(0)
     {
         Clear();
     }
@@ -463,6 +489,13 @@ public:
         return vRandom.size();
     }
 
+    //! Return a counter that changes whenever the tables are modified.
+    uint64_t GetChangeCount() const
+    {
+        LOCK(cs);
+        return nChanges;
+    }
+
     //! Consistency check
     void Check()
     {
@@ -0,0 +1,209 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef GEA_BLOCKENCODINGS_H
+#define GEA_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+
+#include <algorithm>
+#include <ios>
+#include <limits>
+#include <stdint.h>
+#include <vector>
+
+class CTxMemPool;
+
+//! Version of the compact block encoding announced in "sendcmpct"
+static const uint64_t CMPCTBLOCKS_VERSION = 1;
+//! Number of peers that we ask to push new blocks to us as compact blocks
+static const unsigned int MAX_CMPCTBLOCK_HB_PEERS = 3;
+
+/** Request for the transactions of a compact block the requester could not find ("getblocktxn") */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    //! Positions of the requested transactions in the block, ascending
+    std::vector<uint16_t> indexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        // Indexes are sent as the difference to the previous index minus one
+        uint64_t nCount = indexes.size();
+        READWRITE(COMPACTSIZE(nCount));
+        if (ser_action.ForRead()) {
+            indexes.clear();
+            indexes.reserve(std::min(nCount, (uint64_t)MAX_BLOCK_SIZE_CURRENT / 60));
+            uint64_t nOffset = 0;
+            for (uint64_t i = 0; i < nCount; i++) {
+                uint64_t nDiff = 0;
+                READWRITE(COMPACTSIZE(nDiff));
+                nOffset += nDiff;
+                if (nOffset > std::numeric_limits<uint16_t>::max())
+                    throw std::ios_base::failure("index overflowed 16 bits");
+                indexes.push_back(nOffset);
+                nOffset++;
+            }
+        } else {
+            for (size_t i = 0; i < indexes.size(); i++) {
+                uint64_t nDiff = indexes[i] - (i == 0 ? 0 : indexes[i - 1] + 1);
+                READWRITE(COMPACTSIZE(nDiff));
+            }
+        }
+    }
+};
+
+/** The transactions answering a BlockTransactionsRequest ("blocktxn") */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent along with a compact block */
+struct PrefilledTransaction {
+    //! Position in the block, as the difference to the previous prefilled transaction's position minus one
+    uint16_t index;
+    CTransaction tx;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        uint64_t nIndex = index;
+        READWRITE(COMPACTSIZE(nIndex));
+        if (nIndex > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("index overflowed 16 bits");
+        index = nIndex;
+        READWRITE(tx);
+    }
+};
+
+enum ReadStatus {
+    READ_STATUS_OK,
+    //! The peer sent something that is not a valid compact block
+    READ_STATUS_INVALID,
+    //! The block could not be reconstructed, e.g. after a short id collision; request it in full
+    READ_STATUS_FAILED,
+};
+
+/**
+ * A block announced as its header and 6-byte short ids of its transactions
+ * ("cmpctblock", BIP 152). The coinbase, and the coinstake of a proof-of-stake
+ * block, are always sent in full since a peer can never have them in its
+ * mempool. The block signature is included so that the receiver can
+ * reconstruct a proof-of-stake block without a further round trip.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+    static const int SHORTTXIDS_LENGTH = 6;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(header);
+        READWRITE(nonce);
+
+        uint64_t nShortIDs = shorttxids.size();
+        READWRITE(COMPACTSIZE(nShortIDs));
+        if (ser_action.ForRead()) {
+            shorttxids.clear();
+            shorttxids.reserve(std::min(nShortIDs, (uint64_t)MAX_BLOCK_SIZE_CURRENT / 60));
+            for (uint64_t i = 0; i < nShortIDs; i++) {
+                uint32_t lsb = 0;
+                uint16_t msb = 0;
+                READWRITE(lsb);
+                READWRITE(msb);
+                shorttxids.push_back(((uint64_t)msb << 32) | (uint64_t)lsb);
+            }
+        } else {
+            for (size_t i = 0; i < shorttxids.size(); i++) {
+                uint32_t lsb = shorttxids[i] & 0xffffffff;
+                uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+                READWRITE(lsb);
+                READWRITE(msb);
+            }
+        }
+
+        READWRITE(prefilledtxn);
+        READWRITE(vchBlockSig);
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+/** A block being reconstructed from a CBlockHeaderAndShortTxIDs and the mempool */
+class PartiallyDownloadedBlock
+{
+private:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vHaveTx;
+    CTxMemPool* pool;
+    std::vector<unsigned char> vchBlockSig;
+
+public:
+    CBlockHeader header;
+    size_t nPrefilled;
+    size_t nFromMempool;
+
+    PartiallyDownloadedBlock(CTxMemPool* poolIn) : pool(poolIn), nPrefilled(0), nFromMempool(0) {}
+
+    //! Place the prefilled transactions and look up the others in the mempool.
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock);
+    bool IsTxAvailable(size_t index) const;
+    size_t TxCount() const { return txn_available.size(); }
+    //! Assemble the block, taking the transactions that were not available from vtx_missing in order.
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const;
+};
+
+#endif // GEA_BLOCKENCODINGS_H
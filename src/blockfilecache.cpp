@@ -0,0 +1,92 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilecache.h"
+
+#include "compat.h"
+#include "main.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <sys/stat.h>
+#endif
+
+//! Up to 8 mapped files (1 GiB of address space) on 64-bit, 2 on 32-bit systems
+CBlockFileCache blockFileCache(sizeof(void*) > 4 ? 8 : 2);
+
+CMappedBlockFile::~CMappedBlockFile()
+{
+#ifndef WIN32
+    munmap((void*)pdata, nSize);
+#endif
+}
+
+std::shared_ptr<const CMappedBlockFile> CMappedBlockFile::Open(const boost::filesystem::path& path)
+{
+#ifdef WIN32
+    return std::shared_ptr<const CMappedBlockFile>();
+#else
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return std::shared_ptr<const CMappedBlockFile>();
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return std::shared_ptr<const CMappedBlockFile>();
+    }
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping stays valid after the descriptor is closed
+    if (p == MAP_FAILED) {
+        LogPrint("mmap", "%s : unable to map %s (errno %d)\n", __func__, path.string(), errno);
+        return std::shared_ptr<const CMappedBlockFile>();
+    }
+
+    return std::shared_ptr<const CMappedBlockFile>(new CMappedBlockFile((const char*)p, st.st_size));
+#endif
+}
+
+std::shared_ptr<const CMappedBlockFile> CBlockFileCache::Get(int nFile, size_t nMinSize)
+{
+    LOCK(cs);
+
+    for (std::list<std::pair<int, std::shared_ptr<const CMappedBlockFile> > >::iterator it = lru.begin(); it != lru.end(); ++it) {
+        if (it->first != nFile)
+            continue;
+        if (it->second->size() >= nMinSize) {
+            lru.splice(lru.begin(), lru, it);
+            return lru.front().second;
+        }
+        // The file has grown since it was mapped; map it again below.
+        lru.erase(it);
+        break;
+    }
+
+    std::shared_ptr<const CMappedBlockFile> file = CMappedBlockFile::Open(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk"));
+    if (!file || file->size() < nMinSize)
+        return std::shared_ptr<const CMappedBlockFile>();
+
+    lru.push_front(std::make_pair(nFile, file));
+    if (lru.size() > nMaxFiles)
+        lru.pop_back();
+    return file;
+}
+
+void CBlockFileCache::Invalidate(int nFile)
+{
+    LOCK(cs);
+    for (std::list<std::pair<int, std::shared_ptr<const CMappedBlockFile> > >::iterator it = lru.begin(); it != lru.end(); ++it) {
+        if (it->first == nFile) {
+            lru.erase(it);
+            return;
+        }
+    }
+}
+
+void CBlockFileCache::Clear()
+{
+    LOCK(cs);
+    lru.clear();
+}
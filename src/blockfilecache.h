@@ -0,0 +1,70 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef GEA_BLOCKFILECACHE_H
+#define GEA_BLOCKFILECACHE_H
+
+#include "sync.h"
+
+#include <list>
+#include <memory>
+#include <utility>
+
+#include <boost/filesystem/path.hpp>
+
+/** A read-only memory mapping of a whole blk?????.dat file */
+class CMappedBlockFile
+{
+private:
+    const char* pdata;
+    size_t nSize;
+
+    CMappedBlockFile(const CMappedBlockFile&);
+    void operator=(const CMappedBlockFile&);
+
+public:
+    CMappedBlockFile(const char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+    ~CMappedBlockFile();
+
+    const char* begin() const { return pdata; }
+    const char* end() const { return pdata + nSize; }
+    size_t size() const { return nSize; }
+
+    //! Map the file at path, or return NULL if it cannot be mapped.
+    static std::shared_ptr<const CMappedBlockFile> Open(const boost::filesystem::path& path);
+};
+
+/**
+ * Small LRU cache of mapped block files, used by ReadBlockFromDisk and
+ * GetTransaction to avoid an fopen/fseek/fclose and a buffered copy of the
+ * data for every read. Callers hold a reference to the mapping while they
+ * deserialize from it, so an entry can be evicted or invalidated at any time.
+ */
+class CBlockFileCache
+{
+private:
+    mutable CCriticalSection cs;
+    //! Most recently used first
+    std::list<std::pair<int, std::shared_ptr<const CMappedBlockFile> > > lru;
+    size_t nMaxFiles;
+
+public:
+    CBlockFileCache(size_t nMaxFilesIn) : nMaxFiles(nMaxFilesIn) {}
+
+    /**
+     * Return a mapping of block file nFile that covers at least the first
+     * nMinSize bytes. A stale mapping of a file that has grown since it was
+     * mapped is replaced. Returns NULL when mapping is not possible, in which
+     * case the caller should fall back to regular file I/O.
+     */
+    std::shared_ptr<const CMappedBlockFile> Get(int nFile, size_t nMinSize);
+
+    //! Drop the mapping of nFile, e.g. after the file was truncated.
+    void Invalidate(int nFile);
+    void Clear();
+};
+
+extern CBlockFileCache blockFileCache;
+
+#endif // GEA_BLOCKFILECACHE_H
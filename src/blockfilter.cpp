@@ -0,0 +1,287 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "crypto/common.h"
+#include "hash.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "streams.h"
+
+#include <algorithm>
+#include <ios>
+#include <limits>
+#include <stdexcept>
+
+#include <boost/foreach.hpp>
+
+namespace
+{
+/** Writes a bit stream into a byte vector, most significant bit first */
+class CBitWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+    uint8_t nBuffer;
+    //! Number of bits of nBuffer that are used
+    int nOffset;
+
+public:
+    CBitWriter(std::vector<unsigned char>& vchIn) : vch(vchIn), nBuffer(0), nOffset(0) {}
+
+    //! Write the nBits least significant bits of nData
+    void Write(uint64_t nData, int nBits)
+    {
+        while (nBits > 0) {
+            int nWrite = std::min(8 - nOffset, nBits);
+            nBuffer |= (nData << (64 - nBits)) >> (64 - 8 + nOffset);
+            nOffset += nWrite;
+            nBits -= nWrite;
+            if (nOffset == 8)
+                Flush();
+        }
+    }
+
+    //! Write out the partially filled last byte, padded with zero bits
+    void Flush()
+    {
+        if (nOffset == 0)
+            return;
+        vch.push_back(nBuffer);
+        nBuffer = 0;
+        nOffset = 0;
+    }
+};
+
+/** Reads a bit stream written by CBitWriter */
+class CBitReader
+{
+private:
+    const unsigned char* pnext;
+    const unsigned char* pend;
+    uint8_t nBuffer;
+    //! Number of bits of nBuffer that were consumed
+    int nOffset;
+
+public:
+    CBitReader(const unsigned char* pbegin, const unsigned char* pendIn) : pnext(pbegin), pend(pendIn), nBuffer(0), nOffset(8) {}
+
+    uint64_t Read(int nBits)
+    {
+        uint64_t nData = 0;
+        while (nBits > 0) {
+            if (nOffset == 8) {
+                if (pnext == pend)
+                    throw std::ios_base::failure("CBitReader::Read() : end of data");
+                nBuffer = *pnext++;
+                nOffset = 0;
+            }
+            int nRead = std::min(8 - nOffset, nBits);
+            nData <<= nRead;
+            nData |= static_cast<uint8_t>(nBuffer << nOffset) >> (8 - nRead);
+            nOffset += nRead;
+            nBits -= nRead;
+        }
+        return nData;
+    }
+
+    //! Whether all bytes were consumed
+    bool AtEnd() const { return pnext == pend; }
+};
+
+void GolombRiceEncode(CBitWriter& writer, int nP, uint64_t x)
+{
+    // The quotient is written in unary, the remainder in nP bits
+    uint64_t q = x >> nP;
+    while (q > 0) {
+        int nBits = q <= 64 ? (int)q : 64;
+        writer.Write(~0ULL, nBits);
+        q -= nBits;
+    }
+    writer.Write(0, 1);
+    writer.Write(x, nP);
+}
+
+uint64_t GolombRiceDecode(CBitReader& reader, int nP)
+{
+    uint64_t q = 0;
+    while (reader.Read(1) == 1)
+        q++;
+    uint64_t r = reader.Read(nP);
+    return (q << nP) + r;
+}
+
+//! The high 64 bits of x * n, which maps a uniform 64-bit x uniformly into [0, n)
+uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+    return (uint64_t)(((unsigned __int128)x * (unsigned __int128)n) >> 64);
+#else
+    uint64_t x_hi = x >> 32;
+    uint64_t x_lo = x & 0xFFFFFFFF;
+    uint64_t n_hi = n >> 32;
+    uint64_t n_lo = n & 0xFFFFFFFF;
+
+    uint64_t ac = x_hi * n_hi;
+    uint64_t ad = x_hi * n_lo;
+    uint64_t bc = x_lo * n_hi;
+    uint64_t bd = x_lo * n_lo;
+
+    uint64_t mid34 = (bd >> 32) + (bc & 0xFFFFFFFF) + (ad & 0xFFFFFFFF);
+    return ac + (bc >> 32) + (ad >> 32) + (mid34 >> 32);
+#endif
+}
+} // anon namespace
+
+CGCSFilter::CGCSFilter(uint64_t nSipHashK0In, uint64_t nSipHashK1In, int nPIn, uint32_t nMIn, const ElementSet& elements)
+    : nSipHashK0(nSipHashK0In), nSipHashK1(nSipHashK1In), nP(nPIn), nM(nMIn)
+{
+    if (elements.size() > std::numeric_limits<uint32_t>::max())
+        throw std::invalid_argument("CGCSFilter : too many elements");
+    nN = elements.size();
+    nF = (uint64_t)nN * nM;
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(ss, nN);
+    vchEncoded.assign(ss.begin(), ss.end());
+    if (nN == 0)
+        return;
+
+    CBitWriter writer(vchEncoded);
+    uint64_t nLast = 0;
+    std::vector<uint64_t> vHashed = BuildHashedSet(elements);
+    for (std::vector<uint64_t>::const_iterator it = vHashed.begin(); it != vHashed.end(); ++it) {
+        GolombRiceEncode(writer, nP, *it - nLast);
+        nLast = *it;
+    }
+    writer.Flush();
+}
+
+CGCSFilter::CGCSFilter(uint64_t nSipHashK0In, uint64_t nSipHashK1In, int nPIn, uint32_t nMIn, const std::vector<unsigned char>& vchEncodedIn)
+    : nSipHashK0(nSipHashK0In), nSipHashK1(nSipHashK1In), nP(nPIn), nM(nMIn), vchEncoded(vchEncodedIn)
+{
+    CDataStream ss(vchEncoded, SER_NETWORK, PROTOCOL_VERSION);
+    uint64_t nSize = ReadCompactSize(ss);
+    if (nSize > std::numeric_limits<uint32_t>::max())
+        throw std::ios_base::failure("CGCSFilter : N must be less than 2^32");
+    nN = nSize;
+    nF = (uint64_t)nN * nM;
+
+    // Decode all elements once, so that a filter that loads can always be matched against
+    const unsigned char* pbegin = vchEncoded.data() + GetSizeOfCompactSize(nN);
+    CBitReader reader(pbegin, vchEncoded.data() + vchEncoded.size());
+    for (uint32_t i = 0; i < nN; i++)
+        GolombRiceDecode(reader, nP);
+    if (!reader.AtEnd())
+        throw std::ios_base::failure("CGCSFilter : encoded filter contains excess data");
+}
+
+uint64_t CGCSFilter::HashToRange(const Element& element) const
+{
+    uint64_t nHash = CSipHasher(nSipHashK0, nSipHashK1).Write(element.data(), element.size()).Finalize();
+    return MapIntoRange(nHash, nF);
+}
+
+std::vector<uint64_t> CGCSFilter::BuildHashedSet(const ElementSet& elements) const
+{
+    std::vector<uint64_t> vHashed;
+    vHashed.reserve(elements.size());
+    for (ElementSet::const_iterator it = elements.begin(); it != elements.end(); ++it)
+        vHashed.push_back(HashToRange(*it));
+    std::sort(vHashed.begin(), vHashed.end());
+    return vHashed;
+}
+
+bool CGCSFilter::MatchInternal(const uint64_t* pQuery, size_t nQuerySize) const
+{
+    const unsigned char* pbegin = vchEncoded.data() + GetSizeOfCompactSize(nN);
+    CBitReader reader(pbegin, vchEncoded.data() + vchEncoded.size());
+
+    uint64_t nValue = 0;
+    size_t nQuery = 0;
+    for (uint32_t i = 0; i < nN; i++) {
+        nValue += GolombRiceDecode(reader, nP);
+        while (true) {
+            if (nQuery == nQuerySize)
+                return false;
+            if (pQuery[nQuery] == nValue)
+                return true;
+            if (pQuery[nQuery] > nValue)
+                break;
+            nQuery++;
+        }
+    }
+    return false;
+}
+
+bool CGCSFilter::Match(const Element& element) const
+{
+    uint64_t nQuery = HashToRange(element);
+    return MatchInternal(&nQuery, 1);
+}
+
+bool CGCSFilter::MatchAny(const ElementSet& elements) const
+{
+    std::vector<uint64_t> vQuery = BuildHashedSet(elements);
+    if (vQuery.empty())
+        return false;
+    return MatchInternal(vQuery.data(), vQuery.size());
+}
+
+static void AddScriptElement(CGCSFilter::ElementSet& elements, const CScript& script)
+{
+    if (script.empty() || script[0] == OP_RETURN)
+        return;
+    elements.insert(CGCSFilter::Element(script.begin(), script.end()));
+}
+
+CGCSFilter::ElementSet CBlockFilter::BasicFilterElements(const CBlock& block, const CBlockUndo& blockUndo)
+{
+    CGCSFilter::ElementSet elements;
+
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH (const CTxOut& txout, tx.vout)
+            AddScriptElement(elements, txout.scriptPubKey);
+
+        if (tx.IsZerocoinSpend()) {
+            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+                if (txin.scriptSig.IsZerocoinSpend())
+                    elements.insert(CGCSFilter::Element(txin.scriptSig.begin(), txin.scriptSig.end()));
+            }
+        }
+    }
+
+    BOOST_FOREACH (const CTxUndo& txundo, blockUndo.vtxundo) {
+        BOOST_FOREACH (const CTxInUndo& prevout, txundo.vprevout)
+            AddScriptElement(elements, prevout.txout.scriptPubKey);
+    }
+
+    return elements;
+}
+
+CBlockFilter::CBlockFilter(const CBlock& block, const CBlockUndo& blockUndo)
+    : hashBlock(block.GetHash()),
+      filter(ReadLE64(hashBlock.begin()), ReadLE64(hashBlock.begin() + 8), BASIC_FILTER_P, BASIC_FILTER_M, BasicFilterElements(block, blockUndo))
+{
+}
+
+CBlockFilter::CBlockFilter(const uint256& hashBlockIn, const std::vector<unsigned char>& vchEncoded)
+    : hashBlock(hashBlockIn),
+      filter(ReadLE64(hashBlock.begin()), ReadLE64(hashBlock.begin() + 8), BASIC_FILTER_P, BASIC_FILTER_M, vchEncoded)
+{
+}
+
+uint256 CBlockFilter::GetHash() const
+{
+    const std::vector<unsigned char>& vch = filter.GetEncoded();
+    return Hash(vch.begin(), vch.end());
+}
+
+uint256 CBlockFilter::ComputeHeader(const uint256& hashPrevHeader) const
+{
+    uint256 hashFilter = GetHash();
+    return Hash(hashFilter.begin(), hashFilter.end(), hashPrevHeader.begin(), hashPrevHeader.end());
+}
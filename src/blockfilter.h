@@ -0,0 +1,96 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef GEA_BLOCKFILTER_H
+#define GEA_BLOCKFILTER_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+
+/**
+ * Golomb-coded set, a compact probabilistic set as specified in BIP 158.
+ *
+ * Elements are hashed with SipHash into the range [0, N * M) and the sorted
+ * differences between the hashes are Golomb-Rice coded with parameter P. A
+ * query for an element that is not in the set matches with a probability of
+ * about 1 / M.
+ */
+class CGCSFilter
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+private:
+    uint64_t nSipHashK0;
+    uint64_t nSipHashK1;
+    int nP;
+    uint32_t nM;
+    uint32_t nN;
+    //! Range the elements are hashed into
+    uint64_t nF;
+    std::vector<unsigned char> vchEncoded;
+
+    uint64_t HashToRange(const Element& element) const;
+    std::vector<uint64_t> BuildHashedSet(const ElementSet& elements) const;
+    //! Walk the encoded set in increasing order of hash, stopping at the first match
+    bool MatchInternal(const uint64_t* pQuery, size_t nQuerySize) const;
+
+public:
+    CGCSFilter(uint64_t nSipHashK0In, uint64_t nSipHashK1In, int nPIn, uint32_t nMIn, const ElementSet& elements);
+    //! Load an encoded filter; throws std::ios_base::failure when it is malformed
+    CGCSFilter(uint64_t nSipHashK0In, uint64_t nSipHashK1In, int nPIn, uint32_t nMIn, const std::vector<unsigned char>& vchEncodedIn);
+
+    uint32_t GetN() const { return nN; }
+    const std::vector<unsigned char>& GetEncoded() const { return vchEncoded; }
+
+    bool Match(const Element& element) const;
+    bool MatchAny(const ElementSet& elements) const;
+};
+
+//! Parameters of the basic filter type of BIP 158
+static const int BASIC_FILTER_P = 19;
+static const uint32_t BASIC_FILTER_M = 784931;
+
+enum BlockFilterType {
+    BLOCK_FILTER_BASIC = 0,
+};
+
+/**
+ * The basic filter of a block: all scripts the block spends from and all
+ * non-data output scripts it creates. The zerocoin mint scripts are outputs
+ * like any other; the scripts of zerocoin spends, which do not refer to a
+ * previous output, are included as they appear in the spending input.
+ */
+class CBlockFilter
+{
+private:
+    uint256 hashBlock;
+    CGCSFilter filter;
+
+public:
+    //! The scripts that go into the basic filter of block, whose spent outputs are in blockUndo
+    static CGCSFilter::ElementSet BasicFilterElements(const CBlock& block, const CBlockUndo& blockUndo);
+
+    CBlockFilter(const CBlock& block, const CBlockUndo& blockUndo);
+    CBlockFilter(const uint256& hashBlockIn, const std::vector<unsigned char>& vchEncoded);
+
+    const uint256& GetBlockHash() const { return hashBlock; }
+    const CGCSFilter& GetFilter() const { return filter; }
+    const std::vector<unsigned char>& GetEncoded() const { return filter.GetEncoded(); }
+
+    //! Hash of the encoded filter
+    uint256 GetHash() const;
+    //! Header of this filter, which commits to the headers of all filters before it
+    uint256 ComputeHeader(const uint256& hashPrevHeader) const;
+};
+
+#endif // GEA_BLOCKFILTER_H
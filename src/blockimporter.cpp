@@ -0,0 +1,190 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimporter.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+CBlockFileImporter::CBlockFileImporter(FILE* fileIn, int nWorkers) : blkdat(fileIn, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION),
+                                                                     nQueuedBytes(0),
+                                                                     fReaderDone(false),
+                                                                     fQuit(false),
+                                                                     fRescan(false),
+                                                                     nRescanPos(0)
+{
+    threads.create_thread(boost::bind(&CBlockFileImporter::ThreadRead, this));
+    for (int i = 0; i < nWorkers; i++)
+        threads.create_thread(boost::bind(&CBlockFileImporter::ThreadWork, this));
+}
+
+CBlockFileImporter::~CBlockFileImporter()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+    }
+    condReader.notify_all();
+    condWorker.notify_all();
+    condResult.notify_all();
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+void CBlockFileImporter::ThreadRead()
+{
+    RenameThread("gea-loadblk-read");
+
+    uint64_t nRewind = blkdat.GetPos();
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fQuit && !fRescan && (fReaderDone || nQueuedBytes >= MAX_QUEUED_BYTES))
+                condReader.wait(lock);
+            if (fQuit)
+                break;
+            if (fRescan) {
+                fRescan = false;
+                blkdat.SetLimit();
+                blkdat.Seek(nRescanPos);
+                nRewind = nRescanPos;
+            }
+        }
+        if (blkdat.eof()) {
+            SetReaderDone();
+            continue;
+        }
+
+        blkdat.SetPos(nRewind);
+        nRewind++;         // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+            // locate a header
+            unsigned char buf[MESSAGE_START_SIZE];
+            blkdat.FindByte(Params().MessageStart()[0]);
+            nRewind = blkdat.GetPos() + 1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
+                continue;
+        } catch (const std::exception&) {
+            // no valid block header found; don't complain
+            SetReaderDone();
+            continue;
+        }
+
+        std::shared_ptr<Item> item(new Item());
+        item->fDone = false;
+        try {
+            // read block
+            uint64_t nBlockPos = blkdat.GetPos();
+            blkdat.SetLimit(nBlockPos + nSize);
+            item->vchRaw.resize(nSize);
+            blkdat.read(&item->vchRaw[0], nSize);
+            nRewind = blkdat.GetPos();
+            item->result.nPos = nBlockPos;
+            item->result.nSize = nSize;
+        } catch (const std::exception& e) {
+            LogPrintf("%s : I/O error - %s\n", __func__, e.what());
+            continue;
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // Everything read since a rescan was requested lies past the bad record
+            if (fRescan)
+                continue;
+            queue.push_back(item);
+            queueWork.push_back(item);
+            nQueuedBytes += nSize;
+        }
+        condWorker.notify_one();
+    }
+}
+
+void CBlockFileImporter::SetReaderDone()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReaderDone = true;
+    }
+    condResult.notify_all();
+}
+
+void CBlockFileImporter::ThreadWork()
+{
+    RenameThread("gea-loadblk-work");
+
+    while (true) {
+        std::shared_ptr<Item> item;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fQuit && queueWork.empty())
+                condWorker.wait(lock);
+            if (fQuit)
+                return;
+            item = queueWork.front();
+            queueWork.pop_front();
+        }
+
+        // Deserializing computes the hash of every transaction as well
+        std::shared_ptr<CBlock> pblock(new CBlock());
+        try {
+            CMemoryReader reader(&item->vchRaw[0], &item->vchRaw[0] + item->vchRaw.size(), SER_DISK, CLIENT_VERSION);
+            reader >> *pblock;
+            item->result.hash = pblock->GetHash();
+            item->result.pblock = pblock;
+        } catch (const std::exception& e) {
+            LogPrintf("%s : Deserialize error at offset %u - %s\n", __func__, item->result.nPos, e.what());
+        }
+        std::vector<char>().swap(item->vchRaw);
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            item->fDone = true;
+        }
+        condResult.notify_all();
+    }
+}
+
+bool CBlockFileImporter::Next(CImportedBlock& block)
+{
+    std::shared_ptr<Item> item;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            while (queue.empty() || !queue.front()->fDone) {
+                if (queue.empty() && fReaderDone)
+                    return false;
+                condResult.wait(lock);
+            }
+            item = queue.front();
+            queue.pop_front();
+            nQueuedBytes -= item->result.nSize;
+            if (item->result.pblock)
+                break;
+
+            // Likely a torn write; look for a magic again from the byte after this one's
+            BOOST_FOREACH (const std::shared_ptr<Item>& itemDropped, queue)
+                nQueuedBytes -= itemDropped->result.nSize;
+            queue.clear();
+            queueWork.clear();
+            nRescanPos = item->result.nPos - MESSAGE_START_SIZE - sizeof(item->result.nSize) + 1;
+            fRescan = true;
+            fReaderDone = false;
+            condReader.notify_one();
+        }
+    }
+    condReader.notify_one();
+    block = item->result;
+    return true;
+}
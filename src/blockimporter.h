@@ -0,0 +1,99 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef GEA_BLOCKIMPORTER_H
+#define GEA_BLOCKIMPORTER_H
+
+#include "primitives/block.h"
+#include "streams.h"
+#include "uint256.h"
+
+#include <deque>
+#include <memory>
+#include <stdio.h>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+//! Maximum number of threads deserializing blocks during an import
+static const int MAX_IMPORT_WORKER_THREADS = 4;
+
+/** A block read from a block file, ready to be handed to ProcessNewBlock */
+struct CImportedBlock {
+    //! Offset of the serialized block (just past its size field) in the file
+    uint64_t nPos;
+    //! Serialized size of the block
+    unsigned int nSize;
+    //! NULL until deserialized, and for records that did not deserialize
+    std::shared_ptr<CBlock> pblock;
+    uint256 hash;
+};
+
+/**
+ * Pipeline for -reindex and -loadblock imports.
+ *
+ * A reader thread scans the file for network magic and queues the raw bytes
+ * of every block it finds. A pool of worker threads deserializes those
+ * blocks, which also computes all transaction hashes, and computes the block
+ * hash. The importing thread pulls the results in file order through Next(),
+ * so only validation is left on the critical path.
+ *
+ * As in the old single pass over a CBufferedFile, a record with a valid magic
+ * and size whose data fails to deserialize is rescanned for another magic
+ * from the byte after its own. Blocks read past it are dropped and read again.
+ */
+class CBlockFileImporter
+{
+private:
+    struct Item {
+        CImportedBlock result;
+        std::vector<char> vchRaw;
+        bool fDone;
+    };
+
+    //! Raw bytes kept in memory ahead of the importing thread
+    static const size_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+    CBufferedFile blkdat;
+
+    boost::mutex mutex;
+    //! Reader blocks on this while the queue is full
+    boost::condition_variable condReader;
+    //! Workers block on this when there is nothing to deserialize
+    boost::condition_variable condWorker;
+    //! The importing thread blocks on this until the next block is done
+    boost::condition_variable condResult;
+
+    //! All blocks in file order, until they are taken by Next()
+    std::deque<std::shared_ptr<Item> > queue;
+    //! Blocks that still have to be deserialized
+    std::deque<std::shared_ptr<Item> > queueWork;
+    size_t nQueuedBytes;
+    bool fReaderDone;
+    bool fQuit;
+    //! Set by Next() when a record failed to deserialize; the reader goes back to nRescanPos
+    bool fRescan;
+    uint64_t nRescanPos;
+
+    boost::thread_group threads;
+
+    void ThreadRead();
+    void ThreadWork();
+    void SetReaderDone();
+
+    CBlockFileImporter(const CBlockFileImporter&);
+    void operator=(const CBlockFileImporter&);
+
+public:
+    //! Takes over fileIn and closes it on destruction
+    CBlockFileImporter(FILE* fileIn, int nWorkers);
+    ~CBlockFileImporter();
+
+    //! Return the next block in file order, or false at the end of the file.
+    bool Next(CImportedBlock& block);
+};
+
+#endif // GEA_BLOCKIMPORTER_H
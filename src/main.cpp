@@ -11,6 +11,10 @@
 #include "accumulatormap.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
+#include "blockfilter.h"
+#include "blockfilecache.h"
+#include "blockimporter.h"
 #include "blocksignature.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -21,6 +25,7 @@
 #include "masternode-payments.h"
 #include "masternodeman.h"
 #include "merkleblock.h"
+#include "messagedispatch.h"
 #include "net.h"
 #include "obfuscation.h"
 #include "pow.h"
@@ -33,8 +38,10 @@
 #include "util.h"
 #include "utilmoneystr.h"
 #include "validationinterface.h"
+#include "validationqueue.h"
 #include "zgeachain.h"
 #include "coinvalidator.h"
+#include "crypto/common.h"
 
 #include "primitives/zerocoin.h"
 #include "libzerocoin/Denominations.h"
@@ -78,7 +85,9 @@ bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+uint256 hashAssumeValid;
+CAssumeValidStats assumeValidStats;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 CoinValidator &coinValidator = CoinValidator::instance();
 
@@ -106,6 +115,7 @@ map<uint256, int64_t> mapZerocoinspends; //txid, time received
 void EraseOrphansFor(NodeId peer);
 
 static void CheckBlockIndex();
+static void RegisterMessageHandlers(CMessageDispatcher& dispatcher);
 
 /** Constant stuff for coinbase transactions we create: */
 CScript COINBASE_FLAGS;
@@ -179,9 +189,34 @@ map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 /** Number of blocks in flight with validated headers. */
 int nQueuedValidatedHeaders = 0;
 
+/**
+ * Blocks downloaded during headers-first sync before all of their ancestors,
+ * by hashPrevBlock. Their proof of stake can only be checked against a
+ * connected chain, so they are validated once their parent is. Protected by cs_main.
+ */
+struct HeldBlock {
+    NodeId nodeid;
+    std::shared_ptr<CBlock> pblock;
+    size_t nSize;
+};
+multimap<uint256, HeldBlock> mapBlocksAwaitingParent;
+/** Hashes of the blocks in mapBlocksAwaitingParent. Protected by cs_main. */
+set<uint256> setBlocksAwaitingParent;
+size_t nBlocksAwaitingParentSize = 0;
+
+/**
+ * Peers that sent the headers of proof-of-stake blocks whose data has not
+ * arrived yet. The stake of such a block can only be checked once it is there,
+ * so the peer is blamed if it turns out invalid or never comes. Protected by cs_main.
+ */
+map<uint256, NodeId> mapHeaderSource;
+
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
+/** Peers we asked to push new blocks to us as compact blocks, least recently useful first. Protected by cs_main. */
+list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
 /** Dirty block index entries. */
 set<CBlockIndex*> setDirtyBlockIndex;
 
@@ -235,6 +270,16 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer wants new blocks pushed to it as cmpctblock messages, without an inv first.
+    bool fPreferHeaderAndIDs;
+    //! Whether this peer can send and receive compact blocks.
+    bool fProvidesHeaderAndIDs;
+    //! The compact block from this peer that is waiting for its missing transactions, if any.
+    std::shared_ptr<PartiallyDownloadedBlock> partialBlock;
+    //! Number of proof-of-stake headers from this peer whose blocks have not arrived yet.
+    int nHeadersPending;
+    //! Whether we stopped fetching headers from this peer until the block download catches up.
+    bool fHeadersDeferred;
 
     CNodeState()
     {
@@ -248,6 +293,10 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
+        nHeadersPending = 0;
+        fHeadersDeferred = false;
     }
 };
 
@@ -307,8 +356,16 @@ void FinalizeNode(NodeId nodeid)
 
     BOOST_FOREACH (const QueuedBlock& entry, state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
+    map<uint256, NodeId>::iterator itHeader = mapHeaderSource.begin();
+    while (itHeader != mapHeaderSource.end()) {
+        if (itHeader->second == nodeid)
+            mapHeaderSource.erase(itHeader++);
+        else
+            ++itHeader;
+    }
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -378,6 +435,55 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256& hash)
     }
 }
 
+/** Whether blocks are synced with pnode through headers instead of getblocks/inv */
+static bool IsHeadersSyncPeer(const CNode* pnode)
+{
+    return Params().HeadersFirstSyncingActive() && pnode->nVersion >= HEADERS_FIRST_VERSION;
+}
+
+/**
+ * Whether a proof-of-stake header on top of pindexPrev is too far ahead of the
+ * active chain to be added before its block. Nothing but the timestamp of such
+ * a header can be checked, so they would otherwise come for free. Requires cs_main.
+ */
+static bool IsHeaderTooFarAhead(const CBlockIndex* pindexPrev)
+{
+    return pindexPrev->nHeight + 1 > Params().LAST_POW_BLOCK() &&
+           pindexPrev->nHeight + 1 > chainActive.Height() + MAX_HEADERS_AHEAD_OF_TIP;
+}
+
+/** Remember nodeid as the source of pindex if it is a proof-of-stake header without its block. Requires cs_main. */
+static void AddHeaderSource(NodeId nodeid, const CBlockIndex* pindex)
+{
+    if (pindex->nHeight <= Params().LAST_POW_BLOCK() || (pindex->nStatus & BLOCK_HAVE_DATA))
+        return;
+    if (!mapHeaderSource.insert(make_pair(pindex->GetBlockHash(), nodeid)).second)
+        return;
+    CNodeState* state = State(nodeid);
+    if (state)
+        state->nHeadersPending++;
+}
+
+/**
+ * The block of a header from mapHeaderSource was stored or found invalid. The
+ * peer that sent the header is punished for an invalid block, unless it also
+ * sent the block and is punished for that already. Requires cs_main.
+ */
+static void HeaderSourceBlockChecked(const uint256& hash, const CValidationState& state, NodeId nodeidBlock)
+{
+    map<uint256, NodeId>::iterator it = mapHeaderSource.find(hash);
+    if (it == mapHeaderSource.end())
+        return;
+    CNodeState* nodestate = State(it->second);
+    if (nodestate) {
+        nodestate->nHeadersPending--;
+        int nDoS = 0;
+        if (state.IsInvalid(nDoS) && nDoS > 0 && it->second != nodeidBlock)
+            Misbehaving(it->second, nDoS);
+    }
+    mapHeaderSource.erase(it);
+}
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb)
@@ -460,7 +566,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             if (pindex->nStatus & BLOCK_HAVE_DATA) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
-            } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
+            } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0 && setBlocksAwaitingParent.count(pindex->GetBlockHash()) == 0) {
                 // The block is not already downloaded, and not yet in flight.
                 if (pindex->nHeight > nWindowEnd) {
                     // We reached the end of the window.
@@ -502,6 +608,7 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
 
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
+    RegisterMessageHandlers(messageDispatcher);
     nodeSignals.GetHeight.connect(&GetHeight);
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
@@ -516,6 +623,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.SendMessages.disconnect(&SendMessages);
     nodeSignals.InitializeNode.disconnect(&InitializeNode);
     nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
+    messageDispatcher.Clear();
 }
 
 CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& locator)
@@ -536,6 +644,7 @@ CCoinsViewCache* pcoinsTip = NULL;
 CBlockTreeDB* pblocktree = NULL;
 CZerocoinDB* zerocoinDB = NULL;
 CSporkDB* pSporkDB = NULL;
+CBlockFilterDB* pblockfilterdb = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -833,6 +942,22 @@ int GetInputAge(CTxIn& vin)
     }
 }
 
+bool GetUnspentOutput(const COutPoint& outpoint, CTxOut& txoutRet, int& nHeightRet)
+{
+    // The callers fall back to their slow path rather than wait for the chain state
+    TRY_LOCK(cs_main, lockMain);
+    if (!lockMain)
+        return false;
+
+    const CCoins* coins = pcoinsTip->AccessCoins(outpoint.hash);
+    if (!coins || !coins->IsAvailable(outpoint.n))
+        return false;
+
+    txoutRet = coins->vout[outpoint.n];
+    nHeightRet = coins->nHeight;
+    return true;
+}
+
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
 {
     int sigs = 0;
@@ -950,6 +1075,29 @@ bool ContextualCheckZerocoinMint(const CTransaction& tx, const PublicCoin& coin,
     return true;
 }
 
+/**
+ * Whether pindex is the -assumevalid block or one of its ancestors, and that
+ * block is part of the best validated header chain we know of. Only then can
+ * script and zerocoin proof checks be skipped for it.
+ */
+static bool IsAssumedValid(const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    if (hashAssumeValid == 0 || pindex == NULL || pindexBestHeader == NULL)
+        return false;
+    BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+    if (it == mapBlockIndex.end())
+        return false; // header not known (yet)
+    const CBlockIndex* pindexAssumeValid = it->second;
+    if (pindexAssumeValid->GetAncestor(pindex->nHeight) != pindex)
+        return false;
+    // A proof-of-stake header alone costs nothing to make; only rely on the block
+    // once it has been received and its stake checked
+    if (pindexAssumeValid->nHeight > Params().LAST_POW_BLOCK() && !(pindexAssumeValid->nStatus & BLOCK_HAVE_DATA))
+        return false;
+    return pindexBestHeader->GetAncestor(pindexAssumeValid->nHeight) == pindexAssumeValid;
+}
+
 bool ContextualCheckZerocoinSpend(const CTransaction& tx, const CoinSpend& spend, CBlockIndex* pindex, const uint256& hashBlock)
 {
     //Check to see if the zGEA is properly signed
@@ -1062,7 +1210,7 @@ bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidati
     return fValidated;
 }
 
-bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state)
+bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state, bool fAssumeValid)
 {
     // Basic checks that don't depend on any context
     if (tx.vin.empty())
@@ -1123,8 +1271,9 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
                                      error("CheckTransaction() : zerocoinspend contains inputs that are not zerocoins"));
             }
 
-            // Do not require signature verification if this is initial sync and a block over 24 hours old
-            bool fVerifySignature = !IsInitialBlockDownload() && (GetTime() - chainActive.Tip()->GetBlockTime() < (60*60*24));
+            // Do not require signature verification if this is initial sync and a block over 24 hours old,
+            // or if the block is below -assumevalid
+            bool fVerifySignature = !fAssumeValid && !IsInitialBlockDownload() && (GetTime() - chainActive.Tip()->GetBlockTime() < (60*60*24));
             if (!CheckZerocoinSpend(tx, fVerifySignature, state))
                 return state.DoS(100, error("CheckTransaction() : invalid zerocoin spend"));
         }
@@ -1693,6 +1842,34 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
     return true;
 }
 
+/**
+ * Locate the serialized block stored at pos inside a memory mapping of its
+ * block file. The size of the block is stored in the four bytes preceding
+ * pos.nPos. On success [pbegin, pend) holds the block data, which stays valid
+ * for as long as the returned mapping is referenced. Returns NULL if the file
+ * cannot be mapped, in which case regular file I/O has to be used.
+ */
+static std::shared_ptr<const CMappedBlockFile> MapBlockData(const CDiskBlockPos& pos, const char*& pbegin, const char*& pend)
+{
+    std::shared_ptr<const CMappedBlockFile> file;
+    if (pos.IsNull() || pos.nPos < 4)
+        return file;
+    file = blockFileCache.Get(pos.nFile, pos.nPos);
+    if (!file)
+        return file;
+    unsigned int nSize = ReadLE32((const unsigned char*)file->begin() + pos.nPos - 4);
+    uint64_t nEnd = (uint64_t)pos.nPos + nSize;
+    if (nEnd > file->size()) {
+        // Block written after the file was mapped
+        file = blockFileCache.Get(pos.nFile, nEnd);
+        if (!file)
+            return file;
+    }
+    pbegin = file->begin() + pos.nPos;
+    pend = pbegin + nSize;
+    return file;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock, bool fAllowSlow)
 {
@@ -1708,16 +1885,30 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
                 CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (std::exception& e) {
-                    return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+                const char* pbegin;
+                const char* pend;
+                std::shared_ptr<const CMappedBlockFile> mapped = MapBlockData(postx, pbegin, pend);
+                if (mapped) {
+                    try {
+                        CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+                        reader >> header;
+                        reader.ignore(postx.nTxOffset);
+                        reader >> txOut;
+                    } catch (std::exception& e) {
+                        return error("%s : Deserialize error - %s", __func__, e.what());
+                    }
+                } else {
+                    CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                    if (file.IsNull())
+                        return error("%s: OpenBlockFile failed", __func__);
+                    try {
+                        file >> header;
+                        fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                        file >> txOut;
+                    } catch (std::exception& e) {
+                        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+                    }
                 }
                 hashBlock = header.GetHash();
                 if (txOut.GetHash() != hash)
@@ -1789,16 +1980,29 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
+    const char* pbegin;
+    const char* pend;
+    std::shared_ptr<const CMappedBlockFile> mapped = MapBlockData(pos, pbegin, pend);
+    if (mapped) {
+        // Deserialize straight from the mapped block file
+        try {
+            CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            reader >> block;
+        } catch (std::exception& e) {
+            return error("%s : Deserialize error - %s", __func__, e.what());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("ReadBlockFromDisk : OpenBlockFile failed");
 
-    // Read block
-    try {
-        filein >> block;
-    } catch (std::exception& e) {
-        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        // Read block
+        try {
+            filein >> block;
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
     }
 
     // Check the header
@@ -2420,8 +2624,10 @@ void static FlushBlockFile(bool fFinalize = false)
 
     FILE* fileOld = OpenBlockFile(posOld);
     if (fileOld) {
-        if (fFinalize)
+        if (fFinalize) {
             TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
+            blockFileCache.Invalidate(nLastBlockFile);
+        }
         FileCommit(fileOld);
         fclose(fileOld);
     }
@@ -2445,6 +2651,93 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
+/** Compute the filter of pindex and store it, returning its header in hashHeader */
+static bool IndexBlockFilter(const CBlockIndex* pindex, const uint256& hashPrevHeader, uint256& hashHeader)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex))
+        return error("%s : failed to read block %s", __func__, pindex->GetBlockHash().ToString());
+
+    // The genesis block spends nothing and has no undo data
+    CBlockUndo blockUndo;
+    if (pindex->pprev) {
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull() || !blockUndo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+            return error("%s : failed to read undo data of block %s", __func__, pindex->GetBlockHash().ToString());
+    }
+
+    CBlockFilter filter(block, blockUndo);
+    hashHeader = filter.ComputeHeader(hashPrevHeader);
+    if (!pblockfilterdb->WriteFilter(filter, hashHeader))
+        return error("%s : failed to write filter of block %s", __func__, pindex->GetBlockHash().ToString());
+    return true;
+}
+
+void ThreadBlockFilterIndex()
+{
+    RenameThread("gea-filterindex");
+
+    // The last block that was indexed and its filter header. Filters are
+    // stored by block hash, so after a reorg the index continues from the
+    // fork point without removing the filters of the disconnected blocks.
+    const CBlockIndex* pindexBest = NULL;
+    uint256 hashBestHeader;
+    {
+        uint256 hashBest;
+        LOCK(cs_main);
+        if (pblockfilterdb->ReadBestBlock(hashBest)) {
+            BlockMap::iterator mi = mapBlockIndex.find(hashBest);
+            if (mi != mapBlockIndex.end())
+                pindexBest = mi->second;
+        }
+    }
+
+    bool fUpToDate = false;
+    while (true) {
+        boost::this_thread::interruption_point();
+
+        const CBlockIndex* pindexNext = NULL;
+        {
+            LOCK(cs_main);
+            if (pindexBest && !chainActive.Contains(pindexBest)) {
+                pindexBest = chainActive.FindFork(pindexBest);
+                hashBestHeader.SetNull();
+            }
+            pindexNext = pindexBest ? chainActive.Next(pindexBest) : chainActive.Genesis();
+        }
+
+        if (pindexBest && hashBestHeader.IsNull()) {
+            uint256 hashFilter;
+            if (!pblockfilterdb->ReadFilterHashes(pindexBest->GetBlockHash(), hashFilter, hashBestHeader)) {
+                LogPrintf("%s : filter of block %s is missing, rebuilding the index\n", __func__, pindexBest->GetBlockHash().ToString());
+                pindexBest = NULL;
+                continue;
+            }
+        }
+
+        if (!pindexNext) {
+            if (!fUpToDate && pindexBest) {
+                LogPrintf("Block filter index is up to date at height %d\n", pindexBest->nHeight);
+                fUpToDate = true;
+            }
+            MilliSleep(1000);
+            continue;
+        }
+
+        uint256 hashHeader;
+        if (!IndexBlockFilter(pindexNext, pindexBest ? hashBestHeader : uint256(), hashHeader)) {
+            // Try again later, e.g. when the block was not flushed to disk yet
+            MilliSleep(10000);
+            continue;
+        }
+        pindexBest = pindexNext;
+        hashBestHeader = hashHeader;
+
+        if (pindexBest->nHeight % 10000 == 0)
+            LogPrint("filterindex", "Block filter index at height %d\n", pindexBest->nHeight);
+    }
+}
+
 void RecalculateZGEAMinted()
 {
     CBlockIndex *pindex = chainActive[Params().Zerocoin_StartHeight()];
@@ -2726,6 +3019,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             REJECT_INVALID, "PoW-ended");
 
     bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    bool fAssumeValid = fScriptChecks && !fJustCheck && IsAssumedValid(pindex);
+    if (fAssumeValid)
+        fScriptChecks = false;
+    int nSkippedInputs = 0;
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -2865,6 +3162,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 nFees += view.GetValueIn(tx) - tx.GetValueOut();
             nValueIn += view.GetValueIn(tx);
 
+            if (fAssumeValid)
+                nSkippedInputs += tx.vin.size();
+
             std::vector<CScriptCheck> vChecks;
             unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
             if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
@@ -2883,6 +3183,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
 
+    if (fAssumeValid) {
+        assumeValidStats.nBlocks++;
+        assumeValidStats.nInputs += nSkippedInputs;
+        assumeValidStats.nZerocoinSpends += vSpends.size();
+        LogPrint("bench", "    - Assumed valid: skipped %d script and %u zerocoin proof checks\n", nSkippedInputs, vSpends.size());
+    }
+
     //A one-time event where money supply counts were off and recalculated on a certain block.
     if (pindex->nHeight == Params().Zerocoin_Block_RecalculateAccumulators() + 1) {
         RecalculateZGEAMinted();
@@ -3051,7 +3358,7 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
     static int64_t nLastWrite = 0;
     try {
         if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) ||
             (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
             // Typical CCoins structures on disk are around 100 bytes in size.
             // Pushing a new one to the database can cause it to be written
@@ -3115,10 +3422,10 @@ void static UpdateTip(CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -3536,12 +3843,30 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
             // Relay inventory, but don't relay old inventory during initial block download.
+            // Peers in compact block high-bandwidth mode get the block itself right away.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
             {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH (CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                LOCK2(cs_main, cs_vNodes);
+                CInv inv(MSG_BLOCK, hashNewTip);
+                std::shared_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    CNodeState* nodestate = State(pnode->GetId());
+                    if (pblock && pblock->GetHash() == hashNewTip && nodestate && nodestate->fPreferHeaderAndIDs) {
+                        {
+                            LOCK(pnode->cs_inventory);
+                            if (pnode->setInventoryKnown.count(inv))
+                                continue;
+                        }
+                        if (!pcmpctblock)
+                            pcmpctblock = std::make_shared<CBlockHeaderAndShortTxIDs>(*pblock);
+                        pnode->PushMessage("cmpctblock", *pcmpctblock);
+                        pnode->AddInventoryKnown(inv);
+                    } else {
+                        pnode->PushInventory(inv);
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             // Note: uiInterface, should switch main signals.
@@ -3664,6 +3989,12 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
         pindexNew->BuildSkip();
 
+        // Headers-first sync adds blocks before their transactions are known. Every
+        // block after the last PoW block is PoS, and the stake modifiers of its
+        // descendants depend on that flag.
+        if (block.vtx.empty() && pindexNew->nHeight > Params().LAST_POW_BLOCK())
+            pindexNew->SetProofOfStake();
+
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
 
@@ -3675,7 +4006,7 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
             LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
 
         // ppcoin: record proof-of-stake hash value
-        if (pindexNew->IsProofOfStake()) {
+        if (pindexNew->IsProofOfStake() && !block.vtx.empty()) {
             if (!mapProofOfStake.count(hash))
                 LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
             pindexNew->hashProofOfStake = mapProofOfStake[hash];
@@ -3688,12 +4019,14 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
             LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
         pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
         pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
-        if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
+        if (!block.vtx.empty() && !CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
             LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, boost::lexical_cast<std::string>(nStakeModifier));
     }
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
-    if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
+    // The work of a proof-of-stake header only counts once its block has been checked
+    if ((!block.vtx.empty() || pindexNew->nHeight <= Params().LAST_POW_BLOCK()) &&
+        (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork))
         pindexBestHeader = pindexNew;
 
     //update previous block pointer
@@ -3708,10 +4041,27 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
 bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBlockIndex* pindexNew, const CDiskBlockPos& pos)
 {
-    if (block.IsProofOfStake())
+    if (block.IsProofOfStake()) {
         pindexNew->SetProofOfStake();
+
+        // Entries added from a header during headers-first sync get their stake now
+        if (pindexNew->prevoutStake.IsNull()) {
+            pindexNew->prevoutStake = block.vtx[1].vin[0].prevout;
+            pindexNew->nStakeTime = block.nTime;
+            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            if (mapProofOfStake.count(pindexNew->GetBlockHash()))
+                pindexNew->hashProofOfStake = mapProofOfStake[pindexNew->GetBlockHash()];
+            if (pindexNew->pprev) {
+                pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
+                if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
+                    LogPrintf("%s : Rejected by stake modifier checkpoint height=%d\n", __func__, pindexNew->nHeight);
+            }
+        }
+    }
     pindexNew->nTx = block.vtx.size();
     pindexNew->nChainTx = 0;
+    if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
+        pindexBestHeader = pindexNew;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
     pindexNew->nUndoPos = 0;
@@ -3968,11 +4318,19 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         }
     }
 
+    // Zerocoin proofs can only be skipped for blocks whose header is already known
+    bool fAssumeValid = false;
+    if (hashAssumeValid != 0) {
+        LOCK(cs_main);
+        BlockMap::const_iterator mi = mapBlockIndex.find(block.GetHash());
+        fAssumeValid = mi != mapBlockIndex.end() && IsAssumedValid(mi->second);
+    }
+
     // Check transactions
     bool fZerocoinActive = block.GetBlockTime() > Params().Zerocoin_StartTime();
     vector<CBigNum> vBlockSerials;
     for (const CTransaction& tx : block.vtx) {
-        if (!CheckTransaction(tx, fZerocoinActive, chainActive.Height() + 1 >= Params().Zerocoin_Block_EnforceSerialRange(), state))
+        if (!CheckTransaction(tx, fZerocoinActive, chainActive.Height() + 1 >= Params().Zerocoin_Block_EnforceSerialRange(), state, fAssumeValid))
             return error("CheckBlock() : CheckTransaction failed");
 
         // double check that there are no double spent zGEA spends in this block
@@ -4178,6 +4536,19 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
                              REJECT_INVALID, "bad-prevblk");
         }
 
+        // Headers arrive without the coinstake, so check what the height alone tells about
+        // the block: up to the last PoW block it must carry valid proof of work, and after
+        // it the tighter PoS timestamp drift applies.
+        bool fProofOfStake = pindexPrev->nHeight + 1 > Params().LAST_POW_BLOCK();
+        if (!fProofOfStake && !CheckProofOfWork(hash, block.nBits))
+            return state.DoS(50, error("%s : proof of work failed", __func__),
+                REJECT_INVALID, "high-hash");
+        if (block.GetBlockTime() > GetAdjustedTime() + (fProofOfStake ? 180 : 7200))
+            return state.Invalid(error("%s : block timestamp too far in the future", __func__),
+                REJECT_INVALID, "time-too-new");
+        if (block.vtx.empty() && IsHeaderTooFarAhead(pindexPrev))
+            return state.Invalid(error("%s : header %s too far ahead of the active chain", __func__, hash.ToString()),
+                0, "too-far-ahead");
     }
 
     if (!ContextualCheckBlockHeader(block, state, pindexPrev))
@@ -4395,9 +4766,14 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
 
     if (pblock->GetHash() != Params().HashGenesisBlock() && pfrom != NULL) {
         //if we get this far, check if the prev block is our prev block, if not then request sync and return false
+        LOCK(cs_main);
         BlockMap::iterator mi = mapBlockIndex.find(pblock->hashPrevBlock);
         if (mi == mapBlockIndex.end()) {
-            pfrom->PushMessage("getblocks", chainActive.GetLocator(), uint256(0));
+            MarkBlockAsReceived(pblock->GetHash());
+            if (IsHeadersSyncPeer(pfrom))
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), pblock->GetHash());
+            else
+                pfrom->PushMessage("getblocks", chainActive.GetLocator(), uint256(0));
             return false;
         }
     }
@@ -4406,7 +4782,12 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
         LOCK(cs_main);   // Replaces the former TRY_LOCK loop because busy waiting wastes too much resources
 
         MarkBlockAsReceived (pblock->GetHash ());
+        // Held blocks are processed without pfrom, but their source is known
+        std::map<uint256, NodeId>::iterator itSource = mapBlockSource.find(pblock->GetHash());
+        NodeId nodeidBlock = pfrom ? pfrom->GetId() : (itSource != mapBlockSource.end() ? itSource->second : -1);
         if (!checked) {
+            if (!state.CorruptionPossible())
+                HeaderSourceBlockChecked(pblock->GetHash(), state, nodeidBlock);
             return error ("%s : CheckBlock FAILED for block %s", __func__, pblock->GetHash().GetHex());
         }
 
@@ -4416,6 +4797,8 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
         if (pindex && pfrom) {
             mapBlockSource[pindex->GetBlockHash ()] = pfrom->GetId ();
         }
+        if (ret || (state.IsInvalid() && !state.CorruptionPossible()))
+            HeaderSourceBlockChecked(pblock->GetHash(), state, nodeidBlock);
         CheckBlockIndex ();
         if (!ret)
             return error ("%s : AcceptBlock FAILED", __func__);
@@ -4594,7 +4977,8 @@ bool static LoadBlockIndexDB(string& strError)
             pindexBestInvalid = pindex;
         if (pindex->pprev)
             pindex->BuildSkip();
-        if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
+        if (pindex->IsValid(BLOCK_VALID_TREE) && (pindex->nHeight <= Params().LAST_POW_BLOCK() || (pindex->nStatus & BLOCK_HAVE_DATA)) &&
+            (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
 
@@ -4714,7 +5098,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -4810,94 +5194,84 @@ bool InitBlockIndex()
 
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    // Map of blocks with unknown parent (only used for reindex). The block
+    // itself is kept in memory while that fits in MAX_UNKNOWN_PARENT_BYTES,
+    // otherwise it is read back from disk once its parent is known.
+    static std::multimap<uint256, std::pair<CDiskBlockPos, std::shared_ptr<CBlock> > > mapBlocksUnknownParent;
+    static size_t nUnknownParentBytes = 0;
+    static const size_t MAX_UNKNOWN_PARENT_BYTES = 32 * 1024 * 1024;
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        // This takes over fileIn and closes it when done
+        int nWorkers = std::max(1, std::min((int)boost::thread::hardware_concurrency() - 1, MAX_IMPORT_WORKER_THREADS));
+        CBlockFileImporter importer(fileIn, nWorkers);
+        CImportedBlock imported;
+        while (importer.Next(imported)) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++;         // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
-            }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                        block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
+            if (dbp)
+                dbp->nPos = imported.nPos;
+            CBlock& block = *imported.pblock;
+
+            // detect out of order blocks, and store them for later
+            const uint256& hash = imported.hash;
+            if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+                LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                    block.hashPrevBlock.ToString());
+                if (dbp) {
+                    std::shared_ptr<CBlock> pblock;
+                    size_t nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+                    if (nUnknownParentBytes + nBlockSize <= MAX_UNKNOWN_PARENT_BYTES) {
+                        pblock = imported.pblock;
+                        nUnknownParentBytes += nBlockSize;
+                    }
+                    mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, std::make_pair(*dbp, pblock)));
                 }
+                continue;
+            }
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
+            // process in case the block isn't known yet
+            if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                CValidationState state;
+                if (ProcessNewBlock(state, NULL, &block, dbp))
+                    nLoaded++;
+                if (state.IsError())
+                    break;
+            } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+                LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+            }
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second)) {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, NULL, &block, &it->second)) {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
+            // Recursively process earlier encountered successors of this block
+            deque<uint256> queue;
+            queue.push_back(hash);
+            while (!queue.empty()) {
+                uint256 head = queue.front();
+                queue.pop_front();
+                std::pair<std::multimap<uint256, std::pair<CDiskBlockPos, std::shared_ptr<CBlock> > >::iterator, std::multimap<uint256, std::pair<CDiskBlockPos, std::shared_ptr<CBlock> > >::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                while (range.first != range.second) {
+                    std::multimap<uint256, std::pair<CDiskBlockPos, std::shared_ptr<CBlock> > >::iterator it = range.first;
+                    std::shared_ptr<CBlock> pchild = it->second.second;
+                    if (pchild) {
+                        nUnknownParentBytes -= ::GetSerializeSize(*pchild, SER_DISK, CLIENT_VERSION);
+                    } else {
+                        pchild.reset(new CBlock());
+                        if (!ReadBlockFromDisk(*pchild, it->second.first))
+                            pchild.reset();
+                    }
+                    if (pchild) {
+                        LogPrintf("%s: Processing out of order child %s of %s\n", __func__, pchild->GetHash().ToString(),
+                            head.ToString());
+                        CValidationState dummy;
+                        if (ProcessNewBlock(dummy, NULL, pchild.get(), &it->second.first)) {
+                            nLoaded++;
+                            queue.push_back(pchild->GetHash());
                         }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
                     }
+                    range.first++;
+                    mapBlocksUnknownParent.erase(it);
                 }
-            } catch (std::exception& e) {
-                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
         }
     } catch (std::runtime_error& e) {
@@ -5109,6 +5483,9 @@ string GetWarnings(string strFor)
 //
 
 
+/** Blocks and transactions from peers waiting for the validation thread */
+static CValidationQueue validationQueue;
+
 bool static AlreadyHave(const CInv& inv)
 {
     switch (inv.type) {
@@ -5116,12 +5493,12 @@ bool static AlreadyHave(const CInv& inv)
         bool txInMap = false;
         txInMap = mempool.exists(inv.hash);
         return txInMap || mapOrphanTransactions.count(inv.hash) ||
-               pcoinsTip->HaveCoins(inv.hash);
+               pcoinsTip->HaveCoins(inv.hash) || validationQueue.Contains(inv.hash);
     }
     case MSG_DSTX:
-        return mapObfuscationBroadcastTxes.count(inv.hash);
+        return mapObfuscationBroadcastTxes.count(inv.hash) || validationQueue.Contains(inv.hash);
     case MSG_BLOCK:
-        return mapBlockIndex.count(inv.hash);
+        return mapBlockIndex.count(inv.hash) || validationQueue.Contains(inv.hash);
     case MSG_TXLOCK_REQUEST:
         return mapTxLockReq.count(inv.hash) ||
                mapTxLockReqRejected.count(inv.hash);
@@ -5173,6 +5550,37 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/**
+ * Send the block at pindex to pfrom by copying its on-disk serialization into
+ * the send buffer, instead of deserializing it into a CBlock and serializing
+ * it again. Returns false if the raw data is not available, in which case the
+ * caller has to fall back to ReadBlockFromDisk.
+ */
+static bool PushRawBlock(CNode* pfrom, const CBlockIndex* pindex)
+{
+    const char* pbegin;
+    const char* pend;
+    std::shared_ptr<const CMappedBlockFile> mapped = MapBlockData(pindex->GetBlockPos(), pbegin, pend);
+    if (!mapped)
+        return false;
+
+    // Cheap check that the data on disk is the block we indexed; hashing the
+    // header would cost as much as the deserialization we are avoiding.
+    CBlockHeader header;
+    try {
+        CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+        reader >> header;
+    } catch (std::exception& e) {
+        return false;
+    }
+    if (header.hashMerkleRoot != pindex->hashMerkleRoot || header.nTime != pindex->nTime ||
+        header.nBits != pindex->nBits || header.nNonce != pindex->nNonce)
+        return false;
+
+    pfrom->PushMessageRaw("block", pbegin, pend);
+    return true;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -5191,7 +5599,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end()) {
@@ -5212,11 +5620,19 @@ void static ProcessGetData(CNode* pfrom)
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
                     // Send block from disk
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
+                    if (inv.type == MSG_BLOCK && PushRawBlock(pfrom, mi->second)) {
+                        // Sent straight from the mapped block file
+                    } else if (!ReadBlockFromDisk(block, (*mi).second)) {
                         assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
+                    } else if (inv.type == MSG_BLOCK) {
                         pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    } else if (inv.type == MSG_CMPCT_BLOCK) {
+                        // The peer is unlikely to have the transactions of older blocks in its mempool
+                        if (chainActive.Height() - mi->second->nHeight <= MAX_CMPCTBLOCK_DEPTH)
+                            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                        else
+                            pfrom->PushMessage("block", block);
+                    } else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
@@ -5386,7 +5802,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -5405,850 +5821,1467 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
-bool fRequestedSporksIDB = false;
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+void ThreadValidation()
 {
-    RandAddSeedPerfmon();
-    LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
-    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0) {
-        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
-        return true;
-    }
-
-    if (strCommand == "version") {
-        // Each connection can only send one version message
-        if (pfrom->nVersion != 0) {
-            pfrom->PushMessage("reject", strCommand, REJECT_DUPLICATE, string("Duplicate version message"));
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 1);
-            return false;
-        }
+    validationQueue.Thread();
+}
 
-        // GEA: We use certain sporks during IBD, so check to see if they are
-        // available. If not, ask the first peer connected for them.
-        bool fMissingSporks = !pSporkDB->SporkExists(SPORK_14_NEW_PROTOCOL_ENFORCEMENT) &&
-                !pSporkDB->SporkExists(SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2) &&
-                !pSporkDB->SporkExists(SPORK_16_ZEROCOIN_MAINTENANCE_MODE);
+static void ReleaseNodeRef(CNode* pnode)
+{
+    LOCK(cs_vNodes);
+    pnode->Release();
+}
 
-        if (fMissingSporks || !fRequestedSporksIDB){
-            LogPrintf("asking peer for sporks\n");
-            pfrom->PushMessage("getsporks");
-            fRequestedSporksIDB = true;
-        }
+/**
+ * Run fnValidate for the block or transaction hash, received in a message of
+ * nSize bytes from pfrom, on the validation thread, keeping pfrom alive until then.
+ */
+static void QueueValidation(CNode* pfrom, const uint256& hash, const CValidationQueue::Callback& fnValidate, size_t nSize)
+{
+    {
+        LOCK(cs_vNodes);
+        pfrom->AddRef();
+    }
+    validationQueue.Push(hash, fnValidate, boost::bind(&ReleaseNodeRef, pfrom), nSize);
+}
 
-        int64_t nTime;
-        CAddress addrMe;
-        CAddress addrFrom;
-        uint64_t nNonce = 1;
-        vRecv >> pfrom->nVersion >> pfrom->nServices >> nTime >> addrMe;
-        if (pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand))
-            return false;
+/** Messages whose handling goes through the validation queue */
+static bool IsValidationCommand(const std::string& strCommand)
+{
+    return strCommand == "block" || strCommand == "tx" || strCommand == "dstx" || strCommand == "cmpctblock" || strCommand == "blocktxn";
+}
 
-        if (pfrom->nVersion == 10300)
-            pfrom->nVersion = 300;
-        if (!vRecv.empty())
-            vRecv >> addrFrom >> nNonce;
-        if (!vRecv.empty()) {
-            vRecv >> LIMITED_STRING(pfrom->strSubVer, 256);
-            pfrom->cleanSubVer = SanitizeString(pfrom->strSubVer);
-        }
-        if (!vRecv.empty())
-            vRecv >> pfrom->nStartingHeight;
-        if (!vRecv.empty())
-            vRecv >> pfrom->fRelayTxes; // set to true after we get the first filter* message
-        else
-            pfrom->fRelayTxes = true;
+/** Masternodes and stakers want new blocks as soon as possible, to build on the right tip. */
+static bool WantsHighBandwidthCompactBlocks()
+{
+    return fMasterNode || nLastCoinStakeSearchInterval != 0;
+}
 
-        // Disconnect if we connected to ourself
-        if (nNonce == nLocalHostNonce && nNonce > 1) {
-            LogPrintf("connected to self at %s, disconnecting\n", pfrom->addr.ToString());
-            pfrom->fDisconnect = true;
-            return true;
-        }
+/**
+ * Ask pfrom, which just gave us a new best block, to push its next blocks to
+ * us as cmpctblock messages without an inv/getdata round trip. Only the
+ * MAX_CMPCTBLOCK_HB_PEERS peers that most recently did so stay in this
+ * high-bandwidth mode. Requires cs_main.
+ */
+static void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom)
+{
+    if (!WantsHighBandwidthCompactBlocks() || !State(pfrom->GetId())->fProvidesHeaderAndIDs)
+        return;
 
-        pfrom->addrLocal = addrMe;
-        if (pfrom->fInbound && addrMe.IsRoutable()) {
-            SeenLocal(addrMe);
+    NodeId nodeid = pfrom->GetId();
+    for (list<NodeId>::iterator it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); ++it) {
+        if (*it == nodeid) {
+            lNodesAnnouncingHeaderAndIDs.erase(it);
+            lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
+            return;
         }
+    }
 
-        // Be shy and don't send version until we hear
-        if (pfrom->fInbound)
-            pfrom->PushVersion();
-
-        pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
-
-        // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
-
-        // Change version
-        pfrom->PushMessage("verack");
-        pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
-
-        if (!pfrom->fInbound) {
-            // Advertise our address
-            if (fListen && !IsInitialBlockDownload()) {
-                CAddress addr = GetLocalAddress(&pfrom->addr);
-                if (addr.IsRoutable()) {
-                    LogPrintf("ProcessMessages: advertizing address %s\n", addr.ToString());
-                    pfrom->PushAddress(addr);
-                } else if (IsPeerAddrLocalGood(pfrom)) {
-                    addr.SetIP(pfrom->addrLocal);
-                    LogPrintf("ProcessMessages: advertizing address %s\n", addr.ToString());
-                    pfrom->PushAddress(addr);
-                }
-            }
-
-            // Get recent addresses
-            if (pfrom->fOneShot || pfrom->nVersion >= CADDR_TIME_VERSION || addrman.size() < 1000) {
-                pfrom->PushMessage("getaddr");
-                pfrom->fGetAddr = true;
-            }
-            addrman.Good(pfrom->addr);
-        } else {
-            if (((CNetAddr)pfrom->addr) == (CNetAddr)addrFrom) {
-                addrman.Add(addrFrom, addrFrom);
-                addrman.Good(addrFrom);
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_HB_PEERS) {
+        NodeId nodeOldest = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeOldest) {
+                pnode->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+                break;
             }
         }
+    }
+    pfrom->PushMessage("sendcmpct", true, CMPCTBLOCKS_VERSION);
+    lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
+}
 
-        // Relay alerts
-        {
-            LOCK(cs_mapAlerts);
-            BOOST_FOREACH (PAIRTYPE(const uint256, CAlert) & item, mapAlerts)
-                item.second.RelayTo(pfrom);
-        }
+/** Validate a block received from a peer. pfrom is NULL for blocks that were held back. */
+static void ProcessBlockFromPeer(CNode* pfrom, NodeId nodeid, CBlock& block)
+{
+    if (pfrom == NULL) {
+        LOCK(cs_main);
+        mapBlockSource[block.GetHash()] = nodeid;
+    }
 
-        pfrom->fSuccessfullyConnected = true;
+    CValidationState state;
+    if (ProcessNewBlock(state, pfrom, &block) && pfrom) {
+        LOCK(cs_main);
+        if (chainActive.Tip()->GetBlockHash() == block.GetHash())
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
+    }
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        if (pfrom)
+            pfrom->PushMessage("reject", string("block"), state.GetRejectCode(),
+                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain) Misbehaving(nodeid, nDoS);
+        }
+    }
+}
 
-        string remoteAddr;
-        if (fLogIPs)
-            remoteAddr = ", peeraddr=" + pfrom->addr.ToString();
+/**
+ * Blocks downloaded in parallel arrive out of order. Keep a block whose
+ * ancestors are not all there yet in memory until they are; returns false if
+ * the block can be processed right away.
+ */
+static bool HoldBlockForParent(NodeId nodeid, const CBlock& block)
+{
+    LOCK(cs_main);
 
-        LogPrintf("receive version message: %s: version %d, blocks=%d, us=%s, peer=%d%s\n",
-            pfrom->cleanSubVer, pfrom->nVersion,
-            pfrom->nStartingHeight, addrMe.ToString(), pfrom->id,
-            remoteAddr);
+    // The request is answered whether the block is held or processed right away
+    uint256 hash = block.GetHash();
+    MarkBlockAsReceived(hash);
 
-        int64_t nTimeOffset = nTime - GetTime();
-        pfrom->nTimeOffset = nTimeOffset;
-        AddTimeData(pfrom->addr, nTimeOffset);
-    }
+    BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+    if (mi == mapBlockIndex.end() || mi->second->nChainTx != 0 || (mi->second->nStatus & BLOCK_FAILED_MASK))
+        return false;
+    // Only blocks whose header we have validated, i.e. that we asked for
+    if (!mapBlockIndex.count(hash))
+        return false;
 
+    if (setBlocksAwaitingParent.count(hash))
+        return true;
 
-    else if (pfrom->nVersion == 0) {
-        // Must have a version message before anything else
-        LOCK(cs_main);
-        Misbehaving(pfrom->GetId(), 1);
-        return false;
+    size_t nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    if (nBlocksAwaitingParentSize + nSize > MAX_BLOCKS_AWAITING_PARENT_SIZE) {
+        // Dropped blocks are downloaded again once the window gets to them
+        LogPrint("net", "%s : no room for block %s, dropping it\n", __func__, hash.ToString());
+        return true;
     }
 
+    HeldBlock held = {nodeid, std::make_shared<CBlock>(block), nSize};
+    mapBlocksAwaitingParent.insert(make_pair(block.hashPrevBlock, held));
+    setBlocksAwaitingParent.insert(hash);
+    nBlocksAwaitingParentSize += nSize;
+    LogPrint("net", "%s : holding block %s until its parent arrives\n", __func__, hash.ToString());
+    return true;
+}
 
-    else if (strCommand == "verack") {
-        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
-
-        // Mark this node as currently connected, so we update its timestamp later.
-        if (pfrom->fNetworkNode) {
+/** Process the held blocks whose parent has been connected to the block tree or found invalid. */
+static void ProcessBlocksAwaitingParent()
+{
+    while (true) {
+        std::vector<HeldBlock> vReady;
+        {
             LOCK(cs_main);
-            State(pfrom->GetId())->fCurrentlyConnected = true;
+            multimap<uint256, HeldBlock>::iterator it = mapBlocksAwaitingParent.begin();
+            while (it != mapBlocksAwaitingParent.end()) {
+                BlockMap::iterator mi = mapBlockIndex.find(it->first);
+                if (mi == mapBlockIndex.end() || (mi->second->nChainTx == 0 && !(mi->second->nStatus & BLOCK_FAILED_MASK))) {
+                    ++it;
+                    continue;
+                }
+                setBlocksAwaitingParent.erase(it->second.pblock->GetHash());
+                nBlocksAwaitingParentSize -= it->second.nSize;
+                vReady.push_back(it->second);
+                mapBlocksAwaitingParent.erase(it++);
+            }
         }
+        if (vReady.empty())
+            return;
+
+        BOOST_FOREACH (HeldBlock& held, vReady)
+            ProcessBlockFromPeer(NULL, held.nodeid, *held.pblock);
     }
+}
 
+/** Validate a block reconstructed from a compact block sent by pfrom, on the validation thread. */
+static void ProcessReconstructedBlock(CNode* pfrom, std::shared_ptr<CBlock> pblock)
+{
+    ProcessBlockFromPeer(pfrom, pfrom->GetId(), *pblock);
+    ProcessBlocksAwaitingParent();
+}
 
-    else if (strCommand == "addr") {
-        vector<CAddress> vAddr;
-        vRecv >> vAddr;
+/** Drop the compact block a peer is reconstructing, so that the block is downloaded normally. Requires cs_main. */
+static void ResetPartialBlock(NodeId nodeid, CNodeState* nodestate)
+{
+    if (!nodestate->partialBlock)
+        return;
+    uint256 hash = nodestate->partialBlock->header.GetHash();
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid)
+        MarkBlockAsReceived(hash);
+    nodestate->partialBlock.reset();
+}
 
-        // Don't want addr from older versions unless seeding
-        if (pfrom->nVersion < CADDR_TIME_VERSION && addrman.size() > 1000)
-            return true;
-        if (vAddr.size() > 1000) {
+/** Handle a "block" message on the validation thread. */
+static void ProcessBlockMessage(CNode* pfrom, std::shared_ptr<CBlock> pblock)
+{
+    CBlock& block = *pblock;
+    uint256 hashBlock = block.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+
+    //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
+    bool fHavePrev;
+    {
+        LOCK(cs_main);
+        fHavePrev = mapBlockIndex.count(block.hashPrevBlock);
+        if (!fHavePrev) {
+            MarkBlockAsReceived(hashBlock);
+            if (IsHeadersSyncPeer(pfrom)) {
+                // Fetch the headers leading up to it, after which it is downloaded again
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), hashBlock);
+            } else if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
+                //we already asked for this block, so lets work backwards and ask for the previous block
+                pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
+                pfrom->vBlockRequested.push_back(block.hashPrevBlock);
+            } else {
+                //ask to sync to this block
+                pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
+                pfrom->vBlockRequested.push_back(hashBlock);
+            }
+        }
+    }
+    if (fHavePrev) {
+        pfrom->AddInventoryKnown(inv);
+
+        // With headers-first sync the index entry exists before the block data does
+        bool fHaveData;
+        {
             LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 20);
-            return error("message addr size() = %u", vAddr.size());
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            fHaveData = mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA);
+        }
+        if (fHaveData) {
+            LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, hashBlock.GetHex());
+        } else if (!HoldBlockForParent(pfrom->GetId(), block)) {
+            ProcessBlockFromPeer(pfrom, pfrom->GetId(), block);
+            //disconnect this node if its old protocol version
+            pfrom->DisconnectOldProtocol(ActiveProtocol(), "block");
         }
+        ProcessBlocksAwaitingParent();
+    }
+}
 
-        // Store the new addresses
-        vector<CAddress> vAddrOk;
-        int64_t nNow = GetAdjustedTime();
-        int64_t nSince = nNow - 10 * 60;
-        BOOST_FOREACH (CAddress& addr, vAddr) {
-            boost::this_thread::interruption_point();
+/** Handle a "tx" or "dstx" message on the validation thread. */
+static void ProcessTransactionMessage(CNode* pfrom, const std::string& strCommand, const CTransaction& tx, bool ignoreFees)
+{
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    CInv inv(MSG_TX, tx.GetHash());
 
-            if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60)
-                addr.nTime = nNow - 5 * 24 * 60 * 60;
-            pfrom->AddAddressKnown(addr);
-            bool fReachable = IsReachable(addr);
-            if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable()) {
-                // Relay to a limited number of other nodes
-                {
-                    LOCK(cs_vNodes);
-                    // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint64_t hashAddr = addr.GetHash();
-                    uint256 hashRand = hashSalt ^ (hashAddr << 32) ^ ((GetTime() + hashAddr) / (24 * 60 * 60));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    multimap<uint256, CNode*> mapMix;
-                    BOOST_FOREACH (CNode* pnode, vNodes) {
-                        if (pnode->nVersion < CADDR_TIME_VERSION)
-                            continue;
-                        unsigned int nPointer;
-                        memcpy(&nPointer, &pnode, sizeof(nPointer));
-                        uint256 hashKey = hashRand ^ nPointer;
-                        hashKey = Hash(BEGIN(hashKey), END(hashKey));
-                        mapMix.insert(make_pair(hashKey, pnode));
+    LOCK(cs_main);
+
+    bool fMissingInputs = false;
+    bool fMissingZerocoinInputs = false;
+    CValidationState state;
+
+    mapAlreadyAskedFor.erase(inv);
+
+    if (!tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees)) {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+        vWorkQueue.push_back(inv.hash);
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
+                 pfrom->id, pfrom->cleanSubVer,
+                 tx.GetHash().ToString(),
+                 mempool.mapTx.size());
+
+        // Recursively process any orphan transactions that depended on this one
+        set<NodeId> setMisbehaving;
+        for(unsigned int i = 0; i < vWorkQueue.size(); i++) {
+            map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
+            if(itByPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            for(set<uint256>::iterator mi = itByPrev->second.begin();
+                mi != itByPrev->second.end();
+                ++mi) {
+                const uint256 &orphanHash = *mi;
+                const CTransaction &orphanTx = mapOrphanTransactions[orphanHash].tx;
+                NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
+
+
+                if(setMisbehaving.count(fromPeer))
+                    continue;
+                if(AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx);
+                    vWorkQueue.push_back(orphanHash);
+                    vEraseQueue.push_back(orphanHash);
+                } else if(!fMissingInputs2) {
+                    int nDos = 0;
+                    if(stateDummy.IsInvalid(nDos) && nDos > 0) {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
                     }
-                    int nRelayNodes = fReachable ? 2 : 1; // limited relaying of addresses outside our network(s)
-                    for (multimap<uint256, CNode*>::iterator mi = mapMix.begin(); mi != mapMix.end() && nRelayNodes-- > 0; ++mi)
-                        ((*mi).second)->PushAddress(addr);
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee/priority
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                    vEraseQueue.push_back(orphanHash);
                 }
+                mempool.check(pcoinsTip);
             }
-            // Do not store addresses outside our network
-            if (fReachable)
-                vAddrOk.push_back(addr);
         }
-        addrman.Add(vAddrOk, pfrom->addr, 2 * 60 * 60);
-        if (vAddr.size() < 1000)
-            pfrom->fGetAddr = false;
-        if (pfrom->fOneShot)
-            pfrom->fDisconnect = true;
+
+        BOOST_FOREACH (uint256 hash, vEraseQueue)EraseOrphanTx(hash);
+    } else if (tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingZerocoinInputs, false, ignoreFees)) {
+        //Presstab: ZCoin has a bunch of code commented out here. Is this something that should have more going on?
+        //Also there is nothing that handles fMissingZerocoinInputs. Does there need to be?
+        RelayTransaction(tx);
+        LogPrint("mempool", "AcceptToMemoryPool: Zerocoinspend peer=%d %s : accepted %s (poolsz %u)\n",
+                 pfrom->id, pfrom->cleanSubVer,
+                 tx.GetHash().ToString(),
+                 mempool.mapTx.size());
+    } else if (fMissingInputs) {
+        AddOrphanTx(tx, pfrom->GetId());
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    } else if (pfrom->fWhitelisted) {
+        // Always relay transactions received from whitelisted peers, even
+        // if they are already in the mempool (allowing the node to function
+        // as a gateway for nodes hidden behind it).
+
+        RelayTransaction(tx);
     }
 
+    if (strCommand == "dstx") {
+        CInv inv(MSG_DSTX, tx.GetHash());
+        RelayInv(inv);
+    }
 
-    else if (strCommand == "inv") {
-        vector<CInv> vInv;
-        vRecv >> vInv;
-        if (vInv.size() > MAX_INV_SZ) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 20);
-            return error("message inv size() = %u", vInv.size());
-        }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS)) {
+        LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+            state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
 
+bool fRequestedSporksIDB = false;
+static bool ProcessMessageVersion(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Each connection can only send one version message
+    if (pfrom->nVersion != 0) {
+        pfrom->PushMessage("reject", strCommand, REJECT_DUPLICATE, string("Duplicate version message"));
         LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 1);
+        return false;
+    }
 
-        std::vector<CInv> vToFetch;
+    // GEA: We use certain sporks during IBD, so check to see if they are
+    // available. If not, ask the first peer connected for them.
+    bool fMissingSporks = !pSporkDB->SporkExists(SPORK_14_NEW_PROTOCOL_ENFORCEMENT) &&
+            !pSporkDB->SporkExists(SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2) &&
+            !pSporkDB->SporkExists(SPORK_16_ZEROCOIN_MAINTENANCE_MODE);
 
-        for (unsigned int nInv = 0; nInv < vInv.size(); nInv++) {
-            const CInv& inv = vInv[nInv];
+    if (fMissingSporks || !fRequestedSporksIDB){
+        LogPrintf("asking peer for sporks\n");
+        pfrom->PushMessage("getsporks");
+        fRequestedSporksIDB = true;
+    }
 
-            boost::this_thread::interruption_point();
-            pfrom->AddInventoryKnown(inv);
+    int64_t nTime;
+    CAddress addrMe;
+    CAddress addrFrom;
+    uint64_t nNonce = 1;
+    vRecv >> pfrom->nVersion >> pfrom->nServices >> nTime >> addrMe;
+    if (pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand))
+        return false;
+
+    if (pfrom->nVersion == 10300)
+        pfrom->nVersion = 300;
+    if (!vRecv.empty())
+        vRecv >> addrFrom >> nNonce;
+    if (!vRecv.empty()) {
+        vRecv >> LIMITED_STRING(pfrom->strSubVer, 256);
+        pfrom->cleanSubVer = SanitizeString(pfrom->strSubVer);
+    }
+    if (!vRecv.empty())
+        vRecv >> pfrom->nStartingHeight;
+    if (!vRecv.empty())
+        vRecv >> pfrom->fRelayTxes; // set to true after we get the first filter* message
+    else
+        pfrom->fRelayTxes = true;
+
+    // Disconnect if we connected to ourself
+    if (nNonce == nLocalHostNonce && nNonce > 1) {
+        LogPrintf("connected to self at %s, disconnecting\n", pfrom->addr.ToString());
+        pfrom->fDisconnect = true;
+        return true;
+    }
 
-            bool fAlreadyHave = AlreadyHave(inv);
-            LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
+    pfrom->addrLocal = addrMe;
+    if (pfrom->fInbound && addrMe.IsRoutable()) {
+        SeenLocal(addrMe);
+    }
 
-            if (!fAlreadyHave && !fImporting && !fReindex && inv.type != MSG_BLOCK)
-                pfrom->AskFor(inv);
+    // Be shy and don't send version until we hear
+    if (pfrom->fInbound)
+        pfrom->PushVersion();
 
+    pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
-            if (inv.type == MSG_BLOCK) {
-                UpdateBlockAvailability(pfrom->GetId(), inv.hash);
-                if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
-                    LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
-                }
-            }
+    // Potentially mark this peer as a preferred download peer.
+    UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
 
-            // Track requests for our stuff
-            GetMainSignals().Inventory(inv.hash);
+    // Change version
+    pfrom->PushMessage("verack");
+    pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
-            if (pfrom->nSendSize > (SendBufferSize() * 2)) {
-                Misbehaving(pfrom->GetId(), 50);
-                return error("send buffer size() = %u", pfrom->nSendSize);
+    if (!pfrom->fInbound) {
+        // Advertise our address
+        if (fListen && !IsInitialBlockDownload()) {
+            CAddress addr = GetLocalAddress(&pfrom->addr);
+            if (addr.IsRoutable()) {
+                LogPrintf("ProcessMessages: advertizing address %s\n", addr.ToString());
+                pfrom->PushAddress(addr);
+            } else if (IsPeerAddrLocalGood(pfrom)) {
+                addr.SetIP(pfrom->addrLocal);
+                LogPrintf("ProcessMessages: advertizing address %s\n", addr.ToString());
+                pfrom->PushAddress(addr);
             }
         }
 
-        if (!vToFetch.empty())
-            pfrom->PushMessage("getdata", vToFetch);
+        // Get recent addresses
+        if (pfrom->fOneShot || pfrom->nVersion >= CADDR_TIME_VERSION || addrman.size() < 1000) {
+            pfrom->PushMessage("getaddr");
+            pfrom->fGetAddr = true;
+        }
+        addrman.Good(pfrom->addr);
+    } else {
+        if (((CNetAddr)pfrom->addr) == (CNetAddr)addrFrom) {
+            addrman.Add(addrFrom, addrFrom);
+            addrman.Good(addrFrom);
+        }
     }
 
+    // Relay alerts
+    {
+        LOCK(cs_mapAlerts);
+        BOOST_FOREACH (PAIRTYPE(const uint256, CAlert) & item, mapAlerts)
+            item.second.RelayTo(pfrom);
+    }
 
-    else if (strCommand == "getdata") {
-        vector<CInv> vInv;
-        vRecv >> vInv;
-        if (vInv.size() > MAX_INV_SZ) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 20);
-            return error("message getdata size() = %u", vInv.size());
-        }
+    pfrom->fSuccessfullyConnected = true;
 
-        if (fDebug || (vInv.size() != 1))
-            LogPrint("net", "received getdata (%u invsz) peer=%d\n", vInv.size(), pfrom->id);
+    string remoteAddr;
+    if (fLogIPs)
+        remoteAddr = ", peeraddr=" + pfrom->addr.ToString();
 
-        if ((fDebug && vInv.size() > 0) || (vInv.size() == 1))
-            LogPrint("net", "received getdata for: %s peer=%d\n", vInv[0].ToString(), pfrom->id);
+    LogPrintf("receive version message: %s: version %d, blocks=%d, us=%s, peer=%d%s\n",
+        pfrom->cleanSubVer, pfrom->nVersion,
+        pfrom->nStartingHeight, addrMe.ToString(), pfrom->id,
+        remoteAddr);
 
-        pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
-        ProcessGetData(pfrom);
+    int64_t nTimeOffset = nTime - GetTime();
+    pfrom->nTimeOffset = nTimeOffset;
+    AddTimeData(pfrom->addr, nTimeOffset);
+    return true;
+}
+
+static bool ProcessMessageVerack(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+    // Mark this node as currently connected, so we update its timestamp later.
+    if (pfrom->fNetworkNode) {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fCurrentlyConnected = true;
     }
 
+    // Tell the peer that we understand compact blocks. We only ask it to push
+    // them to us unsolicited once it has given us a new best block.
+    if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+        pfrom->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+    return true;
+}
+
+static bool ProcessMessageSendCmpct(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    bool fAnnounceUsingCMPCTBLOCK = false;
+    uint64_t nCMPCTBLOCKVersion = 0;
+    vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+    if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+        LOCK(cs_main);
+        CNodeState* nodestate = State(pfrom->GetId());
+        nodestate->fProvidesHeaderAndIDs = true;
+        nodestate->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+    }
+    return true;
+}
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
-        CBlockLocator locator;
-        uint256 hashStop;
-        vRecv >> locator >> hashStop;
+static bool ProcessMessageAddr(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<CAddress> vAddr;
+    vRecv >> vAddr;
 
+    // Don't want addr from older versions unless seeding
+    if (pfrom->nVersion < CADDR_TIME_VERSION && addrman.size() > 1000)
+        return true;
+    if (vAddr.size() > 1000) {
         LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 20);
+        return error("message addr size() = %u", vAddr.size());
+    }
 
-        // Find the last block the caller has in the main chain
-        CBlockIndex* pindex = FindForkInGlobalIndex(chainActive, locator);
+    // Store the new addresses
+    vector<CAddress> vAddrOk;
+    int64_t nNow = GetAdjustedTime();
+    int64_t nSince = nNow - 10 * 60;
+    BOOST_FOREACH (CAddress& addr, vAddr) {
+        boost::this_thread::interruption_point();
 
-        // Send the rest of the chain
-        if (pindex)
-            pindex = chainActive.Next(pindex);
-        int nLimit = 500;
-        LogPrint("net", "getblocks %d to %s limit %d from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop == uint256(0) ? "end" : hashStop.ToString(), nLimit, pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex)) {
-            if (pindex->GetBlockHash() == hashStop) {
-                LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                break;
-            }
-            pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
-            if (--nLimit <= 0) {
-                // When this block is requested, we'll send an inv that'll make them
-                // getblocks the next batch of inventory.
-                LogPrint("net", "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                pfrom->hashContinue = pindex->GetBlockHash();
-                break;
+        if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60)
+            addr.nTime = nNow - 5 * 24 * 60 * 60;
+        pfrom->AddAddressKnown(addr);
+        bool fReachable = IsReachable(addr);
+        if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable()) {
+            // Relay to a limited number of other nodes
+            {
+                LOCK(cs_vNodes);
+                // Use deterministic randomness to send to the same nodes for 24 hours
+                // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                static uint256 hashSalt;
+                if (hashSalt == 0)
+                    hashSalt = GetRandHash();
+                uint64_t hashAddr = addr.GetHash();
+                uint256 hashRand = hashSalt ^ (hashAddr << 32) ^ ((GetTime() + hashAddr) / (24 * 60 * 60));
+                hashRand = Hash(BEGIN(hashRand), END(hashRand));
+                multimap<uint256, CNode*> mapMix;
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (pnode->nVersion < CADDR_TIME_VERSION)
+                        continue;
+                    unsigned int nPointer;
+                    memcpy(&nPointer, &pnode, sizeof(nPointer));
+                    uint256 hashKey = hashRand ^ nPointer;
+                    hashKey = Hash(BEGIN(hashKey), END(hashKey));
+                    mapMix.insert(make_pair(hashKey, pnode));
+                }
+                int nRelayNodes = fReachable ? 2 : 1; // limited relaying of addresses outside our network(s)
+                for (multimap<uint256, CNode*>::iterator mi = mapMix.begin(); mi != mapMix.end() && nRelayNodes-- > 0; ++mi)
+                    ((*mi).second)->PushAddress(addr);
             }
         }
+        // Do not store addresses outside our network
+        if (fReachable)
+            vAddrOk.push_back(addr);
+    }
+    addrman.Add(vAddrOk, pfrom->addr, 2 * 60 * 60);
+    if (vAddr.size() < 1000)
+        pfrom->fGetAddr = false;
+    if (pfrom->fOneShot)
+        pfrom->fDisconnect = true;
+    return true;
+}
+
+static bool ProcessMessageInv(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<CInv> vInv;
+    vRecv >> vInv;
+    if (vInv.size() > MAX_INV_SZ) {
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 20);
+        return error("message inv size() = %u", vInv.size());
     }
 
+    LOCK(cs_main);
+
+    std::vector<CInv> vToFetch;
+
+    for (unsigned int nInv = 0; nInv < vInv.size(); nInv++) {
+        const CInv& inv = vInv[nInv];
+
+        boost::this_thread::interruption_point();
+        pfrom->AddInventoryKnown(inv);
+
+        bool fAlreadyHave = AlreadyHave(inv);
+        LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
+
+        if (!fAlreadyHave && !fImporting && !fReindex && inv.type != MSG_BLOCK)
+            pfrom->AskFor(inv);
+
+
+        if (inv.type == MSG_BLOCK) {
+            UpdateBlockAvailability(pfrom->GetId(), inv.hash);
+            if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
+                CNodeState* nodestate = State(pfrom->GetId());
+                // Near the tip our mempool most likely has the block's transactions already
+                bool fNearTip = chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20;
+                CInv invFetch = fNearTip && nodestate->fProvidesHeaderAndIDs ? CInv(MSG_CMPCT_BLOCK, inv.hash) : inv;
+                if (IsHeadersSyncPeer(pfrom)) {
+                    // First request the headers preceding the announced block, so that it can be
+                    // validated when it arrives. Only when we are close to being synced, also
+                    // request the block itself right away to save a round trip.
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
+                    if (fNearTip && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                        vToFetch.push_back(invFetch);
+                        MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
+                    }
+                    LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                } else {
+                    // Add this to the list of blocks to request
+                    vToFetch.push_back(invFetch);
+                    LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                }
+            }
+        }
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
-        CBlockLocator locator;
-        uint256 hashStop;
-        vRecv >> locator >> hashStop;
+        // Track requests for our stuff
+        GetMainSignals().Inventory(inv.hash);
 
+        if (pfrom->nSendSize > (SendBufferSize() * 2)) {
+            Misbehaving(pfrom->GetId(), 50);
+            return error("send buffer size() = %u", pfrom->nSendSize);
+        }
+    }
+
+    if (!vToFetch.empty())
+        pfrom->PushMessage("getdata", vToFetch);
+    return true;
+}
+
+static bool ProcessMessageGetData(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<CInv> vInv;
+    vRecv >> vInv;
+    if (vInv.size() > MAX_INV_SZ) {
         LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 20);
+        return error("message getdata size() = %u", vInv.size());
+    }
 
-        if (IsInitialBlockDownload())
-            return true;
+    if (fDebug || (vInv.size() != 1))
+        LogPrint("net", "received getdata (%u invsz) peer=%d\n", vInv.size(), pfrom->id);
 
-        CBlockIndex* pindex = NULL;
-        if (locator.IsNull()) {
-            // If locator is null, return the hashStop block
-            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
-            if (mi == mapBlockIndex.end())
-                return true;
-            pindex = (*mi).second;
-        } else {
-            // Find the last block the caller has in the main chain
-            pindex = FindForkInGlobalIndex(chainActive, locator);
-            if (pindex)
-                pindex = chainActive.Next(pindex);
-        }
-
-        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
-        vector<CBlock> vHeaders;
-        int nLimit = MAX_HEADERS_RESULTS;
-        if (fDebug)
-            LogPrintf("getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex)) {
-            vHeaders.push_back(pindex->GetBlockHeader());
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                break;
+    if ((fDebug && vInv.size() > 0) || (vInv.size() == 1))
+        LogPrint("net", "received getdata for: %s peer=%d\n", vInv[0].ToString(), pfrom->id);
+
+    pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
+    ProcessGetData(pfrom);
+    return true;
+}
+
+static bool ProcessMessageGetBlocks(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CBlockLocator locator;
+    uint256 hashStop;
+    vRecv >> locator >> hashStop;
+
+    LOCK(cs_main);
+
+    // Find the last block the caller has in the main chain
+    CBlockIndex* pindex = FindForkInGlobalIndex(chainActive, locator);
+
+    // Send the rest of the chain
+    if (pindex)
+        pindex = chainActive.Next(pindex);
+    int nLimit = 500;
+    LogPrint("net", "getblocks %d to %s limit %d from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop == uint256(0) ? "end" : hashStop.ToString(), nLimit, pfrom->id);
+    for (; pindex; pindex = chainActive.Next(pindex)) {
+        if (pindex->GetBlockHash() == hashStop) {
+            LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            break;
+        }
+        pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+        if (--nLimit <= 0) {
+            // When this block is requested, we'll send an inv that'll make them
+            // getblocks the next batch of inventory.
+            LogPrint("net", "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            pfrom->hashContinue = pindex->GetBlockHash();
+            break;
         }
-        pfrom->PushMessage("headers", vHeaders);
     }
+    return true;
+}
 
+static bool ProcessMessageGetHeaders(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Peers that do not sync headers-first ask for an inv of the next blocks
+    if (pfrom->nVersion < HEADERS_FIRST_VERSION)
+        return ProcessMessageGetBlocks(pfrom, strCommand, vRecv, nTimeReceived);
 
-    else if (strCommand == "tx" || strCommand == "dstx") {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CTransaction tx;
+    CBlockLocator locator;
+    uint256 hashStop;
+    vRecv >> locator >> hashStop;
 
-        //masternode signed transaction
-        bool ignoreFees = false;
-        CTxIn vin;
-        vector<unsigned char> vchSig;
-        int64_t sigTime;
-
-        if (strCommand == "tx") {
-            vRecv >> tx;
-        } else if (strCommand == "dstx") {
-            //these allow masternodes to publish a limited amount of free transactions
-            vRecv >> tx >> vin >> vchSig >> sigTime;
-
-            CMasternode* pmn = mnodeman.Find(vin);
-            if (pmn != NULL) {
-                if (!pmn->allowFreeTx) {
-                    //multiple peers can send us a valid masternode transaction
-                    if (fDebug) LogPrintf("dstx: Masternode sending too many transactions %s\n", tx.GetHash().ToString());
-                    return true;
-                }
+    LOCK(cs_main);
 
-                std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
+    if (IsInitialBlockDownload())
+        return true;
 
-                std::string errorMessage = "";
-                if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
-                    LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString());
-                    //pfrom->Misbehaving(20);
-                    return false;
-                }
+    CBlockIndex* pindex = NULL;
+    if (locator.IsNull()) {
+        // If locator is null, return the hashStop block
+        BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+        if (mi == mapBlockIndex.end())
+            return true;
+        pindex = (*mi).second;
+    } else {
+        // Find the last block the caller has in the main chain
+        pindex = FindForkInGlobalIndex(chainActive, locator);
+        if (pindex)
+            pindex = chainActive.Next(pindex);
+    }
 
-                LogPrintf("dstx: Got Masternode transaction %s\n", tx.GetHash().ToString());
+    // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
+    vector<CBlock> vHeaders;
+    int nLimit = MAX_HEADERS_RESULTS;
+    if (fDebug)
+        LogPrintf("getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
+    for (; pindex; pindex = chainActive.Next(pindex)) {
+        vHeaders.push_back(pindex->GetBlockHeader());
+        if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+            break;
+    }
+    pfrom->PushMessage("headers", vHeaders);
+    return true;
+}
 
-                ignoreFees = true;
-                pmn->allowFreeTx = false;
+static bool ProcessMessageTx(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    size_t nSize = vRecv.size();
+    CTransaction tx;
 
-                if (!mapObfuscationBroadcastTxes.count(tx.GetHash())) {
-                    CObfuscationBroadcastTx dstx;
-                    dstx.tx = tx;
-                    dstx.vin = vin;
-                    dstx.vchSig = vchSig;
-                    dstx.sigTime = sigTime;
+    //masternode signed transaction
+    bool ignoreFees = false;
+    CTxIn vin;
+    vector<unsigned char> vchSig;
+    int64_t sigTime;
+
+    if (strCommand == "tx") {
+        vRecv >> tx;
+    } else if (strCommand == "dstx") {
+        //these allow masternodes to publish a limited amount of free transactions
+        vRecv >> tx >> vin >> vchSig >> sigTime;
+
+        CMasternode* pmn = mnodeman.Find(vin);
+        if (pmn != NULL) {
+            if (!pmn->allowFreeTx) {
+                //multiple peers can send us a valid masternode transaction
+                if (fDebug) LogPrintf("dstx: Masternode sending too many transactions %s\n", tx.GetHash().ToString());
+                return true;
+            }
 
-                    mapObfuscationBroadcastTxes.insert(make_pair(tx.GetHash(), dstx));
-                }
+            std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
+
+            std::string errorMessage = "";
+            if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
+                LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString());
+                //pfrom->Misbehaving(20);
+                return false;
             }
-        }
 
-        CInv inv(MSG_TX, tx.GetHash());
-        pfrom->AddInventoryKnown(inv);
+            LogPrintf("dstx: Got Masternode transaction %s\n", tx.GetHash().ToString());
 
-        LOCK(cs_main);
+            ignoreFees = true;
+            pmn->allowFreeTx = false;
 
-        bool fMissingInputs = false;
-        bool fMissingZerocoinInputs = false;
-        CValidationState state;
+            if (!mapObfuscationBroadcastTxes.count(tx.GetHash())) {
+                CObfuscationBroadcastTx dstx;
+                dstx.tx = tx;
+                dstx.vin = vin;
+                dstx.vchSig = vchSig;
+                dstx.sigTime = sigTime;
 
-        mapAlreadyAskedFor.erase(inv);
+                mapObfuscationBroadcastTxes.insert(make_pair(tx.GetHash(), dstx));
+            }
+        }
+    }
 
-        if (!tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees)) {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
+    pfrom->AddInventoryKnown(CInv(MSG_TX, tx.GetHash()));
+    QueueValidation(pfrom, tx.GetHash(), boost::bind(&ProcessTransactionMessage, pfrom, strCommand, tx, ignoreFees), nSize);
+    return true;
+}
 
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
-                     pfrom->id, pfrom->cleanSubVer,
-                     tx.GetHash().ToString(),
-                     mempool.mapTx.size());
+static bool ProcessMessageHeaders(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Ignore headers received while importing
+    if (!Params().HeadersFirstSyncingActive() || fImporting || fReindex)
+        return true;
 
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for(unsigned int i = 0; i < vWorkQueue.size(); i++) {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if(itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for(set<uint256>::iterator mi = itByPrev->second.begin();
-                    mi != itByPrev->second.end();
-                    ++mi) {
-                    const uint256 &orphanHash = *mi;
-                    const CTransaction &orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if(setMisbehaving.count(fromPeer))
-                        continue;
-                    if(AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    } else if(!fMissingInputs2) {
-                        int nDos = 0;
-                        if(stateDummy.IsInvalid(nDos) && nDos > 0) {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
+    std::vector<CBlockHeader> headers;
 
-            BOOST_FOREACH (uint256 hash, vEraseQueue)EraseOrphanTx(hash);
-        } else if (tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingZerocoinInputs, false, ignoreFees)) {
-            //Presstab: ZCoin has a bunch of code commented out here. Is this something that should have more going on?
-            //Also there is nothing that handles fMissingZerocoinInputs. Does there need to be?
-            RelayTransaction(tx);
-            LogPrint("mempool", "AcceptToMemoryPool: Zerocoinspend peer=%d %s : accepted %s (poolsz %u)\n",
-                     pfrom->id, pfrom->cleanSubVer,
-                     tx.GetHash().ToString(),
-                     mempool.mapTx.size());
-        } else if (fMissingInputs) {
-            AddOrphanTx(tx, pfrom->GetId());
+    // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
+    unsigned int nCount = ReadCompactSize(vRecv);
+    if (nCount > MAX_HEADERS_RESULTS) {
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 20);
+        return error("headers message size = %u", nCount);
+    }
+    headers.resize(nCount);
+    for (unsigned int n = 0; n < nCount; n++) {
+        vRecv >> headers[n];
+        ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
+    }
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else if (pfrom->fWhitelisted) {
-            // Always relay transactions received from whitelisted peers, even
-            // if they are already in the mempool (allowing the node to function
-            // as a gateway for nodes hidden behind it).
+    LOCK(cs_main);
 
-            RelayTransaction(tx);
+    if (nCount == 0) {
+        // Nothing interesting. Stop asking this peers for more headers.
+        return true;
+    }
+    CNodeState* nodestate = State(pfrom->GetId());
+    CBlockIndex* pindexLast = NULL;
+    BOOST_FOREACH (const CBlockHeader& header, headers) {
+        CValidationState state;
+        if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("non-continuous headers sequence");
         }
 
-        if (strCommand == "dstx") {
-            CInv inv(MSG_DSTX, tx.GetHash());
-            RelayInv(inv);
+        // Stop at proof-of-stake headers too far ahead of the blocks we have, and
+        // continue once the block download has caught up
+        BlockMap::iterator mi = mapBlockIndex.find(header.hashPrevBlock);
+        if (mi != mapBlockIndex.end() && !mapBlockIndex.count(header.GetHash()) && mi->second->nHeight + 1 > Params().LAST_POW_BLOCK() &&
+            (IsHeaderTooFarAhead(mi->second) || nodestate->nHeadersPending >= MAX_HEADERS_AHEAD_OF_TIP)) {
+            LogPrint("net", "deferring headers past height %d from peer=%d\n", mi->second->nHeight, pfrom->id);
+            nodestate->fHeadersDeferred = true;
+            break;
         }
 
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS)) {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+        // The stake of a block added from its header is filled in by ReceivedBlockTransactions
+        if (!AcceptBlockHeader(CBlock(header), state, &pindexLast)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                std::string strError = "invalid header received " + header.GetHash().ToString();
+                return error(strError.c_str());
+            }
         }
+        AddHeaderSource(pfrom->GetId(), pindexLast);
     }
 
+    if (pindexLast)
+        UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) // Ignore headers received while importing
+    if (nCount == MAX_HEADERS_RESULTS && pindexLast && !nodestate->fHeadersDeferred) {
+        // Headers message had its maximum size; the peer may have more headers.
+        // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
+        // from there instead.
+        LogPrintf("more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
+        pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
+    }
+
+    CheckBlockIndex();
+    return true;
+}
+
+static bool ProcessMessageBlock(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Ignore blocks received while importing
+    if (fImporting || fReindex)
+        return true;
+
+    size_t nSize = vRecv.size();
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+    vRecv >> *pblock;
+    LogPrint("net", "received block %s peer=%d\n", pblock->GetHash().ToString(), pfrom->id);
+    QueueValidation(pfrom, pblock->GetHash(), boost::bind(&ProcessBlockMessage, pfrom, pblock), nSize);
+    return true;
+}
+
+static bool ProcessMessageCmpctBlock(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Ignore blocks received while importing
+    if (fImporting || fReindex)
+        return true;
+
+    size_t nSize = vRecv.size();
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    vRecv >> cmpctblock;
+    uint256 hashBlock = cmpctblock.header.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+    LogPrint("net", "received cmpctblock %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
     {
-        std::vector<CBlockHeader> headers;
+        LOCK(cs_main);
+        pfrom->AddInventoryKnown(inv);
 
-        // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
-        unsigned int nCount = ReadCompactSize(vRecv);
-        if (nCount > MAX_HEADERS_RESULTS) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 20);
-            return error("headers message size = %u", nCount);
+        BlockMap::iterator mi = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+        if (mi == mapBlockIndex.end()) {
+            // Doesn't connect to anything we know; fetch what precedes it first
+            if (IsHeadersSyncPeer(pfrom))
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), hashBlock);
+            else
+                pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
+            return true;
         }
-        headers.resize(nCount);
-        for (unsigned int n = 0; n < nCount; n++) {
-            vRecv >> headers[n];
-            ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
+
+        // A proof-of-stake header is free to make, so it only gets an entry of its own
+        // when it extends our tip or when we asked this peer for the block
+        CBlockIndex* pindexPrev = mi->second;
+        if (pindexPrev->nHeight + 1 > Params().LAST_POW_BLOCK() && !mapBlockIndex.count(hashBlock)) {
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+            bool fRequested = itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId();
+            CNodeState* nodestate = State(pfrom->GetId());
+            if (!fRequested && (pindexPrev != chainActive.Tip() || IsHeaderTooFarAhead(pindexPrev) ||
+                                   nodestate->nHeadersPending >= MAX_HEADERS_AHEAD_OF_TIP)) {
+                // Get the full block instead, which is checked before it is added
+                if (itInFlight == mapBlocksInFlight.end() && pindexPrev->nChainTx != 0 &&
+                    nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                    MarkBlockAsInFlight(pfrom->GetId(), hashBlock);
+                    pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                }
+                LogPrint("net", "cmpctblock %s not on our tip, peer=%d\n", hashBlock.ToString(), pfrom->id);
+                return true;
+            }
         }
 
-        LOCK(cs_main);
+        CBlockIndex* pindex = NULL;
+        CValidationState state;
+        if (!AcceptBlockHeader(CBlock(cmpctblock.header), state, &pindex)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid cmpctblock header received %s", hashBlock.ToString());
+            }
+            return true;
+        }
+        AddHeaderSource(pfrom->GetId(), pindex);
+        UpdateBlockAvailability(pfrom->GetId(), hashBlock);
+
+        // Another peer is already sending us this block
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+        if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first != pfrom->GetId())
+            return true;
 
-        if (nCount == 0) {
-            // Nothing interesting. Stop asking this peers for more headers.
+        if ((pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nChainWork <= chainActive.Tip()->nChainWork) {
+            // Nothing to do with it, even if we asked this peer for it
+            if (itInFlight != mapBlocksInFlight.end())
+                MarkBlockAsReceived(hashBlock);
             return true;
         }
-        CBlockIndex* pindexLast = NULL;
-        BOOST_FOREACH (const CBlockHeader& header, headers) {
-            CValidationState state;
-            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
-                Misbehaving(pfrom->GetId(), 20);
-                return error("non-continuous headers sequence");
-            }
 
-            /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
-             * before headers are reimplemented on mainnet
-             */
-            if (!AcceptBlockHeader((CBlock)header, state, &pindexLast)) {
-                int nDoS;
-                if (state.IsInvalid(nDoS)) {
-                    if (nDoS > 0)
-                        Misbehaving(pfrom->GetId(), nDoS);
-                    std::string strError = "invalid header received " + header.GetHash().ToString();
-                    return error(strError.c_str());
-                }
+        CNodeState* nodestate = State(pfrom->GetId());
+        if (pindex->pprev->nChainTx == 0) {
+            // Not on top of a block we have; download it in full along with its ancestors
+            if (itInFlight != mapBlocksInFlight.end() || nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                MarkBlockAsInFlight(pfrom->GetId(), hashBlock, pindex);
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
             }
+            return true;
         }
 
-        if (pindexLast)
-            UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+        ResetPartialBlock(pfrom->GetId(), nodestate);
+        std::shared_ptr<PartiallyDownloadedBlock> partialBlock = std::make_shared<PartiallyDownloadedBlock>(&mempool);
+        ReadStatus status = partialBlock->InitData(cmpctblock);
+        if (status == READ_STATUS_INVALID) {
+            if (itInFlight != mapBlocksInFlight.end())
+                MarkBlockAsReceived(hashBlock);
+            Misbehaving(pfrom->GetId(), 100);
+            return error("invalid cmpctblock %s received from peer=%d", hashBlock.ToString(), pfrom->id);
+        }
+        MarkBlockAsInFlight(pfrom->GetId(), hashBlock, pindex);
+        if (status == READ_STATUS_FAILED) {
+            // Short id collision; get the full block instead
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            return true;
+        }
 
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
-            // Headers message had its maximum size; the peer may have more headers.
-            // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
-            // from there instead.
-            LogPrintf("more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
-            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
+        BlockTransactionsRequest req;
+        for (size_t i = 0; i < partialBlock->TxCount(); i++) {
+            if (!partialBlock->IsTxAvailable(i))
+                req.indexes.push_back(i);
+        }
+        if (!req.indexes.empty()) {
+            req.blockhash = hashBlock;
+            nodestate->partialBlock = partialBlock;
+            pfrom->PushMessage("getblocktxn", req);
+            return true;
         }
 
-        CheckBlockIndex();
+        // Everything was in our mempool
+        if (partialBlock->FillBlock(*pblock, vector<CTransaction>()) != READ_STATUS_OK) {
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            return true;
+        }
     }
+    QueueValidation(pfrom, pblock->GetHash(), boost::bind(&ProcessReconstructedBlock, pfrom, pblock), nSize);
+    return true;
+}
 
-    else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
+static bool ProcessMessageGetBlockTxn(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    BlockTransactionsRequest req;
+    vRecv >> req;
+
+    CBlock block;
     {
-        CBlock block;
-        vRecv >> block;
-        uint256 hashBlock = block.GetHash();
-        CInv inv(MSG_BLOCK, hashBlock);
-        LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
-
-        //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
-        if (!mapBlockIndex.count(block.hashPrevBlock)) {
-            if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
-                //we already asked for this block, so lets work backwards and ask for the previous block
-                pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
-                pfrom->vBlockRequested.push_back(block.hashPrevBlock);
-            } else {
-                //ask to sync to this block
-                pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
-                pfrom->vBlockRequested.push_back(hashBlock);
-            }
-        } else {
-            pfrom->AddInventoryKnown(inv);
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
 
-            CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
-                int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
-                }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
-            } else {
-                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
-            }
+        if (!chainActive.Contains(mi->second) || chainActive.Height() - mi->second->nHeight > MAX_BLOCKTXN_DEPTH) {
+            // Only recent blocks are served this way, like cmpctblock getdata; send the whole block
+            // instead, which is also subject to the checks getdata applies to blocks outside the chain.
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
         }
-    }
 
+        if (!ReadBlockFromDisk(block, mi->second))
+            return error("%s : cannot load block %s from disk", __func__, req.blockhash.ToString());
+    }
 
-    // This asymmetric behavior for inbound and outbound connections was introduced
-    // to prevent a fingerprinting attack: an attacker can send specific fake addresses
-    // to users' AddrMan and later request them by sending getaddr messages.
-    // Making users (which are behind NAT and can only make outgoing connections) ignore
-    // getaddr message mitigates the attack.
-    else if ((strCommand == "getaddr") && (pfrom->fInbound)) {
-        pfrom->vAddrToSend.clear();
-        vector<CAddress> vAddr = addrman.GetAddr();
-        BOOST_FOREACH (const CAddress& addr, vAddr)
-            pfrom->PushAddress(addr);
+    BlockTransactions resp(req);
+    for (size_t i = 0; i < req.indexes.size(); i++) {
+        if (req.indexes[i] >= block.vtx.size()) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 100);
+            return error("peer=%d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+        }
+        resp.txn[i] = block.vtx[req.indexes[i]];
     }
+    pfrom->PushMessage("blocktxn", resp);
+    return true;
+}
 
+static bool ProcessMessageBlockTxn(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Ignore blocks received while importing
+    if (fImporting || fReindex)
+        return true;
 
-    else if (strCommand == "mempool") {
-        LOCK2(cs_main, pfrom->cs_filter);
+    size_t nSize = vRecv.size();
+    BlockTransactions resp;
+    vRecv >> resp;
 
-        std::vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
-        vector<CInv> vInv;
-        BOOST_FOREACH (uint256& hash, vtxid) {
-            CInv inv(MSG_TX, hash);
-            CTransaction tx;
-            bool fInMemPool = mempool.lookup(hash, tx);
-            if (!fInMemPool) continue; // another thread removed since queryHashes, maybe...
-            if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(tx)) ||
-                (!pfrom->pfilter))
-                vInv.push_back(inv);
-            if (vInv.size() == MAX_INV_SZ) {
-                pfrom->PushMessage("inv", vInv);
-                vInv.clear();
-            }
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+    {
+        LOCK(cs_main);
+        CNodeState* nodestate = State(pfrom->GetId());
+        if (!nodestate->partialBlock || nodestate->partialBlock->header.GetHash() != resp.blockhash) {
+            LogPrint("net", "peer=%d sent us block transactions for a block we weren't expecting\n", pfrom->id);
+            return true;
+        }
+
+        std::shared_ptr<PartiallyDownloadedBlock> partialBlock = nodestate->partialBlock;
+        nodestate->partialBlock.reset();
+        ReadStatus status = partialBlock->FillBlock(*pblock, resp.txn);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(resp.blockhash);
+            Misbehaving(pfrom->GetId(), 100);
+            return error("peer=%d sent us block transactions that do not match the compact block", pfrom->id);
+        } else if (status == READ_STATUS_FAILED) {
+            // Short id collision; the block is still in flight from this peer
+            pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+            return true;
         }
-        if (vInv.size() > 0)
-            pfrom->PushMessage("inv", vInv);
     }
+    QueueValidation(pfrom, pblock->GetHash(), boost::bind(&ProcessReconstructedBlock, pfrom, pblock), nSize);
+    return true;
+}
+
+// This asymmetric behavior for inbound and outbound connections was introduced
+// to prevent a fingerprinting attack: an attacker can send specific fake addresses
+// to users' AddrMan and later request them by sending getaddr messages.
+// Making users (which are behind NAT and can only make outgoing connections) ignore
+// getaddr message mitigates the attack.
+static bool ProcessMessageGetAddr(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (!pfrom->fInbound)
+        return true;
 
+    pfrom->vAddrToSend.clear();
+    vector<CAddress> vAddr = addrman.GetAddr();
+    BOOST_FOREACH (const CAddress& addr, vAddr)
+        pfrom->PushAddress(addr);
+    return true;
+}
 
-    else if (strCommand == "ping") {
-        if (pfrom->nVersion > BIP0031_VERSION) {
-            uint64_t nonce = 0;
-            vRecv >> nonce;
-            // Echo the message back with the nonce. This allows for two useful features:
-            //
-            // 1) A remote node can quickly check if the connection is operational
-            // 2) Remote nodes can measure the latency of the network thread. If this node
-            //    is overloaded it won't respond to pings quickly and the remote node can
-            //    avoid sending us more work, like chain download requests.
-            //
-            // The nonce stops the remote getting confused between different pings: without
-            // it, if the remote node sends a ping once per second and this node takes 5
-            // seconds to respond to each, the 5th ping the remote sends would appear to
-            // return very quickly.
-            pfrom->PushMessage("pong", nonce);
+static bool ProcessMessageMempool(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    LOCK2(cs_main, pfrom->cs_filter);
+
+    std::vector<uint256> vtxid;
+    mempool.queryHashes(vtxid);
+    vector<CInv> vInv;
+    BOOST_FOREACH (uint256& hash, vtxid) {
+        CInv inv(MSG_TX, hash);
+        CTransaction tx;
+        bool fInMemPool = mempool.lookup(hash, tx);
+        if (!fInMemPool) continue; // another thread removed since queryHashes, maybe...
+        if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(tx)) ||
+            (!pfrom->pfilter))
+            vInv.push_back(inv);
+        if (vInv.size() == MAX_INV_SZ) {
+            pfrom->PushMessage("inv", vInv);
+            vInv.clear();
         }
     }
+    if (vInv.size() > 0)
+        pfrom->PushMessage("inv", vInv);
+    return true;
+}
 
-
-    else if (strCommand == "pong") {
-        int64_t pingUsecEnd = nTimeReceived;
+static bool ProcessMessagePing(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (pfrom->nVersion > BIP0031_VERSION) {
         uint64_t nonce = 0;
-        size_t nAvail = vRecv.in_avail();
-        bool bPingFinished = false;
-        std::string sProblem;
+        vRecv >> nonce;
+        // Echo the message back with the nonce. This allows for two useful features:
+        //
+        // 1) A remote node can quickly check if the connection is operational
+        // 2) Remote nodes can measure the latency of the network thread. If this node
+        //    is overloaded it won't respond to pings quickly and the remote node can
+        //    avoid sending us more work, like chain download requests.
+        //
+        // The nonce stops the remote getting confused between different pings: without
+        // it, if the remote node sends a ping once per second and this node takes 5
+        // seconds to respond to each, the 5th ping the remote sends would appear to
+        // return very quickly.
+        pfrom->PushMessage("pong", nonce);
+    }
+    return true;
+}
 
-        if (nAvail >= sizeof(nonce)) {
-            vRecv >> nonce;
+static bool ProcessMessagePong(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    int64_t pingUsecEnd = nTimeReceived;
+    uint64_t nonce = 0;
+    size_t nAvail = vRecv.in_avail();
+    bool bPingFinished = false;
+    std::string sProblem;
 
-            // Only process pong message if there is an outstanding ping (old ping without nonce should never pong)
-            if (pfrom->nPingNonceSent != 0) {
-                if (nonce == pfrom->nPingNonceSent) {
-                    // Matching pong received, this ping is no longer outstanding
-                    bPingFinished = true;
-                    int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
-                    if (pingUsecTime > 0) {
-                        // Successful ping time measurement, replace previous
-                        pfrom->nPingUsecTime = pingUsecTime;
-                    } else {
-                        // This should never happen
-                        sProblem = "Timing mishap";
-                    }
+    if (nAvail >= sizeof(nonce)) {
+        vRecv >> nonce;
+
+        // Only process pong message if there is an outstanding ping (old ping without nonce should never pong)
+        if (pfrom->nPingNonceSent != 0) {
+            if (nonce == pfrom->nPingNonceSent) {
+                // Matching pong received, this ping is no longer outstanding
+                bPingFinished = true;
+                int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
+                if (pingUsecTime > 0) {
+                    // Successful ping time measurement, replace previous
+                    pfrom->nPingUsecTime = pingUsecTime;
                 } else {
-                    // Nonce mismatches are normal when pings are overlapping
-                    sProblem = "Nonce mismatch";
-                    if (nonce == 0) {
-                        // This is most likely a bug in another implementation somewhere, cancel this ping
-                        bPingFinished = true;
-                        sProblem = "Nonce zero";
-                    }
+                    // This should never happen
+                    sProblem = "Timing mishap";
                 }
             } else {
-                sProblem = "Unsolicited pong without ping";
+                // Nonce mismatches are normal when pings are overlapping
+                sProblem = "Nonce mismatch";
+                if (nonce == 0) {
+                    // This is most likely a bug in another implementation somewhere, cancel this ping
+                    bPingFinished = true;
+                    sProblem = "Nonce zero";
+                }
             }
         } else {
-            // This is most likely a bug in another implementation somewhere, cancel this ping
-            bPingFinished = true;
-            sProblem = "Short payload";
+            sProblem = "Unsolicited pong without ping";
         }
+    } else {
+        // This is most likely a bug in another implementation somewhere, cancel this ping
+        bPingFinished = true;
+        sProblem = "Short payload";
+    }
 
-        if (!(sProblem.empty())) {
-            LogPrint("net", "pong peer=%d %s: %s, %x expected, %x received, %u bytes\n",
-                pfrom->id,
-                pfrom->cleanSubVer,
-                sProblem,
-                pfrom->nPingNonceSent,
-                nonce,
-                nAvail);
-        }
-        if (bPingFinished) {
-            pfrom->nPingNonceSent = 0;
-        }
+    if (!(sProblem.empty())) {
+        LogPrint("net", "pong peer=%d %s: %s, %x expected, %x received, %u bytes\n",
+            pfrom->id,
+            pfrom->cleanSubVer,
+            sProblem,
+            pfrom->nPingNonceSent,
+            nonce,
+            nAvail);
+    }
+    if (bPingFinished) {
+        pfrom->nPingNonceSent = 0;
     }
+    return true;
+}
 
+static bool ProcessMessageAlert(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (!fAlerts)
+        return true;
 
-    else if (fAlerts && strCommand == "alert") {
-        CAlert alert;
-        vRecv >> alert;
+    CAlert alert;
+    vRecv >> alert;
 
-        uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0) {
-            if (alert.ProcessAlert()) {
-                // Relay
-                pfrom->setKnown.insert(alertHash);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH (CNode* pnode, vNodes)
-                        alert.RelayTo(pnode);
-                }
-            } else {
-                // Small DoS penalty so peers that send us lots of
-                // duplicate/expired/invalid-signature/whatever alerts
-                // eventually get banned.
-                // This isn't a Misbehaving(100) (immediate ban) because the
-                // peer might be an older or different implementation with
-                // a different signature key, etc.
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), 10);
+    uint256 alertHash = alert.GetHash();
+    if (pfrom->setKnown.count(alertHash) == 0) {
+        if (alert.ProcessAlert()) {
+            // Relay
+            pfrom->setKnown.insert(alertHash);
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH (CNode* pnode, vNodes)
+                    alert.RelayTo(pnode);
             }
+        } else {
+            // Small DoS penalty so peers that send us lots of
+            // duplicate/expired/invalid-signature/whatever alerts
+            // eventually get banned.
+            // This isn't a Misbehaving(100) (immediate ban) because the
+            // peer might be an older or different implementation with
+            // a different signature key, etc.
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 10);
         }
     }
+    return true;
+}
+
+//! Peers may only send bloom filter messages if we announce NODE_BLOOM
+static bool CheckBloomServiceEnabled(CNode* pfrom, const std::string& strCommand)
+{
+    if (nLocalServices & NODE_BLOOM)
+        return true;
 
-    else if (!(nLocalServices & NODE_BLOOM) &&
-             (strCommand == "filterload" ||
-                 strCommand == "filteradd" ||
-                 strCommand == "filterclear")) {
-        LogPrintf("bloom message=%s\n", strCommand);
+    LogPrintf("bloom message=%s\n", strCommand);
+    LOCK(cs_main);
+    Misbehaving(pfrom->GetId(), 100);
+    return false;
+}
+
+static bool ProcessMessageFilterLoad(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (!CheckBloomServiceEnabled(pfrom, strCommand))
+        return true;
+
+    CBloomFilter filter;
+    vRecv >> filter;
+
+    if (!filter.IsWithinSizeConstraints()) {
+        // There is no excuse for sending a too-large filter
         LOCK(cs_main);
         Misbehaving(pfrom->GetId(), 100);
+    } else {
+        LOCK(pfrom->cs_filter);
+        delete pfrom->pfilter;
+        pfrom->pfilter = new CBloomFilter(filter);
+        pfrom->pfilter->UpdateEmptyFull();
     }
+    pfrom->fRelayTxes = true;
+    return true;
+}
 
-    else if (strCommand == "filterload") {
-        CBloomFilter filter;
-        vRecv >> filter;
+static bool ProcessMessageFilterAdd(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (!CheckBloomServiceEnabled(pfrom, strCommand))
+        return true;
 
-        if (!filter.IsWithinSizeConstraints()) {
-            // There is no excuse for sending a too-large filter
+    vector<unsigned char> vData;
+    vRecv >> vData;
+
+    // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
+    // and thus, the maximum size any matched object can have) in a filteradd message
+    if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE) {
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 100);
+    } else {
+        LOCK(pfrom->cs_filter);
+        if (pfrom->pfilter)
+            pfrom->pfilter->insert(vData);
+        else {
             LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 100);
-        } else {
-            LOCK(pfrom->cs_filter);
-            delete pfrom->pfilter;
-            pfrom->pfilter = new CBloomFilter(filter);
-            pfrom->pfilter->UpdateEmptyFull();
         }
-        pfrom->fRelayTxes = true;
     }
+    return true;
+}
 
+static bool ProcessMessageFilterClear(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (!CheckBloomServiceEnabled(pfrom, strCommand))
+        return true;
 
-    else if (strCommand == "filteradd") {
-        vector<unsigned char> vData;
-        vRecv >> vData;
+    LOCK(pfrom->cs_filter);
+    delete pfrom->pfilter;
+    pfrom->pfilter = new CBloomFilter();
+    pfrom->fRelayTxes = true;
+    return true;
+}
 
-        // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
-        // and thus, the maximum size any matched object can have) in a filteradd message
-        if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE) {
-            LOCK(cs_main);
-            Misbehaving(pfrom->GetId(), 100);
-        } else {
-            LOCK(pfrom->cs_filter);
-            if (pfrom->pfilter)
-                pfrom->pfilter->insert(vData);
-            else {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), 100);
-            }
-        }
+/**
+ * Look up the blocks of a getcfilters or getcfheaders request: the blocks of
+ * the chain ending at hashStop from nStartHeight on, in height order, and the
+ * block before them. Peers that ask for something we do not serve are
+ * disconnected, as BIP 157 prescribes.
+ */
+static bool GetBlockFilterRequestBlocks(CNode* pfrom, uint8_t nFilterType, uint32_t nStartHeight, const uint256& hashStop, uint32_t nMaxCount, std::vector<uint256>& vHashes, uint256& hashPrev)
+{
+    if (!(nLocalServices & NODE_COMPACT_FILTERS) || nFilterType != BLOCK_FILTER_BASIC) {
+        LogPrint("net", "peer=%d requested unsupported block filter type %d\n", pfrom->id, nFilterType);
+        pfrom->fDisconnect = true;
+        return false;
     }
 
+    LOCK(cs_main);
+    BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+    if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second)) {
+        LogPrint("net", "peer=%d requested block filters up to unknown block %s\n", pfrom->id, hashStop.ToString());
+        pfrom->fDisconnect = true;
+        return false;
+    }
 
-    else if (strCommand == "filterclear") {
-        LOCK(pfrom->cs_filter);
-        delete pfrom->pfilter;
-        pfrom->pfilter = new CBloomFilter();
-        pfrom->fRelayTxes = true;
+    const CBlockIndex* pindex = mi->second;
+    if ((int64_t)nStartHeight > pindex->nHeight || pindex->nHeight - nStartHeight >= nMaxCount) {
+        LogPrint("net", "peer=%d requested invalid block filter range %u-%d\n", pfrom->id, nStartHeight, pindex->nHeight);
+        pfrom->fDisconnect = true;
+        return false;
     }
 
+    vHashes.resize(pindex->nHeight - nStartHeight + 1);
+    for (size_t i = vHashes.size(); i-- > 0; pindex = pindex->pprev)
+        vHashes[i] = pindex->GetBlockHash();
+    hashPrev = pindex ? pindex->GetBlockHash() : uint256();
+    return true;
+}
 
-    else if (strCommand == "reject") {
-        if (fDebug) {
-            try {
-                string strMsg;
-                unsigned char ccode;
-                string strReason;
-                vRecv >> LIMITED_STRING(strMsg, CMessageHeader::COMMAND_SIZE) >> ccode >> LIMITED_STRING(strReason, MAX_REJECT_MESSAGE_LENGTH);
+static bool ProcessMessageGetCFilters(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    uint8_t nFilterType;
+    uint32_t nStartHeight;
+    uint256 hashStop;
+    vRecv >> nFilterType >> nStartHeight >> hashStop;
 
-                ostringstream ss;
-                ss << strMsg << " code " << itostr(ccode) << ": " << strReason;
+    std::vector<uint256> vHashes;
+    uint256 hashPrev;
+    if (!GetBlockFilterRequestBlocks(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFILTERS_SIZE, vHashes, hashPrev))
+        return true;
 
-                if (strMsg == "block" || strMsg == "tx") {
-                    uint256 hash;
-                    vRecv >> hash;
-                    ss << ": hash " << hash.ToString();
-                }
-                LogPrint("net", "Reject %s\n", SanitizeString(ss.str()));
-            } catch (std::ios_base::failure& e) {
-                // Avoid feedback loops by preventing reject messages from triggering a new reject message.
-                LogPrint("net", "Unparseable reject message received\n");
-            }
+    BOOST_FOREACH (const uint256& hash, vHashes) {
+        std::vector<unsigned char> vchFilter;
+        if (!pblockfilterdb->ReadFilter(hash, vchFilter)) {
+            // The index has not caught up with the chain yet
+            LogPrint("net", "block filter of %s is not indexed yet, peer=%d\n", hash.ToString(), pfrom->id);
+            break;
         }
-    } else {
-        //probably one the extensions
-        obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
-        mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
-        budget.ProcessMessage(pfrom, strCommand, vRecv);
-        masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
-        ProcessMessageSwiftTX(pfrom, strCommand, vRecv);
-        ProcessSpork(pfrom, strCommand, vRecv);
-        masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+        pfrom->PushMessage("cfilter", nFilterType, hash, vchFilter);
     }
+    return true;
+}
+
+static bool ProcessMessageGetCFHeaders(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    uint8_t nFilterType;
+    uint32_t nStartHeight;
+    uint256 hashStop;
+    vRecv >> nFilterType >> nStartHeight >> hashStop;
 
+    std::vector<uint256> vHashes;
+    uint256 hashPrev;
+    if (!GetBlockFilterRequestBlocks(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFHEADERS_SIZE, vHashes, hashPrev))
+        return true;
+
+    uint256 hashFilter;
+    uint256 hashPrevHeader;
+    if (!hashPrev.IsNull() && !pblockfilterdb->ReadFilterHashes(hashPrev, hashFilter, hashPrevHeader)) {
+        LogPrint("net", "block filter of %s is not indexed yet, peer=%d\n", hashPrev.ToString(), pfrom->id);
+        return true;
+    }
 
+    std::vector<uint256> vFilterHashes;
+    vFilterHashes.reserve(vHashes.size());
+    BOOST_FOREACH (const uint256& hash, vHashes) {
+        uint256 hashHeader;
+        if (!pblockfilterdb->ReadFilterHashes(hash, hashFilter, hashHeader)) {
+            LogPrint("net", "block filter of %s is not indexed yet, peer=%d\n", hash.ToString(), pfrom->id);
+            return true;
+        }
+        vFilterHashes.push_back(hashFilter);
+    }
+    pfrom->PushMessage("cfheaders", nFilterType, hashStop, hashPrevHeader, vFilterHashes);
+    return true;
+}
+
+static bool ProcessMessageReject(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (fDebug) {
+        try {
+            string strMsg;
+            unsigned char ccode;
+            string strReason;
+            vRecv >> LIMITED_STRING(strMsg, CMessageHeader::COMMAND_SIZE) >> ccode >> LIMITED_STRING(strReason, MAX_REJECT_MESSAGE_LENGTH);
+
+            ostringstream ss;
+            ss << strMsg << " code " << itostr(ccode) << ": " << strReason;
+
+            if (strMsg == "block" || strMsg == "tx") {
+                uint256 hash;
+                vRecv >> hash;
+                ss << ": hash " << hash.ToString();
+            }
+            LogPrint("net", "Reject %s\n", SanitizeString(ss.str()));
+        } catch (std::ios_base::failure& e) {
+            // Avoid feedback loops by preventing reject messages from triggering a new reject message.
+            LogPrint("net", "Unparseable reject message received\n");
+        }
+    }
     return true;
 }
 
+static void RegisterMessageHandlers(CMessageDispatcher& dispatcher)
+{
+    dispatcher.Register("version", &ProcessMessageVersion);
+    dispatcher.Register("verack", &ProcessMessageVerack);
+    dispatcher.Register("sendcmpct", &ProcessMessageSendCmpct);
+    dispatcher.Register("addr", &ProcessMessageAddr);
+    dispatcher.Register("inv", &ProcessMessageInv);
+    dispatcher.Register("getdata", &ProcessMessageGetData);
+    dispatcher.Register("getblocks", &ProcessMessageGetBlocks);
+    dispatcher.Register("getheaders", &ProcessMessageGetHeaders);
+    dispatcher.Register("tx", &ProcessMessageTx);
+    dispatcher.Register("dstx", &ProcessMessageTx);
+    dispatcher.Register("headers", &ProcessMessageHeaders);
+    dispatcher.Register("block", &ProcessMessageBlock);
+    dispatcher.Register("cmpctblock", &ProcessMessageCmpctBlock);
+    dispatcher.Register("getblocktxn", &ProcessMessageGetBlockTxn);
+    dispatcher.Register("blocktxn", &ProcessMessageBlockTxn);
+    dispatcher.Register("getaddr", &ProcessMessageGetAddr);
+    dispatcher.Register("mempool", &ProcessMessageMempool);
+    dispatcher.Register("ping", &ProcessMessagePing);
+    dispatcher.Register("pong", &ProcessMessagePong);
+    dispatcher.Register("alert", &ProcessMessageAlert);
+    dispatcher.Register("filterload", &ProcessMessageFilterLoad);
+    dispatcher.Register("filteradd", &ProcessMessageFilterAdd);
+    dispatcher.Register("filterclear", &ProcessMessageFilterClear);
+    dispatcher.Register("getcfilters", &ProcessMessageGetCFilters);
+    dispatcher.Register("getcfheaders", &ProcessMessageGetCFHeaders);
+    dispatcher.Register("reject", &ProcessMessageReject);
+
+    obfuScationPool.RegisterMessageHandlers(dispatcher);
+    mnodeman.RegisterMessageHandlers(dispatcher);
+    budget.RegisterMessageHandlers(dispatcher);
+    masternodePayments.RegisterMessageHandlers(dispatcher);
+    RegisterSwiftTXMessageHandlers(dispatcher);
+    RegisterSporkMessageHandlers(dispatcher);
+    masternodeSync.RegisterMessageHandlers(dispatcher);
+}
+
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    RandAddSeedPerfmon();
+    LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
+    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0) {
+        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
+        return true;
+    }
+
+    if (pfrom->nVersion == 0 && strCommand != "version") {
+        // Must have a version message before anything else
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), 1);
+        return false;
+    }
+
+    return messageDispatcher.Dispatch(pfrom, strCommand, vRecv, nTimeReceived);
+}
+
 // Note: whenever a protocol update is needed toggle between both implementations (comment out the formerly active one)
 //       so we can leave the existing clients untouched (old SPORK will stay on so they don't see even older clients).
 //       Those old clients won't react to the changes of the other (new) SPORK because at the time of their implementation
@@ -6262,6 +7295,103 @@ int ActiveProtocol()
     return MIN_PEER_PROTO_VERSION_BEFORE_ENFORCEMENT;
 }
 
+static void AddMasternodeSigCheck(const CTxIn& vin, const std::vector<unsigned char>& vchSig, const std::string& strMessage, std::vector<CMessageSigCheck>& vChecks)
+{
+    CMasternode* pmn = mnodeman.Find(vin);
+    if (pmn)
+        vChecks.push_back(CMessageSigCheck(pmn->pubKeyMasternode, vchSig, strMessage));
+}
+
+/** Whether the sigTime of a ping is within the hour CMasternodePing::CheckAndUpdate accepts */
+static bool IsPingSigTimeValid(const CMasternodePing& mnp)
+{
+    int64_t nNow = GetAdjustedTime();
+    return mnp.sigTime <= nNow + 60 * 60 && mnp.sigTime > nNow - 60 * 60;
+}
+
+/**
+ * Add the signatures of a masternode message to vChecks. Messages that their
+ * handler drops without verifying a signature, because they were seen before
+ * or are out of date, are left out.
+ */
+static void GetMessageSigChecks(const std::string& strCommand, CDataStream& vRecv, std::vector<CMessageSigCheck>& vChecks)
+{
+    CDataStream ss(vRecv.begin(), vRecv.end(), vRecv.GetType(), vRecv.GetVersion());
+
+    if (strCommand == "mnb") {
+        CMasternodeBroadcast mnb;
+        ss >> mnb;
+        if (mnodeman.mapSeenMasternodeBroadcast.count(mnb.GetHash()) || mnb.sigTime > GetAdjustedTime() + 60 * 60 ||
+            mnb.lastPing == CMasternodePing() || !IsPingSigTimeValid(mnb.lastPing))
+            return;
+        vChecks.push_back(CMessageSigCheck(mnb.pubKeyCollateralAddress, mnb.sig, mnb.GetNewStrMessage(), mnb.GetOldStrMessage()));
+        vChecks.push_back(CMessageSigCheck(mnb.pubKeyMasternode, mnb.lastPing.vchSig, mnb.lastPing.GetStrMessage()));
+    } else if (strCommand == "mnp") {
+        CMasternodePing mnp;
+        ss >> mnp;
+        if (mnodeman.mapSeenMasternodePing.count(mnp.GetHash()) || !IsPingSigTimeValid(mnp))
+            return;
+        AddMasternodeSigCheck(mnp.vin, mnp.vchSig, mnp.GetStrMessage(), vChecks);
+    } else if (strCommand == "mnw") {
+        CMasternodePaymentWinner winner;
+        ss >> winner;
+        if (masternodePayments.mapMasternodePayeeVotes.count(winner.GetHash()))
+            return;
+        AddMasternodeSigCheck(winner.vinMasternode, winner.vchSig, winner.GetStrMessage(), vChecks);
+    } else if (strCommand == "mvote") {
+        CBudgetVote vote;
+        ss >> vote;
+        if (budget.mapSeenMasternodeBudgetVotes.count(vote.GetHash()))
+            return;
+        AddMasternodeSigCheck(vote.vin, vote.vchSig, vote.GetStrMessage(), vChecks);
+    } else if (strCommand == "fbvote") {
+        CFinalizedBudgetVote vote;
+        ss >> vote;
+        if (budget.mapSeenFinalizedBudgetVotes.count(vote.GetHash()))
+            return;
+        AddMasternodeSigCheck(vote.vin, vote.vchSig, vote.GetStrMessage(), vChecks);
+    } else if (strCommand == "txlvote") {
+        CConsensusVote vote;
+        ss >> vote;
+        if (mapTxLockVote.count(vote.GetHash()))
+            return;
+        AddMasternodeSigCheck(vote.vinMasternode, vote.vchMasterNodeSignature, vote.GetStrMessage(), vChecks);
+    }
+}
+
+/**
+ * Verify the signatures of the masternode messages that wait in the receive
+ * queue of pfrom in one batch on the signature check threads. The handlers
+ * verify them again when their turn comes, but then find the outcome in the
+ * cache, whether the signature was valid or not.
+ */
+static void CheckQueuedMessageSignatures(CNode* pfrom)
+{
+    if (fLiteMode || !nScriptCheckThreads || !masternodeSync.IsBlockchainSynced())
+        return;
+
+    // The messages that were looked at before are at the front of the queue
+    std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.end();
+    while (it != pfrom->vRecvMsg.begin() && !(it - 1)->fSigsChecked)
+        --it;
+
+    std::vector<CMessageSigCheck> vChecks;
+    for (; it != pfrom->vRecvMsg.end() && it->complete(); ++it) {
+        it->fSigsChecked = true;
+        if (!it->hdr.IsValid())
+            continue;
+        try {
+            GetMessageSigChecks(it->hdr.GetCommand(), it->vRecv, vChecks);
+        } catch (const std::exception&) {
+            // Malformed messages are dealt with by their handler
+        }
+    }
+
+    // A single signature is verified just as fast by the handler itself
+    if (vChecks.size() > 1)
+        obfuScationSigner.VerifyMessages(vChecks);
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -6284,6 +7414,9 @@ bool ProcessMessages(CNode* pfrom)
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
+    CheckQueuedMessageSignatures(pfrom);
+
+    pfrom->fValidationBacklog = false;
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -6302,6 +7435,12 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
+        // Leave blocks and transactions where they are until the validation thread has caught up
+        if (IsValidationCommand(msg.hdr.GetCommand()) && validationQueue.IsFull()) {
+            pfrom->fValidationBacklog = true;
+            break;
+        }
+
         // at this point, any failure means we can delete the current message
         it++;
 
@@ -6365,8 +7504,11 @@ bool ProcessMessages(CNode* pfrom)
     }
 
     // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
+    if (!pfrom->fDisconnect) {
+        for (std::deque<CNetMessage>::iterator itMsg = pfrom->vRecvMsg.begin(); itMsg != it; ++itMsg)
+            itMsg->releaseData();
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
@@ -6478,13 +7620,25 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (IsHeadersSyncPeer(pto)) {
+                    CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
+                } else {
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                }
             }
         }
 
+        // Continue fetching headers from a peer that was too far ahead once its blocks have caught up
+        if (state.fHeadersDeferred && state.pindexBestKnownBlock &&
+            state.pindexBestKnownBlock->nHeight <= chainActive.Height() + (int)BLOCK_DOWNLOAD_WINDOW &&
+            state.nHeadersPending < MAX_HEADERS_AHEAD_OF_TIP) {
+            state.fHeadersDeferred = false;
+            LogPrint("net", "more getheaders (%d) to end to peer=%d (startheight:%d)\n", state.pindexBestKnownBlock->nHeight, pto->id, pto->nStartingHeight);
+            pto->PushMessage("getheaders", chainActive.GetLocator(state.pindexBestKnownBlock), uint256(0));
+        }
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -6496,29 +7650,25 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
+            // Announce inventory in batches on a Poisson timer: a burst of votes or pings goes out
+            // as a few large invs instead of an inv per item, and the time an item is announced
+            // does not tell which peer it came from. New blocks and SwiftX locks do not wait.
+            int64_t nNow = GetTimeMicros();
+            bool fSendInv = pto->nNextInvSend < nNow;
+            if (fSendInv)
+                pto->nNextInvSend = PoissonNextSend(nNow, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL / 2);
+
+            size_t nWait = 0;
+            for (size_t i = 0; i < pto->vInventoryToSend.size(); i++) {
+                const CInv& inv = pto->vInventoryToSend[i];
                 if (pto->setInventoryKnown.count(inv))
                     continue;
 
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle) {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait) {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
+                if (!fSendInv && inv.type != MSG_BLOCK && inv.type != MSG_TXLOCK_REQUEST && inv.type != MSG_TXLOCK_VOTE) {
+                    pto->vInventoryToSend[nWait++] = inv;
+                    continue;
                 }
 
                 // returns true if wasn't already contained in the set
@@ -6530,7 +7680,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.resize(nWait);
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
@@ -6552,6 +7702,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!pto->fDisconnect && state.vBlocksInFlight.size() > 0 && state.vBlocksInFlight.front().nTime < nNow - 500000 * Params().TargetSpacing() * (4 + state.vBlocksInFlight.front().nValidatedQueuedBefore)) {
             LogPrintf("Timeout downloading block %s from peer=%d, disconnecting\n", state.vBlocksInFlight.front().hash.ToString(), pto->id);
             pto->fDisconnect = true;
+            // It announced a header, but does not deliver the block
+            map<uint256, NodeId>::iterator itHeader = mapHeaderSource.find(state.vBlocksInFlight.front().hash);
+            if (itHeader != mapHeaderSource.end() && itHeader->second == pto->GetId())
+                Misbehaving(pto->GetId(), 50);
         }
 
         //
@@ -44,6 +44,7 @@
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
+class CBlockFilterDB;
 class CBlockTreeDB;
 class CZerocoinDB;
 class CSporkDB;
@@ -102,6 +103,14 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Size of the blocks downloaded ahead of a missing parent that are kept in memory. */
+static const size_t MAX_BLOCKS_AWAITING_PARENT_SIZE = 32 * 1024 * 1024;
+/** How far past the active chain tip proof-of-stake headers are accepted before their blocks have arrived. */
+static const int MAX_HEADERS_AHEAD_OF_TIP = 2 * BLOCK_DOWNLOAD_WINDOW;
+/** Maximum depth of a block that is still served as a cmpctblock; older blocks are sent in full. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of a block whose transactions are served through getblocktxn; older blocks are sent in full. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
@@ -113,6 +122,12 @@ static const CAmount MASTERNODE_COLLATERAL_NEW = 10000 * COIN;
 
 /** Enable bloom filter */
  static const bool DEFAULT_PEERBLOOMFILTERS = true;
+/** Maintain an index of BIP 158 block filters and serve them to peers */
+static const bool DEFAULT_BLOCKFILTERINDEX = false;
+/** Maximum number of filters that can be requested in one getcfilters message */
+static const unsigned int MAX_GETCFILTERS_SIZE = 1000;
+/** Maximum number of filter hashes that can be requested in one getcfheaders message */
+static const unsigned int MAX_GETCFHEADERS_SIZE = 2000;
 
 /** "reject" message codes */
 static const unsigned char REJECT_MALFORMED = 0x01;
@@ -145,10 +160,25 @@ extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 extern bool fVerifyingBlocks;
+/** Ancestors of this block skip script and zerocoin proof checks (-assumevalid); 0 if disabled */
+extern uint256 hashAssumeValid;
+
+/** Verification work skipped because of -assumevalid. Protected by cs_main. */
+struct CAssumeValidStats {
+    //! blocks connected without script checks
+    int64_t nBlocks;
+    //! transaction inputs whose scripts were not verified
+    int64_t nInputs;
+    //! zerocoin spends whose proofs were not verified
+    int64_t nZerocoinSpends;
+
+    CAssumeValidStats() : nBlocks(0), nInputs(0), nZerocoinSpends(0) {}
+};
+extern CAssumeValidStats assumeValidStats;
 
 extern bool fLargeWorkForkFound;
 extern bool fLargeWorkInvalidChainFound;
@@ -224,6 +254,10 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run validation of blocks and transactions received from peers */
+void ThreadValidation();
+/** Build the block filter index up to the tip and keep it there */
+void ThreadBlockFilterIndex();
 
 // ***TODO*** probably not the right place for these 2
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -268,6 +302,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
 int GetInputAge(CTxIn& vin);
+/** Look up an unspent output of the active chain and the height it was created at, without reading blocks */
+bool GetUnspentOutput(const COutPoint& outpoint, CTxOut& txoutRet, int& nHeightRet);
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin);
 bool GetCoinAge(const CTransaction& tx, unsigned int nTxTime, uint64_t& nCoinAge);
 int GetIXConfirmations(uint256 nTXHash);
@@ -358,7 +394,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
 void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCache& inputs, CTxUndo& txundo, int nHeight);
 
 /** Context-independent validity checks */
-bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state);
+bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state, bool fAssumeValid = false);
 bool CheckZerocoinMint(const uint256& txHash, const CTxOut& txout, CValidationState& state, bool fCheckOnly = false);
 bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state);
 bool ContextualCheckZerocoinSpend(const CTransaction& tx, const libzerocoin::CoinSpend& spend, CBlockIndex* pindex);
@@ -476,7 +512,7 @@ bool TestBlockValidity(CValidationState& state, const CBlock& block, CBlockIndex
 
 /** Store block on disk. If dbp is provided, the file is known to already reside on disk */
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** pindex, CDiskBlockPos* dbp = NULL, bool fAlreadyCheckedBlock = false);
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex = NULL);
+bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex** ppindex = NULL);
 
 
 class CBlockFileInfo
@@ -643,6 +679,9 @@ extern CZerocoinDB* zerocoinDB;
 /** Global variable that points to the spork database (protected by cs_main) */
 extern CSporkDB* pSporkDB;
 
+/** Global variable that points to the block filter index, NULL unless -blockfilterindex is set */
+extern CBlockFilterDB* pblockfilterdb;
+
 struct CBlockTemplate {
     CBlock block;
     std::vector<CAmount> vTxFees;
@@ -10,12 +10,17 @@
 #include "masternode-budget.h"
 #include "masternode-sync.h"
 #include "masternode.h"
+#include "masternodedb.h"
 #include "masternodeman.h"
+#include "messagedispatch.h"
 #include "obfuscation.h"
 #include "util.h"
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include <limits>
+
 CBudgetManager budget;
 CCriticalSection cs_budget;
 
@@ -116,31 +121,16 @@ bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, s
     }
 }
 
+// Orphan votes are applied when their proposal or budget is added; this only drops the ones that waited too long
 void CBudgetManager::CheckOrphanVotes()
 {
     LOCK(cs);
 
+    int64_t nNow = GetTime();
+    unsigned int nExpired = orphanBudgetVotes.Expire(nNow) + orphanFinalizedBudgetVotes.Expire(nNow);
 
-    std::string strError = "";
-    std::map<uint256, CBudgetVote>::iterator it1 = mapOrphanMasternodeBudgetVotes.begin();
-    while (it1 != mapOrphanMasternodeBudgetVotes.end()) {
-        if (budget.UpdateProposal(((*it1).second), NULL, strError)) {
-            LogPrint("mnbudget","CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
-            mapOrphanMasternodeBudgetVotes.erase(it1++);
-        } else {
-            ++it1;
-        }
-    }
-    std::map<uint256, CFinalizedBudgetVote>::iterator it2 = mapOrphanFinalizedBudgetVotes.begin();
-    while (it2 != mapOrphanFinalizedBudgetVotes.end()) {
-        if (budget.UpdateFinalizedBudget(((*it2).second), NULL, strError)) {
-            LogPrint("mnbudget","CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
-            mapOrphanFinalizedBudgetVotes.erase(it2++);
-        } else {
-            ++it2;
-        }
-    }
-    LogPrint("mnbudget","CBudgetManager::CheckOrphanVotes - Done\n");
+    LogPrint("mnbudget","CBudgetManager::CheckOrphanVotes - Removed %u expired orphan votes, %u proposal and %u finalized budget votes left\n",
+        nExpired, orphanBudgetVotes.size(), orphanFinalizedBudgetVotes.size());
 }
 
 void CBudgetManager::SubmitFinalBudget()
@@ -273,171 +263,26 @@ void CBudgetManager::SubmitFinalBudget()
     LogPrint("mnbudget","CBudgetManager::SubmitFinalBudget - Done! %s\n", finalizedBudgetBroadcast.GetHash().ToString());
 }
 
-//
-// CBudgetDB
-//
-
-CBudgetDB::CBudgetDB()
-{
-    pathDB = GetDataDir() / "budget.dat";
-    strMagicMessage = "MasternodeBudget";
-}
-
-bool CBudgetDB::Write(const CBudgetManager& objToSave)
-{
-    LOCK(objToSave.cs);
-
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
-
-    LogPrint("mnbudget","Written info to budget.dat  %dms\n", GetTimeMillis() - nStart);
-
-    return true;
-}
-
-CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
-{
-    LOCK(objToLoad.cs);
-
-    int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
-
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-
-        // de-serialize data into CBudgetManager object
-        ssObj >> objToLoad;
-    } catch (std::exception& e) {
-        objToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
-    }
-
-    LogPrint("mnbudget","Loaded info from budget.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrint("mnbudget","  %s\n", objToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("mnbudget","Budget manager - cleaning....\n");
-        objToLoad.CheckAndRemove();
-        LogPrint("mnbudget","Budget manager - result:\n");
-        LogPrint("mnbudget","  %s\n", objToLoad.ToString());
-    }
-
-    return Ok;
-}
-
-void DumpBudgets()
-{
-    int64_t nStart = GetTimeMillis();
-
-    CBudgetDB budgetdb;
-    CBudgetManager tempBudget;
-
-    LogPrint("mnbudget","Verifying budget.dat format...\n");
-    CBudgetDB::ReadResult readResult = budgetdb.Read(tempBudget, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CBudgetDB::FileError)
-        LogPrint("mnbudget","Missing budgets file - budget.dat, will try to recreate\n");
-    else if (readResult != CBudgetDB::Ok) {
-        LogPrint("mnbudget","Error reading budget.dat: ");
-        if (readResult == CBudgetDB::IncorrectFormat)
-            LogPrint("mnbudget","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("mnbudget","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrint("mnbudget","Writting info to budget.dat...\n");
-    budgetdb.Write(budget);
-
-    LogPrint("mnbudget","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
-}
-
 bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
 {
+    LOCK(cs);
     std::string strError = "";
     if (!finalizedBudget.IsValid(strError)) return false;
 
-    if (mapFinalizedBudgets.count(finalizedBudget.GetHash())) {
+    uint256 hash = finalizedBudget.GetHash();
+    if (mapFinalizedBudgets.count(hash)) {
         return false;
     }
 
-    mapFinalizedBudgets.insert(make_pair(finalizedBudget.GetHash(), finalizedBudget));
+    mapFinalizedBudgets.insert(make_pair(hash, finalizedBudget));
+
+    //we might have votes for this budget that are valid now
+    std::vector<CFinalizedBudgetVote> vOrphanVotes;
+    orphanFinalizedBudgetVotes.Release(hash, vOrphanVotes);
+    BOOST_FOREACH (CFinalizedBudgetVote& vote, vOrphanVotes) {
+        if (UpdateFinalizedBudget(vote, NULL, strError))
+            LogPrint("mnbudget","CBudgetManager::AddFinalizedBudget - Budget is known, activating orphan vote %s\n", vote.GetHash().ToString());
+    }
     return true;
 }
 
@@ -454,8 +299,18 @@ bool CBudgetManager::AddProposal(CBudgetProposal& budgetProposal)
         return false;
     }
 
-    mapProposals.insert(make_pair(budgetProposal.GetHash(), budgetProposal));
+    uint256 hash = budgetProposal.GetHash();
+    mapProposals.insert(make_pair(hash, budgetProposal));
+    nProposalsVersion++;
     LogPrint("mnbudget","CBudgetManager::AddProposal - proposal %s added\n", budgetProposal.GetName ().c_str ());
+
+    //We might have votes for this proposal that are valid now
+    std::vector<CBudgetVote> vOrphanVotes;
+    orphanBudgetVotes.Release(hash, vOrphanVotes);
+    BOOST_FOREACH (CBudgetVote& vote, vOrphanVotes) {
+        if (UpdateProposal(vote, NULL, strError))
+            LogPrint("mnbudget","CBudgetManager::AddProposal - Proposal is known, activating orphan vote %s\n", vote.GetHash().ToString());
+    }
     return true;
 }
 
@@ -525,6 +380,7 @@ void CBudgetManager::CheckAndRemove()
     // Remove invalid entries by overwriting complete map
     mapFinalizedBudgets.swap(tmpMapFinalizedBudgets);
     mapProposals.swap(tmpMapProposals);
+    nProposalsVersion++;
 
     // clang doesn't accept copy assignemnts :-/
     // mapFinalizedBudgets = tmpMapFinalizedBudgets;
@@ -758,6 +614,7 @@ std::vector<CBudgetProposal*> CBudgetManager::GetAllProposals()
 
         ++it;
     }
+    nProposalsVersion++;
 
     return vBudgetProposalRet;
 }
@@ -779,6 +636,25 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
 {
     LOCK(cs);
 
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    if (pindexPrev == NULL) return std::vector<CBudgetProposal*>();
+
+    int nCountThreshold = mnodeman.CountEnabled(ActiveProtocol()) / 10;
+
+    // The budget only changes with the proposals and their votes, with the chain through the
+    // payment cycle, with the vote threshold and as proposals become established, so reuse the
+    // last one while none of these changed
+    if (nBudgetCacheVersion == nProposalsVersion && hashBudgetCacheBlock == pindexPrev->GetBlockHash() &&
+        nBudgetCacheThreshold == nCountThreshold && GetTime() <= nBudgetCacheExpires) {
+        std::vector<CBudgetProposal*> vBudgetProposalsRet;
+        BOOST_FOREACH (const uint256& hash, vBudgetCache) {
+            std::map<uint256, CBudgetProposal>::iterator it = mapProposals.find(hash);
+            if (it == mapProposals.end()) break;
+            vBudgetProposalsRet.push_back(&(it->second));
+        }
+        if (vBudgetProposalsRet.size() == vBudgetCache.size()) return vBudgetProposalsRet;
+    }
+
     // ------- Sort budgets by Yes Count
 
     std::vector<std::pair<CBudgetProposal*, int> > vBudgetPorposalsSort;
@@ -797,8 +673,7 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
     std::vector<CBudgetProposal*> vBudgetProposalsRet;
 
     CAmount nBudgetAllocated = 0;
-    CBlockIndex* pindexPrev = chainActive.Tip();
-    if (pindexPrev == NULL) return vBudgetProposalsRet;
+    int64_t nExpires = std::numeric_limits<int64_t>::max();
 
     int nBlockStart = pindexPrev->nHeight - pindexPrev->nHeight % GetBudgetPaymentCycleBlocks() + GetBudgetPaymentCycleBlocks();
     int nBlockEnd = nBlockStart + GetBudgetPaymentCycleBlocks() - 1;
@@ -813,12 +688,12 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
         //prop start/end should be inside this period
         if (pbudgetProposal->fValid && pbudgetProposal->nBlockStart <= nBlockStart &&
             pbudgetProposal->nBlockEnd >= nBlockEnd &&
-            pbudgetProposal->GetYeas() - pbudgetProposal->GetNays() > mnodeman.CountEnabled(ActiveProtocol()) / 10 &&
+            pbudgetProposal->GetYeas() - pbudgetProposal->GetNays() > nCountThreshold &&
             pbudgetProposal->IsEstablished()) {
 
             LogPrint("mnbudget","CBudgetManager::GetBudget() -   Check 1 passed: valid=%d | %ld <= %ld | %ld >= %ld | Yeas=%d Nays=%d Count=%d | established=%d\n",
                       pbudgetProposal->fValid, pbudgetProposal->nBlockStart, nBlockStart, pbudgetProposal->nBlockEnd,
-                      nBlockEnd, pbudgetProposal->GetYeas(), pbudgetProposal->GetNays(), mnodeman.CountEnabled(ActiveProtocol()) / 10,
+                      nBlockEnd, pbudgetProposal->GetYeas(), pbudgetProposal->GetNays(), nCountThreshold,
                       pbudgetProposal->IsEstablished());
 
             if (pbudgetProposal->GetAmount() + nBudgetAllocated <= nTotalBudget) {
@@ -834,13 +709,23 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
         else {
             LogPrint("mnbudget","CBudgetManager::GetBudget() -   Check 1 failed: valid=%d | %ld <= %ld | %ld >= %ld | Yeas=%d Nays=%d Count=%d | established=%d\n",
                       pbudgetProposal->fValid, pbudgetProposal->nBlockStart, nBlockStart, pbudgetProposal->nBlockEnd,
-                      nBlockEnd, pbudgetProposal->GetYeas(), pbudgetProposal->GetNays(), mnodeman.CountEnabled(ActiveProtocol()) / 10,
+                      nBlockEnd, pbudgetProposal->GetYeas(), pbudgetProposal->GetNays(), nCountThreshold,
                       pbudgetProposal->IsEstablished());
+            if (!pbudgetProposal->IsEstablished())
+                nExpires = std::min(nExpires, pbudgetProposal->GetEstablishedTime());
         }
 
         ++it2;
     }
 
+    vBudgetCache.clear();
+    BOOST_FOREACH (CBudgetProposal* pbudgetProposal, vBudgetProposalsRet)
+        vBudgetCache.push_back(pbudgetProposal->GetHash());
+    hashBudgetCacheBlock = pindexPrev->GetBlockHash();
+    nBudgetCacheVersion = nProposalsVersion;
+    nBudgetCacheThreshold = nCountThreshold;
+    nBudgetCacheExpires = nExpires;
+
     return vBudgetProposalsRet;
 }
 
@@ -987,6 +872,7 @@ void CBudgetManager::NewBlock()
 
 
     CheckAndRemove();
+    CheckOrphanVotes();
 
     //remove invalid votes once in a while (we have to check the signatures and validity of every vote, somewhat CPU intensive)
 
@@ -1006,6 +892,7 @@ void CBudgetManager::NewBlock()
         (*it2).second.CleanAndRemove(false);
         ++it2;
     }
+    nProposalsVersion++;
 
     LogPrint("mnbudget","CBudgetManager::NewBlock - mapFinalizedBudgets cleanup - size: %d\n", mapFinalizedBudgets.size());
     std::map<uint256, CFinalizedBudget>::iterator it3 = mapFinalizedBudgets.begin();
@@ -1067,6 +954,16 @@ void CBudgetManager::NewBlock()
     LogPrint("mnbudget","CBudgetManager::NewBlock - PASSED\n");
 }
 
+void CBudgetManager::RegisterMessageHandlers(CMessageDispatcher& dispatcher)
+{
+    CMessageDispatcher::ExtensionHandler handler = boost::bind(&CBudgetManager::ProcessMessage, this, _1, _2, _3);
+    dispatcher.RegisterExtension("mnvs", handler);
+    dispatcher.RegisterExtension("mprop", handler);
+    dispatcher.RegisterExtension("mvote", handler);
+    dispatcher.RegisterExtension("fbs", handler);
+    dispatcher.RegisterExtension("fbvote", handler);
+}
+
 void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     // lite mode is not supported
@@ -1125,9 +1022,6 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         masternodeSync.AddedBudgetItem(budgetProposalBroadcast.GetHash());
 
         LogPrint("mnbudget","mprop - new budget - %s\n", budgetProposalBroadcast.GetHash().ToString());
-
-        //We might have active votes for this proposal that are valid now
-        CheckOrphanVotes();
     }
 
     if (strCommand == "mvote") { //Masternode Vote
@@ -1200,9 +1094,6 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             finalizedBudgetBroadcast.Relay();
         }
         masternodeSync.AddedBudgetItem(finalizedBudgetBroadcast.GetHash());
-
-        //we might have active votes for this budget that are now valid
-        CheckOrphanVotes();
     }
 
     if (strCommand == "fbvote") { //Finalized Budget Vote
@@ -1407,7 +1298,7 @@ bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string
             if (!masternodeSync.IsSynced()) return false;
 
             LogPrint("mnbudget","CBudgetManager::UpdateProposal - Unknown proposal %d, asking for source proposal\n", vote.nProposalHash.ToString());
-            mapOrphanMasternodeBudgetVotes[vote.nProposalHash] = vote;
+            orphanBudgetVotes.Add(vote.nProposalHash, vote, pfrom->GetId(), GetTime());
 
             if (!askedForSourceProposalOrBudget.count(vote.nProposalHash)) {
                 pfrom->PushMessage("mnvs", vote.nProposalHash);
@@ -1420,7 +1311,11 @@ bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string
     }
 
 
-    return mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError);
+    if (!mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError))
+        return false;
+
+    nProposalsVersion++;
+    return true;
 }
 
 bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pfrom, std::string& strError)
@@ -1434,7 +1329,7 @@ bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pf
             if (!masternodeSync.IsSynced()) return false;
 
             LogPrint("mnbudget","CBudgetManager::UpdateFinalizedBudget - Unknown Finalized Proposal %s, asking for source budget\n", vote.nBudgetHash.ToString());
-            mapOrphanFinalizedBudgetVotes[vote.nBudgetHash] = vote;
+            orphanFinalizedBudgetVotes.Add(vote.nBudgetHash, vote, pfrom->GetId(), GetTime());
 
             if (!askedForSourceProposalOrBudget.count(vote.nBudgetHash)) {
                 pfrom->PushMessage("mnvs", vote.nBudgetHash);
@@ -1457,6 +1352,7 @@ CBudgetProposal::CBudgetProposal()
     nAmount = 0;
     nTime = 0;
     fValid = true;
+    RecountVotes();
 }
 
 CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strURLIn, int nBlockStartIn, int nBlockEndIn, CScript addressIn, CAmount nAmountIn, uint256 nFeeTXHashIn)
@@ -1469,6 +1365,7 @@ CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strU
     nAmount = nAmountIn;
     nFeeTXHash = nFeeTXHashIn;
     fValid = true;
+    RecountVotes();
 }
 
 CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
@@ -1482,6 +1379,11 @@ CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
     nTime = other.nTime;
     nFeeTXHash = other.nFeeTXHash;
     mapVotes = other.mapVotes;
+    nYeas = other.nYeas;
+    nNays = other.nNays;
+    nAbstains = other.nAbstains;
+    nYeasCast = other.nYeasCast;
+    nNaysCast = other.nNaysCast;
     fValid = true;
 }
 
@@ -1589,7 +1491,10 @@ bool CBudgetProposal::AddOrUpdateVote(CBudgetVote& vote, std::string& strError)
         return false;
     }
 
+    std::map<uint256, CBudgetVote>::iterator it = mapVotes.find(hash);
+    if (it != mapVotes.end()) CountVote(it->second, -1);
     mapVotes[hash] = vote;
+    CountVote(vote, 1);
     LogPrint("mnbudget", "CBudgetProposal::AddOrUpdateVote - %s %s\n", strAction.c_str(), vote.GetHash().ToString().c_str());
 
     return true;
@@ -1604,63 +1509,55 @@ void CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
         (*it).second.fValid = (*it).second.SignatureValid(fSignatureCheck);
         ++it;
     }
+
+    RecountVotes();
 }
 
-double CBudgetProposal::GetRatio()
+void CBudgetProposal::CountVote(const CBudgetVote& vote, int nDelta)
 {
-    int yeas = 0;
-    int nays = 0;
+    if (vote.nVote == VOTE_YES) {
+        nYeasCast += nDelta;
+        if (vote.fValid) nYeas += nDelta;
+    } else if (vote.nVote == VOTE_NO) {
+        nNaysCast += nDelta;
+        if (vote.fValid) nNays += nDelta;
+    } else if (vote.nVote == VOTE_ABSTAIN) {
+        if (vote.fValid) nAbstains += nDelta;
+    }
+}
 
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
+void CBudgetProposal::RecountVotes()
+{
+    nYeas = nNays = nAbstains = 0;
+    nYeasCast = nNaysCast = 0;
 
+    std::map<uint256, CBudgetVote>::const_iterator it = mapVotes.begin();
     while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES) yeas++;
-        if ((*it).second.nVote == VOTE_NO) nays++;
+        CountVote((*it).second, 1);
         ++it;
     }
+}
 
-    if (yeas + nays == 0) return 0.0f;
+double CBudgetProposal::GetRatio()
+{
+    if (nYeasCast + nNaysCast == 0) return 0.0f;
 
-    return ((double)(yeas) / (double)(yeas + nays));
+    return ((double)(nYeasCast) / (double)(nYeasCast + nNaysCast));
 }
 
 int CBudgetProposal::GetYeas()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    return nYeas;
 }
 
 int CBudgetProposal::GetNays()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_NO && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    return nNays;
 }
 
 int CBudgetProposal::GetAbstains()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_ABSTAIN && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    return nAbstains;
 }
 
 int CBudgetProposal::GetBlockStartCycle()
@@ -1760,6 +1657,11 @@ void CBudgetVote::Relay()
     RelayInv(inv);
 }
 
+std::string CBudgetVote::GetStrMessage()
+{
+    return vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+}
+
 bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 {
     // Choose coins to use
@@ -1767,7 +1669,7 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("mnbudget","CBudgetVote::Sign - Error upon calling SignMessage");
@@ -1785,7 +1687,7 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 bool CBudgetVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     CMasternode* pmn = mnodeman.Find(vin);
 
@@ -2265,6 +2167,11 @@ void CFinalizedBudgetVote::Relay()
     RelayInv(inv);
 }
 
+std::string CFinalizedBudgetVote::GetStrMessage()
+{
+    return vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+}
+
 bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 {
     // Choose coins to use
@@ -2272,7 +2179,7 @@ bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("mnbudget","CFinalizedBudgetVote::Sign - Error upon calling SignMessage");
@@ -2291,7 +2198,7 @@ bool CFinalizedBudgetVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
 
-    std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     CMasternode* pmn = mnodeman.Find(vin);
 
@@ -2318,3 +2225,43 @@ std::string CBudgetManager::ToString() const
 
     return info.str();
 }
+
+void CBudgetManager::WriteCache(CMasternodeCacheDB& db)
+{
+    LOCK(cs);
+
+    db.WriteTable(MNCACHE_SEEN_PROPOSALS, mapSeenMasternodeBudgetProposals);
+    db.WriteAddedEntries(MNCACHE_SEEN_PROPOSAL_VOTES, mapSeenMasternodeBudgetVotes);
+    db.WriteTable(MNCACHE_SEEN_FINALIZED_BUDGETS, mapSeenFinalizedBudgets);
+    db.WriteAddedEntries(MNCACHE_SEEN_FINALIZED_VOTES, mapSeenFinalizedBudgetVotes);
+    db.WriteTable(MNCACHE_ORPHAN_PROPOSAL_VOTES, orphanBudgetVotes.GetVotes());
+    db.WriteTable(MNCACHE_ORPHAN_FINALIZED_VOTES, orphanFinalizedBudgetVotes.GetVotes());
+
+    db.WriteTable(MNCACHE_PROPOSALS, mapProposals);
+    db.WriteTable(MNCACHE_FINALIZED_BUDGETS, mapFinalizedBudgets);
+}
+
+bool CBudgetManager::ReadCache(CMasternodeCacheDB& db)
+{
+    LOCK(cs);
+
+    nProposalsVersion++;
+    std::map<uint256, std::pair<CBudgetVote, int64_t> > mapOrphanBudgetVotes;
+    std::map<uint256, std::pair<CFinalizedBudgetVote, int64_t> > mapOrphanFinalizedBudgetVotes;
+    if (!db.ReadTable(MNCACHE_SEEN_PROPOSALS, mapSeenMasternodeBudgetProposals) ||
+        !db.ReadTable(MNCACHE_SEEN_PROPOSAL_VOTES, mapSeenMasternodeBudgetVotes) ||
+        !db.ReadTable(MNCACHE_SEEN_FINALIZED_BUDGETS, mapSeenFinalizedBudgets) ||
+        !db.ReadTable(MNCACHE_SEEN_FINALIZED_VOTES, mapSeenFinalizedBudgetVotes) ||
+        !db.ReadTable(MNCACHE_ORPHAN_PROPOSAL_VOTES, mapOrphanBudgetVotes) ||
+        !db.ReadTable(MNCACHE_ORPHAN_FINALIZED_VOTES, mapOrphanFinalizedBudgetVotes) ||
+        !db.ReadTable(MNCACHE_PROPOSALS, mapProposals) ||
+        !db.ReadTable(MNCACHE_FINALIZED_BUDGETS, mapFinalizedBudgets))
+        return false;
+
+    // the orphan votes are queued again with the time they had left, from no peer in particular
+    for (std::map<uint256, std::pair<CBudgetVote, int64_t> >::iterator it = mapOrphanBudgetVotes.begin(); it != mapOrphanBudgetVotes.end(); ++it)
+        orphanBudgetVotes.Restore(it->second.first.nProposalHash, it->second.first, it->second.second);
+    for (std::map<uint256, std::pair<CFinalizedBudgetVote, int64_t> >::iterator it = mapOrphanFinalizedBudgetVotes.begin(); it != mapOrphanFinalizedBudgetVotes.end(); ++it)
+        orphanFinalizedBudgetVotes.Restore(it->second.first.nBudgetHash, it->second.first, it->second.second);
+    return true;
+}
@@ -12,8 +12,12 @@
 #include "main.h"
 #include "masternode.h"
 #include "net.h"
+#include "random.h"
 #include "sync.h"
 #include "util.h"
+
+#include <set>
+
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -26,6 +30,8 @@ class CFinalizedBudget;
 class CBudgetProposal;
 class CBudgetProposalBroadcast;
 class CTxBudgetPayment;
+class CMasternodeCacheDB;
+class CMessageDispatcher;
 
 #define VOTE_ABSTAIN 0
 #define VOTE_YES 1
@@ -42,13 +48,17 @@ static const CAmount PROPOSAL_FEE_TX = (50 * COIN);
 static const CAmount BUDGET_FEE_TX_OLD = (50 * COIN);
 static const CAmount BUDGET_FEE_TX = (5 * COIN);
 static const int64_t BUDGET_VOTE_UPDATE_MIN = 60 * 60;
+//! Most votes of one kind waiting for their proposal or finalized budget, in total and from one peer
+static const unsigned int BUDGET_ORPHAN_VOTES_MAX = 20000;
+static const unsigned int BUDGET_ORPHAN_VOTES_PER_PEER = 2000;
+//! How long a vote waits for its proposal or finalized budget
+static const int64_t BUDGET_ORPHAN_VOTE_EXPIRY = 2 * 60 * 60;
 static map<uint256, int> mapPayment_History;
 
 extern std::vector<CBudgetProposalBroadcast> vecImmatureBudgetProposals;
 extern std::vector<CFinalizedBudgetBroadcast> vecImmatureFinalizedBudgets;
 
 extern CBudgetManager budget;
-void DumpBudgets();
 
 // Define amount of blocks in budget payment cycle
 int GetBudgetPaymentCycleBlocks();
@@ -74,6 +84,7 @@ public:
     CBudgetVote();
     CBudgetVote(CTxIn vin, uint256 nProposalHash, int nVoteIn);
 
+    std::string GetStrMessage();
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool SignatureValid(bool fSignatureCheck);
     void Relay();
@@ -126,6 +137,7 @@ public:
     CFinalizedBudgetVote();
     CFinalizedBudgetVote(CTxIn vinIn, uint256 nBudgetHashIn);
 
+    std::string GetStrMessage();
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool SignatureValid(bool fSignatureCheck);
     void Relay();
@@ -151,30 +163,151 @@ public:
     }
 };
 
-/** Save Budget Manager (budget.dat)
+/**
+ * Votes that arrived before the proposal or finalized budget they are for.
+ *
+ * The votes are indexed by the hash of that parent, so they can be taken out
+ * as soon as it arrives, and expire after BUDGET_ORPHAN_VOTE_EXPIRY. Like the
+ * orphan transactions, a random vote is evicted when the queue is full, and
+ * one peer can only fill a part of it.
  */
-class CBudgetDB
+template <typename Vote>
+class CBudgetOrphanVotes
 {
 private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
+    struct COrphanVote {
+        Vote vote;
+        uint256 hashParent;
+        NodeId fromPeer;
+        int64_t nTimeExpire;
+    };
+
+    typedef typename std::map<uint256, COrphanVote>::iterator OrphanIt;
+
+    // by vote hash
+    std::map<uint256, COrphanVote> mapOrphans;
+    std::map<uint256, std::set<uint256> > mapOrphansByParent;
+    std::map<NodeId, unsigned int> mapOrphansPerPeer;
+
+    void Erase(OrphanIt it)
+    {
+        typename std::map<uint256, std::set<uint256> >::iterator itParent = mapOrphansByParent.find(it->second.hashParent);
+        if (itParent != mapOrphansByParent.end()) {
+            itParent->second.erase(it->first);
+            if (itParent->second.empty())
+                mapOrphansByParent.erase(itParent);
+        }
+
+        std::map<NodeId, unsigned int>::iterator itPeer = mapOrphansPerPeer.find(it->second.fromPeer);
+        if (itPeer != mapOrphansPerPeer.end() && --itPeer->second == 0)
+            mapOrphansPerPeer.erase(itPeer);
+
+        mapOrphans.erase(it);
+    }
+
+    void Insert(const uint256& hash, const uint256& hashParent, const Vote& vote, NodeId peer, int64_t nTimeExpire)
+    {
+        while (mapOrphans.size() >= BUDGET_ORPHAN_VOTES_MAX) {
+            OrphanIt it = mapOrphans.lower_bound(GetRandHash());
+            if (it == mapOrphans.end())
+                it = mapOrphans.begin();
+            Erase(it);
+        }
+
+        COrphanVote& orphan = mapOrphans[hash];
+        orphan.vote = vote;
+        orphan.hashParent = hashParent;
+        orphan.fromPeer = peer;
+        orphan.nTimeExpire = nTimeExpire;
+        mapOrphansByParent[hashParent].insert(hash);
+        mapOrphansPerPeer[peer]++;
+    }
 
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
+    //! Queue a vote for hashParent; returns false if it is already queued or its peer has too many
+    bool Add(const uint256& hashParent, const Vote& voteIn, NodeId peer, int64_t nNow)
+    {
+        Vote vote(voteIn);
+        uint256 hash = vote.GetHash();
+        if (mapOrphans.count(hash))
+            return false;
 
-    CBudgetDB();
-    bool Write(const CBudgetManager& objToSave);
-    ReadResult Read(CBudgetManager& objToLoad, bool fDryRun = false);
-};
+        std::map<NodeId, unsigned int>::iterator itPeer = mapOrphansPerPeer.find(peer);
+        if (itPeer != mapOrphansPerPeer.end() && itPeer->second >= BUDGET_ORPHAN_VOTES_PER_PEER)
+            return false;
+
+        Insert(hash, hashParent, vote, peer, nNow + BUDGET_ORPHAN_VOTE_EXPIRY);
+        return true;
+    }
+
+    //! Queue a vote read from the cache again, with the expiry time it had. Such votes count against no peer.
+    bool Restore(const uint256& hashParent, const Vote& voteIn, int64_t nTimeExpire)
+    {
+        Vote vote(voteIn);
+        uint256 hash = vote.GetHash();
+        if (mapOrphans.count(hash))
+            return false;
+
+        Insert(hash, hashParent, vote, -1, nTimeExpire);
+        return true;
+    }
+
+    //! Take the votes waiting for hashParent out of the queue
+    void Release(const uint256& hashParent, std::vector<Vote>& vVotes)
+    {
+        typename std::map<uint256, std::set<uint256> >::iterator itParent = mapOrphansByParent.find(hashParent);
+        if (itParent == mapOrphansByParent.end())
+            return;
+
+        std::set<uint256> setHashes;
+        setHashes.swap(itParent->second);
+        BOOST_FOREACH (const uint256& hash, setHashes) {
+            OrphanIt it = mapOrphans.find(hash);
+            if (it == mapOrphans.end())
+                continue;
+            vVotes.push_back(it->second.vote);
+            Erase(it);
+        }
+    }
 
+    //! Drop the votes that waited too long; returns how many were dropped
+    unsigned int Expire(int64_t nNow)
+    {
+        unsigned int nExpired = 0;
+        OrphanIt it = mapOrphans.begin();
+        while (it != mapOrphans.end()) {
+            OrphanIt itErase = it++;
+            if (itErase->second.nTimeExpire <= nNow) {
+                Erase(itErase);
+                nExpired++;
+            }
+        }
+        return nExpired;
+    }
+
+    //! The queued votes and their expiry times by vote hash, for the cache
+    std::map<uint256, std::pair<Vote, int64_t> > GetVotes() const
+    {
+        std::map<uint256, std::pair<Vote, int64_t> > mapVotes;
+        for (typename std::map<uint256, COrphanVote>::const_iterator it = mapOrphans.begin(); it != mapOrphans.end(); ++it)
+            mapVotes.insert(std::make_pair(it->first, std::make_pair(it->second.vote, it->second.nTimeExpire)));
+        return mapVotes;
+    }
+
+    size_t size() const { return mapOrphans.size(); }
+    size_t CountFor(const uint256& hashParent) const
+    {
+        typename std::map<uint256, std::set<uint256> >::const_iterator itParent = mapOrphansByParent.find(hashParent);
+        return itParent == mapOrphansByParent.end() ? 0 : itParent->second.size();
+    }
+
+    void clear()
+    {
+        mapOrphans.clear();
+        mapOrphansByParent.clear();
+        mapOrphansPerPeer.clear();
+    }
+};
 
 //
 // Budget Manager : Contains all proposals for the budget
@@ -186,6 +319,16 @@ private:
     // XX42    map<uint256, CTransaction> mapCollateral;
     map<uint256, uint256> mapCollateralTxids;
 
+    // the last result of GetBudget, by proposal hash, and what it was computed for
+    std::vector<uint256> vBudgetCache;
+    uint256 hashBudgetCacheBlock;
+    int nBudgetCacheVersion;
+    int nBudgetCacheThreshold;
+    // when the next proposal left out for being too new becomes established
+    int64_t nBudgetCacheExpires;
+    // changes whenever a proposal, a proposal vote or the validity of either changes
+    int nProposalsVersion;
+
 public:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -196,15 +339,19 @@ public:
 
     std::map<uint256, CBudgetProposalBroadcast> mapSeenMasternodeBudgetProposals;
     std::map<uint256, CBudgetVote> mapSeenMasternodeBudgetVotes;
-    std::map<uint256, CBudgetVote> mapOrphanMasternodeBudgetVotes;
+    CBudgetOrphanVotes<CBudgetVote> orphanBudgetVotes;
     std::map<uint256, CFinalizedBudgetBroadcast> mapSeenFinalizedBudgets;
     std::map<uint256, CFinalizedBudgetVote> mapSeenFinalizedBudgetVotes;
-    std::map<uint256, CFinalizedBudgetVote> mapOrphanFinalizedBudgetVotes;
+    CBudgetOrphanVotes<CFinalizedBudgetVote> orphanFinalizedBudgetVotes;
 
     CBudgetManager()
     {
         mapProposals.clear();
         mapFinalizedBudgets.clear();
+        nBudgetCacheVersion = -1;
+        nBudgetCacheThreshold = -1;
+        nBudgetCacheExpires = 0;
+        nProposalsVersion = 0;
     }
 
     void ClearSeen()
@@ -224,6 +371,7 @@ public:
 
     void Calculate();
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+    void RegisterMessageHandlers(CMessageDispatcher& dispatcher);
     void NewBlock();
     CBudgetProposal* FindProposal(const std::string& strProposalName);
     CBudgetProposal* FindProposal(uint256 nHash);
@@ -258,12 +406,16 @@ public:
         mapSeenMasternodeBudgetVotes.clear();
         mapSeenFinalizedBudgets.clear();
         mapSeenFinalizedBudgetVotes.clear();
-        mapOrphanMasternodeBudgetVotes.clear();
-        mapOrphanFinalizedBudgetVotes.clear();
+        orphanBudgetVotes.clear();
+        orphanFinalizedBudgetVotes.clear();
+        nProposalsVersion++;
     }
     void CheckAndRemove();
     std::string ToString() const;
 
+    void WriteCache(CMasternodeCacheDB& db);
+    bool ReadCache(CMasternodeCacheDB& db);
+
 
     ADD_SERIALIZE_METHODS;
 
@@ -274,8 +426,6 @@ public:
         READWRITE(mapSeenMasternodeBudgetVotes);
         READWRITE(mapSeenFinalizedBudgets);
         READWRITE(mapSeenFinalizedBudgetVotes);
-        READWRITE(mapOrphanMasternodeBudgetVotes);
-        READWRITE(mapOrphanFinalizedBudgetVotes);
 
         READWRITE(mapProposals);
         READWRITE(mapFinalizedBudgets);
@@ -466,6 +616,16 @@ private:
     mutable CCriticalSection cs;
     CAmount nAlloted;
 
+    // tallies of the valid votes in mapVotes, kept up to date by AddOrUpdateVote and CleanAndRemove
+    int nYeas;
+    int nNays;
+    int nAbstains;
+    // yes and no votes including the invalid ones, for GetRatio
+    int nYeasCast;
+    int nNaysCast;
+
+    void CountVote(const CBudgetVote& vote, int nDelta);
+
 public:
     bool fValid;
     std::string strProposalName;
@@ -496,15 +656,18 @@ public:
 
     bool IsValid(std::string& strError, bool fCheckCollateral = true);
 
-    bool IsEstablished()
+    // the time after which the proposal is old enough to make it into a budget
+    int64_t GetEstablishedTime()
     {
         // Proposals must be at least a day old to make it into a budget
-        if (Params().NetworkID() == CBaseChainParams::MAIN) return (nTime < GetTime() - (60 * 60 * 24));
+        if (Params().NetworkID() == CBaseChainParams::MAIN) return nTime + (60 * 60 * 24);
 
         // For testing purposes - 5 minutes
-        return (nTime < GetTime() - (60 * 5));
+        return nTime + (60 * 5);
     }
 
+    bool IsEstablished() { return GetTime() > GetEstablishedTime(); }
+
     std::string GetName() { return strProposalName; }
     std::string GetURL() { return strURL; }
     int GetBlockStart() { return nBlockStart; }
@@ -524,6 +687,8 @@ public:
     CAmount GetAllotted() { return nAlloted; }
 
     void CleanAndRemove(bool fSignatureCheck);
+    //! Recount the tallies after mapVotes was replaced
+    void RecountVotes();
 
     uint256 GetHash()
     {
@@ -557,6 +722,8 @@ public:
 
         //for saving to the serialized db
         READWRITE(mapVotes);
+        if (ser_action.ForRead())
+            RecountVotes();
     }
 };
 
@@ -585,6 +752,8 @@ public:
         swap(first.nTime, second.nTime);
         swap(first.nFeeTXHash, second.nFeeTXHash);
         first.mapVotes.swap(second.mapVotes);
+        first.RecountVotes();
+        second.RecountVotes();
     }
 
     CBudgetProposalBroadcast& operator=(CBudgetProposalBroadcast from)
@@ -9,6 +9,9 @@
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+
+#include <set>
+
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -20,6 +23,8 @@ extern CCriticalSection cs_mapMasternodePayeeVotes;
 class CMasternodePayments;
 class CMasternodePaymentWinner;
 class CMasternodeBlockPayees;
+class CMasternodeCacheDB;
+class CMessageDispatcher;
 
 extern CMasternodePayments masternodePayments;
 
@@ -32,32 +37,6 @@ std::string GetRequiredPaymentsString(int nBlockHeight);
 bool IsBlockValueValid(const CBlock& block, CAmount nExpectedValue, CAmount nMinted);
 void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake, bool fZGEAStake);
 
-void DumpMasternodePayments();
-
-/** Save Masternode Payment Data (mnpayments.dat)
- */
-class CMasternodePaymentDB
-{
-private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
-
-public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
-
-    CMasternodePaymentDB();
-    bool Write(const CMasternodePayments& objToSave);
-    ReadResult Read(CMasternodePayments& objToLoad, bool fDryRun = false);
-};
-
 class CMasternodePayee
 {
 public:
@@ -192,6 +171,7 @@ public:
         return ss.GetHash();
     }
 
+    std::string GetStrMessage();
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool IsValid(CNode* pnode, std::string& strError);
     bool SignatureValid();
@@ -236,6 +216,14 @@ private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
 
+    // heights of the blocks each payee has at least two votes for, kept up to date as votes come in and expire
+    std::map<CScript, std::set<int> > mapPayeeHeights;
+    // hashes of the votes in mapMasternodePayeeVotes by block height, so old heights are dropped as a whole
+    std::map<int, std::set<uint256> > mapVotesByHeight;
+
+    void AddToPayeeIndex(int nBlockHeight, const CMasternodeBlockPayees& blockPayees);
+    void RemoveFromPayeeIndex(int nBlockHeight, const CMasternodeBlockPayees& blockPayees);
+
 public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
@@ -252,6 +240,8 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeeHeights.clear();
+        mapVotesByHeight.clear();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
@@ -263,7 +253,8 @@ public:
 
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
-    bool IsScheduled(CMasternode& mn, int nNotBlockHeight);
+    void GetScheduledPayees(int nNotBlockHeight, std::set<CScript>& setPayees);
+    int GetLastPaidHeight(const CScript& payee, int nMinHeight, int nMaxHeight);
 
     bool CanVote(COutPoint outMasternode, int nBlockHeight)
     {
@@ -282,12 +273,16 @@ public:
 
     int GetMinMasternodePaymentsProto();
     void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+    void RegisterMessageHandlers(CMessageDispatcher& dispatcher);
     std::string GetRequiredPaymentsString(int nBlockHeight);
     void FillBlockPayee(CMutableTransaction& txNew, int64_t nFees, bool fProofOfStake, bool fZGEAStake);
     std::string ToString() const;
     int GetOldestBlock();
     int GetNewestBlock();
 
+    void WriteCache(CMasternodeCacheDB& db);
+    bool ReadCache(CMasternodeCacheDB& db);
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
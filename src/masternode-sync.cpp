@@ -11,9 +11,11 @@
 #include "masternode-budget.h"
 #include "masternode.h"
 #include "masternodeman.h"
+#include "messagedispatch.h"
 #include "spork.h"
 #include "util.h"
 #include "addrman.h"
+#include <boost/bind.hpp>
 // clang-format on
 
 class CMasternodeSync;
@@ -180,6 +182,12 @@ std::string CMasternodeSync::GetSyncStatus()
     return "";
 }
 
+void CMasternodeSync::RegisterMessageHandlers(CMessageDispatcher& dispatcher)
+{
+    CMessageDispatcher::ExtensionHandler handler = boost::bind(&CMasternodeSync::ProcessMessage, this, _1, _2, _3);
+    dispatcher.RegisterExtension("ssc", handler);
+}
+
 void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (strCommand == "ssc") { //Sync status count
@@ -264,6 +272,7 @@ void CMasternodeSync::Process()
     TRY_LOCK(cs_vNodes, lockRecv);
     if (!lockRecv) return;
 
+    int nListRequests = 0;
     BOOST_FOREACH (CNode* pnode, vNodes) {
         if (Params().NetworkID() == CBaseChainParams::REGTEST) {
             if (RequestedMasternodeAttempt <= 2) {
@@ -305,8 +314,8 @@ void CMasternodeSync::Process()
                 if (pnode->HasFulfilledRequest("mnsync")) continue;
                 pnode->FulfilledRequest("mnsync");
 
-                // timeout
-                if (lastMasternodeList == 0 &&
+                // timeout, checked before the first of the peers asked in this round
+                if (nListRequests == 0 && lastMasternodeList == 0 &&
                     (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
                     if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
                         LogPrintf("CMasternodeSync::Process - ERROR - Sync has failed, will retry later\n");
@@ -320,10 +329,17 @@ void CMasternodeSync::Process()
                     return;
                 }
 
-                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
+                if (nListRequests == 0 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
 
                 mnodeman.DsegUpdate(pnode);
-                RequestedMasternodeAttempt++;
+
+                // Ask several peers at once. Each of them only announces hashes, and every entry
+                // we miss is fetched from the first peer that announced it, so the downloads are
+                // spread over the peers instead of all coming from one of them. The peers asked
+                // together count as a single attempt.
+                if (nListRequests++ == 0)
+                    RequestedMasternodeAttempt++;
+                if (nListRequests < MASTERNODE_SYNC_LIST_PEERS) continue;
                 return;
             }
 
@@ -18,8 +18,11 @@
 
 #define MASTERNODE_SYNC_TIMEOUT 5
 #define MASTERNODE_SYNC_THRESHOLD 2
+//! Number of peers the masternode list is requested from at once
+#define MASTERNODE_SYNC_LIST_PEERS 3
 
 class CMasternodeSync;
+class CMessageDispatcher;
 extern CMasternodeSync masternodeSync;
 
 //
@@ -65,6 +68,7 @@ public:
     void GetNextAsset();
     std::string GetSyncStatus();
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+    void RegisterMessageHandlers(CMessageDispatcher& dispatcher);
     bool IsBudgetFinEmpty();
     bool IsBudgetPropEmpty();
 
@@ -57,6 +57,24 @@ bool GetBlockHash(uint256& hash, int nBlockHeight)
     return false;
 }
 
+//Get the block the collateral was confirmed in. Unspent collateral is found in the UTXO set,
+//only spent or unknown collateral needs the transaction, which without -txindex means reading blocks
+const CBlockIndex* GetCollateralBlockIndex(const COutPoint& outpoint)
+{
+    CTxOut txout;
+    int nHeight;
+    if (GetUnspentOutput(outpoint, txout, nHeight))
+        return chainActive[nHeight];
+
+    uint256 hashBlock = 0;
+    CTransaction tx;
+    GetTransaction(outpoint.hash, tx, hashBlock, true);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second;
+    return NULL;
+}
+
 CMasternode::CMasternode()
 {
     LOCK(cs);
@@ -236,10 +254,12 @@ void CMasternode::Check(bool forceCheck)
 
 int64_t CMasternode::SecondsSincePayment()
 {
-    CScript pubkeyScript;
-    pubkeyScript = GetScriptForDestination(pubKeyCollateralAddress.GetID());
+    return SecondsSincePayment(mnodeman.CountEnabled());
+}
 
-    int64_t sec = (GetAdjustedTime() - GetLastPaid());
+int64_t CMasternode::SecondsSincePayment(int nEnabled)
+{
+    int64_t sec = (GetAdjustedTime() - GetLastPaid(nEnabled));
     int64_t month = 60 * 60 * 24 * 30;
     if (sec < month) return sec; //if it's less than 30 days, give seconds
 
@@ -253,6 +273,11 @@ int64_t CMasternode::SecondsSincePayment()
 }
 
 int64_t CMasternode::GetLastPaid()
+{
+    return GetLastPaid(mnodeman.CountEnabled());
+}
+
+int64_t CMasternode::GetLastPaid(int nEnabled)
 {
     CBlockIndex* pindexPrev = chainActive.Tip();
     if (pindexPrev == NULL) return false;
@@ -268,36 +293,15 @@ int64_t CMasternode::GetLastPaid()
     // use a deterministic offset to break a tie -- 2.5 minutes
     int64_t nOffset = hash.GetCompact(false) % 150;
 
-    if (chainActive.Tip() == NULL) return false;
-
-    const CBlockIndex* BlockReading = chainActive.Tip();
-
-    int nMnCount = mnodeman.CountEnabled() * 1.25;
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nMnCount) {
-            return 0;
-        }
-        n++;
-
-        if (masternodePayments.mapMasternodeBlocks.count(BlockReading->nHeight)) {
-            /*
-                Search for this payee, with at least 2 votes. This will aid in consensus allowing the network
-                to converge on the same payees quickly, then keep the same schedule.
-            */
-            if (masternodePayments.mapMasternodeBlocks[BlockReading->nHeight].HasPayeeWithVotes(mnpayee, 2)) {
-                return BlockReading->nTime + nOffset;
-            }
-        }
-
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
+    /*
+        Search the last nMnCount blocks for this payee, with at least 2 votes. This will aid in consensus
+        allowing the network to converge on the same payees quickly, then keep the same schedule.
+    */
+    int nMnCount = nEnabled * 1.25;
+    int nHeight = masternodePayments.GetLastPaidHeight(mnpayee, std::max(1, pindexPrev->nHeight - nMnCount + 1), pindexPrev->nHeight);
+    if (nHeight == 0) return 0;
 
-    return 0;
+    return chainActive[nHeight]->nTime + nOffset;
 }
 
 std::string CMasternode::GetStatus()
@@ -553,7 +557,7 @@ bool CMasternodeBroadcast::CheckAndUpdate(int& nDos)
     if (pmn->pubKeyCollateralAddress == pubKeyCollateralAddress && !pmn->IsBroadcastedWithin(MASTERNODE_MIN_MNB_SECONDS)) {
         //take the newest entry
         LogPrint("masternode","mnb - Got updated entry for %s\n", vin.prevout.hash.ToString());
-        if (pmn->UpdateFromNewBroadcast((*this))) {
+        if (mnodeman.UpdateFromNewBroadcast(pmn, *this)) {
             pmn->Check();
             if (pmn->IsEnabled()) Relay();
         }
@@ -618,12 +622,8 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
 
     // verify that sig time is legit in past
     // should be at least not earlier than block when 1000 GEA tx got MASTERNODE_MIN_CONFIRMATIONS
-    uint256 hashBlock = 0;
-    CTransaction tx2;
-    GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-    if (mi != mapBlockIndex.end() && (*mi).second) {
-        CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 1000 GEA tx -> 1 confirmation
+    const CBlockIndex* pMNIndex = GetCollateralBlockIndex(vin.prevout); // block for 1000 GEA tx -> 1 confirmation
+    if (pMNIndex) {
         CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
         if (pConfIndex->GetBlockTime() > sigTime) {
             LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
@@ -724,13 +724,18 @@ CMasternodePing::CMasternodePing(CTxIn& newVin)
 }
 
 
+std::string CMasternodePing::GetStrMessage()
+{
+    return vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+}
+
 bool CMasternodePing::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 {
     std::string errorMessage;
     std::string strMasterNodeSignMessage;
 
     sigTime = GetAdjustedTime();
-    std::string strMessage = vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CMasternodePing::Sign() - Error: %s\n", errorMessage);
@@ -746,7 +751,7 @@ bool CMasternodePing::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 }
 
 bool CMasternodePing::VerifySignature(CPubKey& pubKeyMasternode, int &nDos) {
-	std::string strMessage = vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+	std::string strMessage = GetStrMessage();
 	std::string errorMessage = "";
 
 	if(!obfuScationSigner.VerifyMessage(pubKeyMasternode, vchSig, strMessage, errorMessage)){
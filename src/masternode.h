@@ -30,6 +30,7 @@ class CMasternodePing;
 extern map<int64_t, uint256> mapCacheBlockHashes;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
+const CBlockIndex* GetCollateralBlockIndex(const COutPoint& outpoint);
 
 
 //
@@ -60,6 +61,7 @@ public:
     }
 
     bool CheckAndUpdate(int& nDos, bool fRequireEnabled = true, bool fCheckSigTimeOnly = false);
+    std::string GetStrMessage();
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool VerifySignature(CPubKey& pubKeyMasternode, int &nDos);
     void Relay();
@@ -219,6 +221,7 @@ public:
     }
 
     int64_t SecondsSincePayment();
+    int64_t SecondsSincePayment(int nEnabled);
 
     bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
 
@@ -282,6 +285,8 @@ public:
     }
 
     int64_t GetLastPaid();
+    //! Time of the last payment within one cycle over nEnabled masternodes, or 0
+    int64_t GetLastPaid(int nEnabled);
     bool IsValidNetAddr();
 };
 
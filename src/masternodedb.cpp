@@ -0,0 +1,174 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternodedb.h"
+
+#include "hash.h"
+#include "masternode-budget.h"
+#include "masternode-payments.h"
+#include "masternodeman.h"
+#include "sync.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+
+CMasternodeCacheDB* pmncachedb = NULL;
+
+//! Keeps a flush from running while the cache is loaded or flushed by another thread
+static CCriticalSection cs_mncachedb;
+
+CMasternodeCacheDB::CMasternodeCacheDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "mncache", nCacheSize, fMemory, fWipe) {}
+
+uint64_t CMasternodeCacheDB::Checksum(const std::string& strValue)
+{
+    return CSipHasher(0, 0).Write((const unsigned char*)strValue.data(), strValue.size()).Finalize();
+}
+
+void CMasternodeCacheDB::BeginFlush()
+{
+    mapFlushing.clear();
+    vChanged.clear();
+}
+
+void CMasternodeCacheDB::WriteRaw(const std::string& strKey, const std::string& strValue)
+{
+    uint64_t nChecksum = Checksum(strValue);
+    mapFlushing[strKey] = nChecksum;
+
+    std::map<std::string, uint64_t>::const_iterator it = mapWritten.find(strKey);
+    if (it == mapWritten.end() || it->second != nChecksum)
+        vChanged.push_back(std::make_pair(strKey, strValue));
+}
+
+bool CMasternodeCacheDB::KeepRaw(const std::string& strKey)
+{
+    std::map<std::string, uint64_t>::const_iterator it = mapWritten.find(strKey);
+    if (it == mapWritten.end())
+        return false;
+    mapFlushing[strKey] = it->second;
+    return true;
+}
+
+bool CMasternodeCacheDB::Commit()
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<std::string, std::string> >::iterator it = vChanged.begin(); it != vChanged.end(); ++it) {
+        std::string& strKey = it->first;
+        std::string& strValue = it->second;
+        batch.Write(CFlatData((void*)strKey.data(), (void*)(strKey.data() + strKey.size())),
+            CFlatData((void*)strValue.data(), (void*)(strValue.data() + strValue.size())));
+    }
+
+    unsigned int nErased = 0;
+    for (std::map<std::string, uint64_t>::const_iterator it = mapWritten.begin(); it != mapWritten.end(); ++it) {
+        if (mapFlushing.count(it->first))
+            continue;
+        const std::string& strKey = it->first;
+        batch.Erase(CFlatData((void*)strKey.data(), (void*)(strKey.data() + strKey.size())));
+        nErased++;
+    }
+
+    try {
+        WriteBatch(batch);
+    } catch (const leveldb_error& e) {
+        // The entries that were not written stay different from mapWritten and are retried on the next flush
+        vChanged.clear();
+        mapFlushing.clear();
+        return error("%s : %s", __func__, e.what());
+    }
+
+    LogPrint("masternode", "Masternode cache: %u entries, %u written, %u erased\n", mapFlushing.size(), vChanged.size(), nErased);
+    mapWritten.swap(mapFlushing);
+    mapFlushing.clear();
+    vChanged.clear();
+    return true;
+}
+
+bool CMasternodeCacheDB::ReadRaw(char chTable, std::vector<std::pair<std::string, std::string> >& vEntries)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    for (pcursor->Seek(std::string(1, chTable)); pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.empty() || slKey[0] != chTable)
+            break;
+
+        std::string strKey = slKey.ToString();
+        std::string strValue = pcursor->value().ToString();
+        mapWritten[strKey] = Checksum(strValue);
+        vEntries.push_back(std::make_pair(strKey, strValue));
+    }
+
+    if (!pcursor->status().ok())
+        return error("%s : %s", __func__, pcursor->status().ToString());
+    return true;
+}
+
+/** Remove the cache files of earlier versions. They are not imported; what they held is synced again. */
+static void RemoveLegacyCacheFiles()
+{
+    static const char* const pszFiles[] = {"mncache.dat", "mnpayments.dat", "budget.dat"};
+    for (unsigned int i = 0; i < sizeof(pszFiles) / sizeof(pszFiles[0]); i++) {
+        boost::filesystem::path path = GetDataDir() / pszFiles[i];
+        boost::system::error_code ec;
+        if (!boost::filesystem::exists(path, ec))
+            continue;
+        if (boost::filesystem::remove(path, ec))
+            LogPrintf("Removed %s, the masternode cache is in mncache/ now\n", pszFiles[i]);
+        else
+            LogPrintf("Error removing %s: %s\n", pszFiles[i], ec.message());
+    }
+}
+
+void LoadMasternodeCache()
+{
+    LOCK(cs_mncachedb);
+    int64_t nStart = GetTimeMillis();
+
+    RemoveLegacyCacheFiles();
+
+    if (!mnodeman.ReadCache(*pmncachedb)) {
+        LogPrintf("Error reading the masternode list from the masternode cache, it will be synced again\n");
+        mnodeman.Clear();
+    }
+    LogPrint("masternode","Masternode manager - cleaning....\n");
+    mnodeman.CheckAndRemove(true);
+    LogPrint("masternode","  %s\n", mnodeman.ToString());
+
+    if (!budget.ReadCache(*pmncachedb)) {
+        LogPrintf("Error reading the budgets from the masternode cache, they will be synced again\n");
+        budget.Clear();
+    }
+    LogPrint("mnbudget","Budget manager - cleaning....\n");
+    budget.CheckAndRemove();
+    LogPrint("mnbudget","  %s\n", budget.ToString());
+
+    if (!masternodePayments.ReadCache(*pmncachedb)) {
+        LogPrintf("Error reading the masternode payments from the masternode cache, they will be synced again\n");
+        masternodePayments.Clear();
+    }
+    LogPrint("masternode","Masternode payments manager - cleaning....\n");
+    masternodePayments.CleanPaymentList();
+    LogPrint("masternode","  %s\n", masternodePayments.ToString());
+
+    LogPrintf("Loaded masternode cache  %dms\n", GetTimeMillis() - nStart);
+}
+
+void FlushMasternodeCache()
+{
+    if (!pmncachedb)
+        return;
+
+    LOCK(cs_mncachedb);
+    int64_t nStart = GetTimeMillis();
+
+    pmncachedb->BeginFlush();
+    mnodeman.WriteCache(*pmncachedb);
+    masternodePayments.WriteCache(*pmncachedb);
+    budget.WriteCache(*pmncachedb);
+    pmncachedb->Commit();
+
+    LogPrint("masternode","Masternode cache flushed  %dms\n", GetTimeMillis() - nStart);
+}
@@ -0,0 +1,142 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef GEA_MASTERNODEDB_H
+#define GEA_MASTERNODEDB_H
+
+#include "leveldbwrapper.h"
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+//! Tables of the masternode cache: the masternode list and what CMasternodeMan has seen and asked for
+static const char MNCACHE_MASTERNODES = 'm';
+static const char MNCACHE_ASKED_US = 'a';
+static const char MNCACHE_WE_ASKED = 'w';
+static const char MNCACHE_WE_ASKED_ENTRY = 'e';
+static const char MNCACHE_DSQ_COUNT = 'd';
+static const char MNCACHE_SEEN_BROADCASTS = 'b';
+static const char MNCACHE_SEEN_PINGS = 'p';
+//! Tables of the masternode payment votes
+static const char MNCACHE_PAYEE_VOTES = 'v';
+static const char MNCACHE_BLOCK_PAYEES = 'k';
+//! Tables of the budgets
+static const char MNCACHE_PROPOSALS = 'P';
+static const char MNCACHE_FINALIZED_BUDGETS = 'F';
+static const char MNCACHE_SEEN_PROPOSALS = 'Q';
+static const char MNCACHE_SEEN_PROPOSAL_VOTES = 'V';
+static const char MNCACHE_ORPHAN_PROPOSAL_VOTES = 'O';
+static const char MNCACHE_SEEN_FINALIZED_BUDGETS = 'G';
+static const char MNCACHE_SEEN_FINALIZED_VOTES = 'W';
+static const char MNCACHE_ORPHAN_FINALIZED_VOTES = 'X';
+
+/**
+ * Cache of the masternode list, the masternode payment votes and the budget
+ * objects, so that they do not have to be synced from scratch after a restart.
+ *
+ * Every map of the managers is a table of its own, keyed by a table id and
+ * the key of the entry in the map. A flush compares each entry with what was
+ * written before and only writes the entries that changed and erases the ones
+ * that went away, instead of rewriting the whole state like the .dat files of
+ * earlier versions did. Entries of tables that only grow are not serialized
+ * again at all, see WriteAddedEntries.
+ */
+class CMasternodeCacheDB : public CLevelDBWrapper
+{
+private:
+    //! Checksums of the entries as they are in the database, by database key
+    std::map<std::string, uint64_t> mapWritten;
+    //! Checksums of the entries written by the flush in progress
+    std::map<std::string, uint64_t> mapFlushing;
+    //! Entries of the flush in progress that changed, as database key and value
+    std::vector<std::pair<std::string, std::string> > vChanged;
+
+    static uint64_t Checksum(const std::string& strValue);
+    void WriteRaw(const std::string& strKey, const std::string& strValue);
+    //! Keep the entry under strKey as it is in the database; returns false if it is not there
+    bool KeepRaw(const std::string& strKey);
+    bool ReadRaw(char chTable, std::vector<std::pair<std::string, std::string> >& vEntries);
+
+    CMasternodeCacheDB(const CMasternodeCacheDB&);
+    void operator=(const CMasternodeCacheDB&);
+
+public:
+    CMasternodeCacheDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+    //! Start a flush; every entry that is still there has to be written again before Commit
+    void BeginFlush();
+
+    template <typename K, typename V>
+    void WriteEntry(char chTable, const K& key, const V& value)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << chTable << key;
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << value;
+        WriteRaw(ssKey.str(), ssValue.str());
+    }
+
+    template <typename K, typename V>
+    void WriteTable(char chTable, const std::map<K, V>& mapTable)
+    {
+        for (typename std::map<K, V>::const_iterator it = mapTable.begin(); it != mapTable.end(); ++it)
+            WriteEntry(chTable, it->first, it->second);
+    }
+
+    /**
+     * WriteTable for tables whose entries do not change once they are added,
+     * like those keyed by the hash of the entry. Only the entries that are not
+     * in the database yet are serialized.
+     */
+    template <typename K, typename V>
+    void WriteAddedEntries(char chTable, const std::map<K, V>& mapTable)
+    {
+        for (typename std::map<K, V>::const_iterator it = mapTable.begin(); it != mapTable.end(); ++it) {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey << chTable << it->first;
+            if (KeepRaw(ssKey.str()))
+                continue;
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue << it->second;
+            WriteRaw(ssKey.str(), ssValue.str());
+        }
+    }
+
+    //! Write the entries that changed since the last flush and erase the ones that were not written again
+    bool Commit();
+
+    //! Read all entries of a table; returns false if one of them cannot be deserialized
+    template <typename K, typename V>
+    bool ReadTable(char chTable, std::map<K, V>& mapTable)
+    {
+        std::vector<std::pair<std::string, std::string> > vEntries;
+        if (!ReadRaw(chTable, vEntries))
+            return false;
+
+        try {
+            for (std::vector<std::pair<std::string, std::string> >::const_iterator it = vEntries.begin(); it != vEntries.end(); ++it) {
+                CDataStream ssKey(it->first.data(), it->first.data() + it->first.size(), SER_DISK, CLIENT_VERSION);
+                char chTableIn;
+                K key;
+                ssKey >> chTableIn >> key;
+                CDataStream ssValue(it->second.data(), it->second.data() + it->second.size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> mapTable[key];
+            }
+        } catch (const std::exception& e) {
+            return error("%s : Deserialize error in table %c - %s", __func__, chTable, e.what());
+        }
+        return true;
+    }
+};
+
+extern CMasternodeCacheDB* pmncachedb;
+
+//! Load the masternode list, payment votes and budgets from the cache
+void LoadMasternodeCache();
+//! Write the changes to the masternode list, payment votes and budgets to the cache
+void FlushMasternodeCache();
+
+#endif // GEA_MASTERNODEDB_H
@@ -6,10 +6,15 @@
 #include "masternodeman.h"
 #include "activemasternode.h"
 #include "addrman.h"
+#include "hash.h"
 #include "masternode.h"
+#include "masternodedb.h"
+#include "messagedispatch.h"
 #include "obfuscation.h"
 #include "spork.h"
 #include "util.h"
+#include <limits>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
@@ -26,9 +31,9 @@ struct CompareLastPaid {
     }
 };
 
-struct CompareScoreTxIn {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-        const pair<int64_t, CTxIn>& t2) const
+struct CompareScoreOutPoint {
+    bool operator()(const pair<int64_t, COutPoint>& t1,
+        const pair<int64_t, COutPoint>& t2) const
     {
         return t1.first < t2.first;
     }
@@ -42,160 +47,74 @@ struct CompareScoreMN {
     }
 };
 
-//
-// CMasternodeDB
-//
-
-CMasternodeDB::CMasternodeDB()
+CMasternodeIndexHasher::CMasternodeIndexHasher()
 {
-    pathMN = GetDataDir() / "mncache.dat";
-    strMagicMessage = "MasternodeCache";
+    k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    k1 = GetRand(std::numeric_limits<uint64_t>::max());
 }
 
-bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
+size_t CMasternodeIndexHasher::operator()(const COutPoint& outpoint) const
 {
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssMasternodes;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    //    FileCommit(fileout);
-    fileout.fclose();
-
-    LogPrint("masternode","Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrint("masternode","  %s\n", mnodemanToSave.ToString());
-
-    return true;
+    return CSipHasher(k0, k1).Write(outpoint.hash.begin(), 32).Write(outpoint.n).Finalize();
 }
 
-CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fDryRun)
+size_t CMasternodeIndexHasher::operator()(const CPubKey& pubKey) const
 {
-    int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathMN.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathMN);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssMasternodes(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-
-        ssMasternodes >> strMagicMessageTmp;
+    return CSipHasher(k0, k1).Write(pubKey.begin(), pubKey.size()).Finalize();
+}
 
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
+size_t CMasternodeIndexHasher::operator()(const CScript& script) const
+{
+    return CSipHasher(k0, k1).Write(script.data(), script.size()).Finalize();
+}
 
-        // de-serialize file header (network specific magic number) and ..
-        ssMasternodes >> FLATDATA(pchMsgTmp);
+CMasternodeMan::CMasternodeMan()
+{
+    nDsqCount = 0;
+    nListVersion = 0;
+}
 
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
+template <typename Map>
+static void EraseIndexEntry(Map& map, const typename Map::key_type& key, const typename Map::mapped_type& value)
+{
+    std::pair<typename Map::iterator, typename Map::iterator> range = map.equal_range(key);
+    for (typename Map::iterator it = range.first; it != range.second; ++it) {
+        if (it->second == value) {
+            map.erase(it);
+            return;
         }
-        // de-serialize data into CMasternodeMan object
-        ssMasternodes >> mnodemanToLoad;
-    } catch (std::exception& e) {
-        mnodemanToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
-    }
-
-    LogPrint("masternode","Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("masternode","Masternode manager - cleaning....\n");
-        mnodemanToLoad.CheckAndRemove(true);
-        LogPrint("masternode","Masternode manager - result:\n");
-        LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
     }
+}
 
-    return Ok;
+void CMasternodeMan::AddToIndexes(MasternodeIt it)
+{
+    nListVersion++;
+    mapMasternodesByVin[it->vin.prevout] = it;
+    mapMasternodesByPubKey.insert(make_pair(it->pubKeyMasternode, it));
+    mapMasternodesByPayee.insert(make_pair(GetScriptForDestination(it->pubKeyCollateralAddress.GetID()), it));
 }
 
-void DumpMasternodes()
+void CMasternodeMan::RemoveFromIndexes(MasternodeIt it)
 {
-    int64_t nStart = GetTimeMillis();
-
-    CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
-
-    LogPrint("masternode","Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodeDB::FileError)
-        LogPrint("masternode","Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok) {
-        LogPrint("masternode","Error reading mncache.dat: ");
-        if (readResult == CMasternodeDB::IncorrectFormat)
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrint("masternode","Writting info to mncache.dat...\n");
-    mndb.Write(mnodeman);
+    nListVersion++;
+    mapMasternodesByVin.erase(it->vin.prevout);
+    EraseIndexEntry(mapMasternodesByPubKey, it->pubKeyMasternode, it);
+    EraseIndexEntry(mapMasternodesByPayee, GetScriptForDestination(it->pubKeyCollateralAddress.GetID()), it);
+}
 
-    LogPrint("masternode","Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
+void CMasternodeMan::RebuildIndexes()
+{
+    mapMasternodesByVin.clear();
+    mapMasternodesByPubKey.clear();
+    mapMasternodesByPayee.clear();
+    for (MasternodeIt it = listMasternodes.begin(); it != listMasternodes.end(); ++it)
+        AddToIndexes(it);
 }
 
-CMasternodeMan::CMasternodeMan()
+CMasternodeMan::MasternodeIt CMasternodeMan::EraseMasternode(MasternodeIt it)
 {
-    nDsqCount = 0;
+    RemoveFromIndexes(it);
+    return listMasternodes.erase(it);
 }
 
 bool CMasternodeMan::Add(CMasternode& mn)
@@ -208,13 +127,28 @@ bool CMasternodeMan::Add(CMasternode& mn)
     CMasternode* pmn = Find(mn.vin);
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
+        AddToIndexes(listMasternodes.insert(listMasternodes.end(), mn));
         return true;
     }
 
     return false;
 }
 
+bool CMasternodeMan::UpdateFromNewBroadcast(CMasternode* pmn, CMasternodeBroadcast& mnb)
+{
+    LOCK(cs);
+
+    boost::unordered_map<COutPoint, MasternodeIt, CMasternodeIndexHasher>::iterator mi = mapMasternodesByVin.find(pmn->vin.prevout);
+    if (mi == mapMasternodesByVin.end() || &*mi->second != pmn)
+        return pmn->UpdateFromNewBroadcast(mnb);
+
+    MasternodeIt it = mi->second;
+    RemoveFromIndexes(it);
+    bool fUpdated = it->UpdateFromNewBroadcast(mnb);
+    AddToIndexes(it);
+    return fUpdated;
+}
+
 void CMasternodeMan::AskForMN(CNode* pnode, CTxIn& vin)
 {
     std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasternodeListEntry.find(vin.prevout);
@@ -235,7 +169,7 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
     }
 }
@@ -247,43 +181,41 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::set<COutPoint> setRemoved;
+    MasternodeIt it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
             (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
             (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
             (*it).protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) {
             LogPrint("masternode", "CMasternodeMan: Removing inactive Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
 
-            //erase all of the broadcasts we've seen from this vin
-            // -- if we missed a few pings and the node was removed, this will allow is to get it back without them
-            //    sending a brand new mnb
-            map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
-            while (it3 != mapSeenMasternodeBroadcast.end()) {
-                if ((*it3).second.vin == (*it).vin) {
-                    masternodeSync.mapSeenSyncMNB.erase((*it3).first);
-                    mapSeenMasternodeBroadcast.erase(it3++);
-                } else {
-                    ++it3;
-                }
-            }
+            setRemoved.insert((*it).vin.prevout);
 
             // allow us to ask for this masternode again if we see another ping
-            map<COutPoint, int64_t>::iterator it2 = mWeAskedForMasternodeListEntry.begin();
-            while (it2 != mWeAskedForMasternodeListEntry.end()) {
-                if ((*it2).first == (*it).vin.prevout) {
-                    mWeAskedForMasternodeListEntry.erase(it2++);
-                } else {
-                    ++it2;
-                }
-            }
+            mWeAskedForMasternodeListEntry.erase((*it).vin.prevout);
 
-            it = vMasternodes.erase(it);
+            it = EraseMasternode(it);
         } else {
             ++it;
         }
     }
 
+    //erase all of the broadcasts we've seen from the removed vins, in one pass
+    // -- if we missed a few pings and the node was removed, this will allow is to get it back without them
+    //    sending a brand new mnb
+    if (!setRemoved.empty()) {
+        map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
+        while (it3 != mapSeenMasternodeBroadcast.end()) {
+            if (setRemoved.count((*it3).second.vin.prevout)) {
+                masternodeSync.mapSeenSyncMNB.erase((*it3).first);
+                mapSeenMasternodeBroadcast.erase(it3++);
+            } else {
+                ++it3;
+            }
+        }
+    }
+
     // check who's asked for the Masternode list
     map<CNetAddr, int64_t>::iterator it1 = mAskedUsForMasternodeList.begin();
     while (it1 != mAskedUsForMasternodeList.end()) {
@@ -339,7 +271,11 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    listMasternodes.clear();
+    mapMasternodesByVin.clear();
+    mapMasternodesByPubKey.clear();
+    mapMasternodesByPayee.clear();
+    mapScoresCache.clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -355,7 +291,7 @@ int CMasternodeMan::stable_size ()
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < nMinProtocol) {
             continue; // Skip obsolete versions
         }
@@ -380,7 +316,7 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -393,7 +329,7 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
 {
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         std::string strHost;
         int port;
@@ -438,25 +374,21 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_multimap<CScript, MasternodeIt, CMasternodeIndexHasher>::iterator mi = mapMasternodesByPayee.find(payee);
+    if (mi == mapMasternodesByPayee.end())
+        return NULL;
+    return &*mi->second;
 }
 
 CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_map<COutPoint, MasternodeIt, CMasternodeIndexHasher>::iterator mi = mapMasternodesByVin.find(vin.prevout);
+    if (mi == mapMasternodesByVin.end())
+        return NULL;
+    return &*mi->second;
 }
 
 
@@ -464,11 +396,10 @@ CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_multimap<CPubKey, MasternodeIt, CMasternodeIndexHasher>::iterator mi = mapMasternodesByPubKey.find(pubKeyMasternode);
+    if (mi == mapMasternodesByPubKey.end())
+        return NULL;
+    return &*mi->second;
 }
 
 //
@@ -485,16 +416,21 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         Make a vector with all of the last paid times
     */
 
+    // CountEnabled also checks every masternode, so their states are current below
     int nMnCount = CountEnabled();
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        mn.Check();
+    int nMinProtocol = masternodePayments.GetMinMasternodePaymentsProto();
+
+    std::set<CScript> setScheduled;
+    masternodePayments.GetScheduledPayees(nBlockHeight, setScheduled);
+
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (!mn.IsEnabled()) continue;
 
         // //check protocol version
-        if (mn.protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) continue;
+        if (mn.protocolVersion < nMinProtocol) continue;
 
         //it's in the list (up to 8 entries ahead of current block to allow propagation) -- so let's skip it
-        if (masternodePayments.IsScheduled(mn, nBlockHeight)) continue;
+        if (setScheduled.count(GetScriptForDestination(mn.pubKeyCollateralAddress.GetID()))) continue;
 
         //it's too new, wait for a cycle
         if (fFilterSigTime && mn.sigTime + (nMnCount * 2.6 * 60) > GetAdjustedTime()) continue;
@@ -502,7 +438,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nMnCount), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -516,8 +452,8 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     // Look at 1/10 of the oldest nodes (by last payment), calculate their scores and pay the best one
     //  -- This doesn't look at who is being paid in the +8-10 blocks, allowing for double payments very rarely
     //  -- 1/100 payments should be a double payment on mainnet - (1/(3000/10))*2
-    //  -- (chance per block * chances before IsScheduled will fire)
-    int nTenthNetwork = CountEnabled() / 10;
+    //  -- (chance per block * chances before a scheduled payee is skipped)
+    int nTenthNetwork = nMnCount / 10;
     int nCountTenth = 0;
     uint256 nHigh = 0;
     BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeLastPaid) {
@@ -549,7 +485,7 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     LogPrint("masternode", "CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH (CTxIn& usedVin, vecToExclude) {
@@ -573,7 +509,7 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     CMasternode* winner = NULL;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
 
@@ -591,18 +527,50 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     return winner;
 }
 
+const std::vector<pair<int64_t, COutPoint> >* CMasternodeMan::GetScores(int64_t nBlockHeight)
+{
+    //make sure we know about this block
+    uint256 hash = 0;
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    std::map<int64_t, CMasternodeScores>::iterator it = mapScoresCache.find(nBlockHeight);
+    if (it != mapScoresCache.end() && it->second.hashBlock == hash && it->second.nListVersion == nListVersion)
+        return &it->second.vScores;
+
+    if (it == mapScoresCache.end() && mapScoresCache.size() >= MASTERNODES_RANK_CACHE_HEIGHTS)
+        mapScoresCache.erase(mapScoresCache.begin());
+
+    CMasternodeScores& scores = mapScoresCache[nBlockHeight];
+    scores.hashBlock = hash;
+    scores.nListVersion = nListVersion;
+    scores.vScores.clear();
+    scores.vScores.reserve(listMasternodes.size());
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        uint256 n = mn.CalculateScore(1, nBlockHeight);
+        int64_t n2 = n.GetCompact(false);
+
+        scores.vScores.push_back(make_pair(n2, mn.vin.prevout));
+    }
+
+    stable_sort(scores.vScores.rbegin(), scores.vScores.rend(), CompareScoreOutPoint());
+
+    return &scores.vScores;
+}
+
 int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
+
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    const std::vector<pair<int64_t, COutPoint> >* pScores = GetScores(nBlockHeight);
+    if (!pScores) return -1;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // walk the MNs from the best score down, skipping the ones that do not take part
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(int64_t, COutPoint) & s, *pScores) {
+        CMasternode& mn = *mapMasternodesByVin[s.second];
         if (mn.protocolVersion < minProtocol) {
             LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
             continue;                                                       // Skip obsolete versions
@@ -619,18 +587,9 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
-        if (s.second.prevout == vin.prevout) {
+        if (s.second == vin.prevout) {
             return rank;
         }
     }
@@ -640,15 +599,17 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
+    LOCK(cs);
+
     std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
     std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    const std::vector<pair<int64_t, COutPoint> >* pScores = GetScores(nBlockHeight);
+    if (!pScores) return vecMasternodeRanks;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (const PAIRTYPE(int64_t, COutPoint) & s, *pScores) {
+        CMasternode& mn = *mapMasternodesByVin[s.second];
         mn.Check();
 
         if (mn.protocolVersion < minProtocol) continue;
@@ -658,13 +619,10 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn));
+        vecMasternodeScores.push_back(make_pair(s.first, mn));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
+    stable_sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
 
     int rank = 0;
     BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
@@ -677,29 +635,23 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    const std::vector<pair<int64_t, COutPoint> >* pScores = GetScores(nBlockHeight);
+    if (!pScores) return NULL;
+
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(int64_t, COutPoint) & s, *pScores) {
+        CMasternode& mn = *mapMasternodesByVin[s.second];
         if (mn.protocolVersion < minProtocol) continue;
         if (fOnlyActive) {
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
         if (rank == nRank) {
-            return Find(s.second);
+            return &mn;
         }
     }
 
@@ -722,6 +674,16 @@ void CMasternodeMan::ProcessMasternodeConnections()
     }
 }
 
+void CMasternodeMan::RegisterMessageHandlers(CMessageDispatcher& dispatcher)
+{
+    CMessageDispatcher::ExtensionHandler handler = boost::bind(&CMasternodeMan::ProcessMessage, this, _1, _2, _3);
+    dispatcher.RegisterExtension("mnb", handler);
+    dispatcher.RegisterExtension("mnp", handler);
+    dispatcher.RegisterExtension("dseg", handler);
+    dispatcher.RegisterExtension("dsee", handler);
+    dispatcher.RegisterExtension("dseep", handler);
+}
+
 void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
@@ -823,7 +785,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         int nInvCount = 0;
 
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH (CMasternode& mn, listMasternodes) {
             if (mn.addr.IsRFC1918()) continue; //local network
 
             if (mn.IsEnabled()) {
@@ -834,7 +796,20 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                     pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
                     nInvCount++;
 
-                    if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+                    // the hash of a broadcast does not cover its ping, so keep the one we serve up to date
+                    std::map<uint256, CMasternodeBroadcast>::iterator it = mapSeenMasternodeBroadcast.find(hash);
+                    if (it == mapSeenMasternodeBroadcast.end())
+                        mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+                    else
+                        it->second.lastPing = mn.lastPing;
+
+                    // Announce the last ping as well: a peer that still has the broadcast from its cache
+                    // only fetches the pings that changed instead of waiting for them to be relayed
+                    if (vin == CTxIn() && mn.lastPing != CMasternodePing()) {
+                        uint256 hashPing = mn.lastPing.GetHash();
+                        pfrom->PushInventory(CInv(MSG_MASTERNODE_PING, hashPing));
+                        if (!mapSeenMasternodePing.count(hashPing)) mapSeenMasternodePing.insert(make_pair(hashPing, mn.lastPing));
+                    }
 
                     if (vin == mn.vin) {
                         LogPrint("masternode", "dseg - Sent 1 Masternode entry to peer %i\n", pfrom->GetId());
@@ -941,7 +916,13 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                 if (pmn->nLastDsee < sigTime) { //take the newest entry
                     LogPrint("masternode", "dsee - Got updated entry for %s\n", vin.prevout.hash.ToString());
                     if (pmn->protocolVersion < GETHEADERS_VERSION) {
-                        pmn->pubKeyMasternode = pubkey2;
+                        {
+                            LOCK(cs);
+                            MasternodeIt itMn = mapMasternodesByVin[vin.prevout];
+                            RemoveFromIndexes(itMn);
+                            pmn->pubKeyMasternode = pubkey2;
+                            AddToIndexes(itMn);
+                        }
                         pmn->sigTime = sigTime;
                         pmn->sig = vchSig;
                         pmn->protocolVersion = protocolVersion;
@@ -1006,12 +987,8 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
             // verify that sig time is legit in past
             // should be at least not earlier than block when 1000 GEA tx got MASTERNODE_MIN_CONFIRMATIONS
-            uint256 hashBlock = 0;
-            CTransaction tx2;
-            GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-            if (mi != mapBlockIndex.end() && (*mi).second) {
-                CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 10000 GEA tx -> 1 confirmation
+            const CBlockIndex* pMNIndex = GetCollateralBlockIndex(vin.prevout); // block for 10000 GEA tx -> 1 confirmation
+            if (pMNIndex) {
                 CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
                 if (pConfIndex->GetBlockTime() > sigTime) {
                     LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
@@ -1135,14 +1112,10 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
-        if ((*it).vin == vin) {
-            LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-            vMasternodes.erase(it);
-            break;
-        }
-        ++it;
+    boost::unordered_map<COutPoint, MasternodeIt, CMasternodeIndexHasher>::iterator mi = mapMasternodesByVin.find(vin.prevout);
+    if (mi != mapMasternodesByVin.end() && mi->second->vin == vin) {
+        LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", vin.prevout.hash.ToString(), size() - 1);
+        EraseMasternode(mi->second);
     }
 }
 
@@ -1159,7 +1132,7 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
         CMasternode mn(mnb);
         Add(mn);
     } else {
-    	pmn->UpdateFromNewBroadcast(mnb);
+    	UpdateFromNewBroadcast(pmn, mnb);
     }
 }
 
@@ -1167,7 +1140,56 @@ std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
+    info << "Masternodes: " << (int)listMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
 
     return info.str();
 }
+
+void CMasternodeMan::WriteCache(CMasternodeCacheDB& db)
+{
+    // The masternodes and their broadcasts change all the time, so they are
+    // copied and serialized after the lock is released
+    std::vector<CMasternode> vMasternodes;
+    std::map<uint256, CMasternodeBroadcast> mapSeenBroadcasts;
+    {
+        LOCK(cs);
+
+        vMasternodes.assign(listMasternodes.begin(), listMasternodes.end());
+        mapSeenBroadcasts = mapSeenMasternodeBroadcast;
+        db.WriteTable(MNCACHE_ASKED_US, mAskedUsForMasternodeList);
+        db.WriteTable(MNCACHE_WE_ASKED, mWeAskedForMasternodeList);
+        db.WriteTable(MNCACHE_WE_ASKED_ENTRY, mWeAskedForMasternodeListEntry);
+        db.WriteEntry(MNCACHE_DSQ_COUNT, 0, nDsqCount);
+
+        db.WriteAddedEntries(MNCACHE_SEEN_PINGS, mapSeenMasternodePing);
+    }
+
+    BOOST_FOREACH (const CMasternode& mn, vMasternodes)
+        db.WriteEntry(MNCACHE_MASTERNODES, mn.vin.prevout, mn);
+    db.WriteTable(MNCACHE_SEEN_BROADCASTS, mapSeenBroadcasts);
+}
+
+bool CMasternodeMan::ReadCache(CMasternodeCacheDB& db)
+{
+    LOCK(cs);
+
+    std::map<COutPoint, CMasternode> mapMasternodes;
+    std::map<int, int64_t> mapDsqCount;
+    if (!db.ReadTable(MNCACHE_MASTERNODES, mapMasternodes) ||
+        !db.ReadTable(MNCACHE_ASKED_US, mAskedUsForMasternodeList) ||
+        !db.ReadTable(MNCACHE_WE_ASKED, mWeAskedForMasternodeList) ||
+        !db.ReadTable(MNCACHE_WE_ASKED_ENTRY, mWeAskedForMasternodeListEntry) ||
+        !db.ReadTable(MNCACHE_DSQ_COUNT, mapDsqCount) ||
+        !db.ReadTable(MNCACHE_SEEN_BROADCASTS, mapSeenMasternodeBroadcast) ||
+        !db.ReadTable(MNCACHE_SEEN_PINGS, mapSeenMasternodePing))
+        return false;
+
+    listMasternodes.clear();
+    for (std::map<COutPoint, CMasternode>::iterator it = mapMasternodes.begin(); it != mapMasternodes.end(); ++it)
+        listMasternodes.push_back(it->second);
+    RebuildIndexes();
+    if (mapDsqCount.count(0))
+        nDsqCount = mapDsqCount[0];
+
+    return true;
+}
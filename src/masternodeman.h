@@ -14,38 +14,34 @@
 #include "sync.h"
 #include "util.h"
 
+#include <list>
+
+#include <boost/unordered_map.hpp>
+
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODES_RANK_CACHE_HEIGHTS 32
 
 using namespace std;
 
 class CMasternodeMan;
+class CMasternodeCacheDB;
+class CMessageDispatcher;
 
 extern CMasternodeMan mnodeman;
-void DumpMasternodes();
 
-/** Access to the MN database (mncache.dat)
- */
-class CMasternodeDB
+/** Salted hash of the keys the masternode list is indexed by */
+class CMasternodeIndexHasher
 {
 private:
-    boost::filesystem::path pathMN;
-    std::string strMagicMessage;
+    uint64_t k0, k1;
 
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
+    CMasternodeIndexHasher();
 
-    CMasternodeDB();
-    bool Write(const CMasternodeMan& mnodemanToSave);
-    ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
+    size_t operator()(const COutPoint& outpoint) const;
+    size_t operator()(const CPubKey& pubKey) const;
+    size_t operator()(const CScript& script) const;
 };
 
 class CMasternodeMan
@@ -57,8 +53,14 @@ private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    typedef std::list<CMasternode>::iterator MasternodeIt;
+
+    // all MNs, in the order they were added; a list so that pointers returned by Find stay valid
+    std::list<CMasternode> listMasternodes;
+    // indexes into listMasternodes by collateral, by masternode key and by payee script
+    boost::unordered_map<COutPoint, MasternodeIt, CMasternodeIndexHasher> mapMasternodesByVin;
+    boost::unordered_multimap<CPubKey, MasternodeIt, CMasternodeIndexHasher> mapMasternodesByPubKey;
+    boost::unordered_multimap<CScript, MasternodeIt, CMasternodeIndexHasher> mapMasternodesByPayee;
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
@@ -66,6 +68,24 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    // the scores of all MNs for one block height, best first
+    struct CMasternodeScores {
+        uint256 hashBlock;
+        int nListVersion;
+        std::vector<pair<int64_t, COutPoint> > vScores;
+    };
+    // scores of recently ranked heights, recomputed when the block at the height or the list changed
+    std::map<int64_t, CMasternodeScores> mapScoresCache;
+    // changes whenever an entry is added to or removed from the list
+    int nListVersion;
+
+    const std::vector<pair<int64_t, COutPoint> >* GetScores(int64_t nBlockHeight);
+
+    void AddToIndexes(MasternodeIt it);
+    void RemoveFromIndexes(MasternodeIt it);
+    void RebuildIndexes();
+    MasternodeIt EraseMasternode(MasternodeIt it);
+
 public:
     // Keep track of all broadcasts I've seen
     map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
@@ -81,7 +101,16 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
         LOCK(cs);
-        READWRITE(vMasternodes);
+        // stored as a vector, like before the list was indexed
+        if (ser_action.ForRead()) {
+            std::vector<CMasternode> vMasternodes;
+            READWRITE(vMasternodes);
+            listMasternodes.assign(vMasternodes.begin(), vMasternodes.end());
+            RebuildIndexes();
+        } else {
+            std::vector<CMasternode> vMasternodes(listMasternodes.begin(), listMasternodes.end());
+            READWRITE(vMasternodes);
+        }
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
         READWRITE(mWeAskedForMasternodeListEntry);
@@ -132,7 +161,8 @@ public:
     std::vector<CMasternode> GetFullMasternodeVector()
     {
         Check();
-        return vMasternodes;
+        LOCK(cs);
+        return std::vector<CMasternode>(listMasternodes.begin(), listMasternodes.end());
     }
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
@@ -142,21 +172,30 @@ public:
     void ProcessMasternodeConnections();
 
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+    void RegisterMessageHandlers(CMessageDispatcher& dispatcher);
 
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return listMasternodes.size(); }
 
     /// Return the number of Masternodes older than (default) 8000 seconds
     int stable_size ();
 
     std::string ToString() const;
 
+    /// Write the list and what was seen and asked for to the masternode cache
+    void WriteCache(CMasternodeCacheDB& db);
+    /// Read the list and what was seen and asked for from the masternode cache
+    bool ReadCache(CMasternodeCacheDB& db);
+
     void Remove(CTxIn vin);
 
     int GetEstimatedMasternodes(int nBlock);
 
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
+
+    /// Update an entry of the list from a newer broadcast, keeping the indexes current
+    bool UpdateFromNewBroadcast(CMasternode* pmn, CMasternodeBroadcast& mnb);
 };
 
 #endif
@@ -0,0 +1,133 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "messagedispatch.h"
+
+#include "net.h"
+#include "protocol.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+#include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
+
+CMessageDispatcher messageDispatcher;
+
+static_assert(CMessageHeader::COMMAND_SIZE == sizeof(uint64_t) + sizeof(uint32_t), "command does not fit the dispatch key");
+
+void CMessageStats::Add(size_t nMessageBytes, int64_t nMessageQueueMicros, int64_t nMessageTimeMicros)
+{
+    nCount++;
+    nBytes += nMessageBytes;
+    nQueueMicros += nMessageQueueMicros;
+    nTimeMicros += nMessageTimeMicros;
+    nMaxTimeMicros = std::max(nMaxTimeMicros, nMessageTimeMicros);
+
+    int nBucket = 0;
+    for (int64_t nLimit = 10; nBucket < MESSAGE_TIME_BUCKETS - 1 && nMessageTimeMicros >= nLimit; nLimit *= 10)
+        nBucket++;
+    vTimeHistogram[nBucket]++;
+}
+
+CMessageDispatcher::CommandKey::CommandKey(const std::string& strCommand)
+{
+    unsigned char pchCommand[CMessageHeader::COMMAND_SIZE] = {};
+    // A longer command can never come out of a message header, so truncating it cannot make it match
+    memcpy(pchCommand, strCommand.data(), std::min(strCommand.size(), sizeof(pchCommand)));
+    memcpy(&nLow, pchCommand, sizeof(nLow));
+    memcpy(&nHigh, pchCommand + sizeof(nLow), sizeof(nHigh));
+}
+
+size_t CMessageDispatcher::CommandKeyHasher::operator()(const CommandKey& key) const
+{
+    size_t seed = 0;
+    boost::hash_combine(seed, key.nLow);
+    boost::hash_combine(seed, key.nHigh);
+    return seed;
+}
+
+void CMessageDispatcher::Register(const std::string& strCommand, const Handler& handler)
+{
+    assert(strCommand.size() <= CMessageHeader::COMMAND_SIZE);
+    Entry& entry = mapHandlers[CommandKey(strCommand)];
+    assert(entry.handler.empty());
+    entry.strCommand = strCommand;
+    entry.handler = handler;
+}
+
+static bool CallExtensionHandler(const CMessageDispatcher::ExtensionHandler& handler, CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
+    handler(pfrom, strCommand, vRecv);
+    return true;
+}
+
+void CMessageDispatcher::RegisterExtension(const std::string& strCommand, const ExtensionHandler& handler)
+{
+    Register(strCommand, boost::bind(&CallExtensionHandler, handler, _1, _2, _3));
+}
+
+void CMessageDispatcher::Clear()
+{
+    mapHandlers.clear();
+}
+
+void CMessageDispatcher::Record(Entry& entry, CNode* pfrom, size_t nBytes, int64_t nTimeReceived, int64_t nStart)
+{
+    int64_t nTime = GetTimeMicros() - nStart;
+    // Messages that did not come off the wire, like in the unit tests, have no receive time
+    int64_t nQueueTime = nTimeReceived > 0 ? std::max(nStart - nTimeReceived, (int64_t)0) : 0;
+    {
+        LOCK(cs_stats);
+        entry.stats.Add(nBytes, nQueueTime, nTime);
+    }
+    if (pfrom)
+        pfrom->RecordReceivedMessage(entry.strCommand, nBytes, nQueueTime, nTime);
+}
+
+bool CMessageDispatcher::Dispatch(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    HandlerMap::iterator it = mapHandlers.find(CommandKey(strCommand));
+    if (it == mapHandlers.end())
+        return true;
+
+    Entry& entry = it->second;
+    size_t nBytes = vRecv.size();
+    int64_t nStart = GetTimeMicros();
+    bool fRet = false;
+    try {
+        fRet = entry.handler(pfrom, strCommand, vRecv, nTimeReceived);
+    } catch (...) {
+        Record(entry, pfrom, nBytes, nTimeReceived, nStart);
+        throw;
+    }
+    Record(entry, pfrom, nBytes, nTimeReceived, nStart);
+    return fRet;
+}
+
+void CMessageDispatcher::GetStats(std::map<std::string, CMessageStats>& mapStats) const
+{
+    mapStats.clear();
+    LOCK(cs_stats);
+    for (HandlerMap::const_iterator it = mapHandlers.begin(); it != mapHandlers.end(); ++it)
+        mapStats[it->second.strCommand] = it->second.stats;
+}
+
+void CMessageDispatcher::LogStats() const
+{
+    std::map<std::string, CMessageStats> mapStats;
+    GetStats(mapStats);
+    for (std::map<std::string, CMessageStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it) {
+        const CMessageStats& stats = it->second;
+        if (stats.nCount == 0)
+            continue;
+        LogPrintf("message stats: %s count=%u bytes=%u time=%.3fms avg=%dus max=%dus queued=%.3fms\n", it->first,
+            stats.nCount, stats.nBytes, stats.nTimeMicros * 0.001, stats.nTimeMicros / (int64_t)stats.nCount,
+            stats.nMaxTimeMicros, stats.nQueueMicros * 0.001);
+    }
+}
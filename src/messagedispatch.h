@@ -0,0 +1,109 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef GEA_MESSAGEDISPATCH_H
+#define GEA_MESSAGEDISPATCH_H
+
+#include "sync.h"
+
+#include <algorithm>
+#include <map>
+#include <stdint.h>
+#include <string>
+
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
+
+class CDataStream;
+class CNode;
+
+//! Buckets of the handler time histogram: below 10us, 100us, 1ms, 10ms, 100ms, 1s, and the rest
+static const int MESSAGE_TIME_BUCKETS = 7;
+
+/** Counters for one P2P command */
+struct CMessageStats {
+    uint64_t nCount;
+    uint64_t nBytes;
+    //! Time the messages waited between arriving and being handled
+    int64_t nQueueMicros;
+    //! Time spent in the handler, including deserialization
+    int64_t nTimeMicros;
+    int64_t nMaxTimeMicros;
+    uint64_t vTimeHistogram[MESSAGE_TIME_BUCKETS];
+
+    CMessageStats() : nCount(0), nBytes(0), nQueueMicros(0), nTimeMicros(0), nMaxTimeMicros(0)
+    {
+        std::fill(vTimeHistogram, vTimeHistogram + MESSAGE_TIME_BUCKETS, 0);
+    }
+
+    void Add(size_t nMessageBytes, int64_t nMessageQueueMicros, int64_t nMessageTimeMicros);
+};
+
+/**
+ * Table of the handlers for the P2P commands we understand.
+ *
+ * Handlers are looked up with a single hash of the 12-byte command from the
+ * message header instead of comparing the command against every command that
+ * is handled, and the masternode subsystems only see the commands they
+ * registered for. The table is filled in by RegisterNodeSignals before the
+ * network threads start and is read-only afterwards.
+ */
+class CMessageDispatcher
+{
+public:
+    //! Returns false if the message was rejected, like ProcessMessage
+    typedef boost::function<bool(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)> Handler;
+    //! The message handlers of the masternode subsystems, which never fail
+    typedef boost::function<void(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)> ExtensionHandler;
+
+private:
+    //! A command as it is sent in the message header: 12 bytes, NUL padded
+    struct CommandKey {
+        uint64_t nLow;
+        uint32_t nHigh;
+
+        explicit CommandKey(const std::string& strCommand);
+        bool operator==(const CommandKey& other) const { return nLow == other.nLow && nHigh == other.nHigh; }
+    };
+
+    struct CommandKeyHasher {
+        size_t operator()(const CommandKey& key) const;
+    };
+
+    struct Entry {
+        std::string strCommand;
+        Handler handler;
+        CMessageStats stats;
+    };
+
+    typedef boost::unordered_map<CommandKey, Entry, CommandKeyHasher> HandlerMap;
+    HandlerMap mapHandlers;
+
+    //! Protects the stats of the entries; the map itself does not change while the node runs
+    mutable CCriticalSection cs_stats;
+
+    void Record(Entry& entry, CNode* pfrom, size_t nBytes, int64_t nTimeReceived, int64_t nStart);
+
+public:
+    void Register(const std::string& strCommand, const Handler& handler);
+    void RegisterExtension(const std::string& strCommand, const ExtensionHandler& handler);
+    void Clear();
+
+    /**
+     * Run the handler registered for strCommand and account for the message
+     * in its stats. Messages with a command nobody registered for are
+     * ignored.
+     */
+    bool Dispatch(CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived);
+
+    //! Counters of all registered commands, by command
+    void GetStats(std::map<std::string, CMessageStats>& mapStats) const;
+
+    //! Write the counters of the commands that were received at least once to the debug log
+    void LogStats() const;
+};
+
+extern CMessageDispatcher messageDispatcher;
+
+#endif // GEA_MESSAGEDISPATCH_H
@@ -22,11 +22,17 @@
 #include "wallet.h"
 
 #ifdef WIN32
+#include <math.h>
 #include <string.h>
 #else
 #include <fcntl.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -429,6 +435,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        WakeSocketHandler();
 
         pnode->nTimeConnected = GetTime();
         if (obfuScationMaster) pnode->fObfuScationMaster = true;
@@ -701,9 +708,21 @@ void CNode::copyStats(CNodeStats& stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_msgStats);
+        X(mapRecvMsgStats);
+        X(mapSendBytesPerMsgCmd);
+    }
 }
 #undef X
 
+void CNode::RecordReceivedMessage(const std::string& strCommand, size_t nBytes, int64_t nQueueMicros, int64_t nTimeMicros)
+{
+    LOCK(cs_msgStats);
+    mapRecvMsgStats[strCommand].Add(nBytes, nQueueMicros, nTimeMicros);
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 {
@@ -711,7 +730,7 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+            vRecvMsg.emplace_back(SER_NETWORK, nRecvVersion);
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -742,6 +761,23 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
     return true;
 }
 
+char* CNode::GetRecvDataBuffer(unsigned int nMax, unsigned int& nSpace)
+{
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+    return vRecvMsg.back().getDataBuffer(nMax, nSpace);
+}
+
+void CNode::ReceivedDataBytes(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.dataReceived(nBytes);
+    if (msg.complete()) {
+        msg.nTime = GetTimeMicros();
+        messageHandlerCondition.notify_one();
+    }
+}
+
 int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -772,22 +808,92 @@ int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
     return nCopy;
 }
 
+/**
+ * Payload buffers of processed messages, for reuse by messages received later.
+ * Buffers are kept by size class, and every buffer in a class has at least
+ * the capacity of the class, so that taking one never reallocates.
+ */
+static const size_t RECV_BUFFER_CLASS_SIZES[] = {1024, 4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024};
+static const size_t RECV_BUFFER_CLASSES = sizeof(RECV_BUFFER_CLASS_SIZES) / sizeof(RECV_BUFFER_CLASS_SIZES[0]);
+//! Buffers kept per size class; a few MiB when the pool is full
+static const size_t MAX_POOLED_RECV_BUFFERS[RECV_BUFFER_CLASSES] = {128, 64, 32, 16, 8};
+static CCriticalSection cs_recvBufferPool;
+static std::vector<CSerializeData> vRecvBufferPool[RECV_BUFFER_CLASSES];
+
+void CNetMessage::prepareData(unsigned int nBytes)
+{
+    if (vRecv.size() >= nDataPos + nBytes)
+        return;
+
+    // Allocate up to 256 KiB ahead, but never more than the total message size.
+    unsigned int nSize = std::min(hdr.nMessageSize, nDataPos + nBytes + 256 * 1024);
+    if (nDataPos == 0 && vRecv.empty()) {
+        for (size_t i = 0; i < RECV_BUFFER_CLASSES; i++) {
+            if (nSize > RECV_BUFFER_CLASS_SIZES[i])
+                continue;
+            CSerializeData data;
+            {
+                LOCK(cs_recvBufferPool);
+                if (!vRecvBufferPool[i].empty()) {
+                    data.swap(vRecvBufferPool[i].back());
+                    vRecvBufferPool[i].pop_back();
+                }
+            }
+            // Allocate the full class size, so that the buffer can go back to this class later
+            data.reserve(RECV_BUFFER_CLASS_SIZES[i]);
+            data.resize(nSize);
+            vRecv.swap(data);
+            return;
+        }
+    }
+    vRecv.resize(nSize);
+}
+
 int CNetMessage::readData(const char* pch, unsigned int nBytes)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
-
+    prepareData(nCopy);
     memcpy(&vRecv[nDataPos], pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
+char* CNetMessage::getDataBuffer(unsigned int nMax, unsigned int& nSpace)
+{
+    nSpace = std::min(hdr.nMessageSize - nDataPos, nMax);
+    prepareData(nSpace);
+    return &vRecv[nDataPos];
+}
+
+void CNetMessage::dataReceived(unsigned int nBytes)
+{
+    assert(nDataPos + nBytes <= vRecv.size());
+    nDataPos += nBytes;
+}
+
+void CNetMessage::releaseData()
+{
+    CSerializeData data;
+    vRecv.swap(data);
+    if (data.capacity() > 2 * RECV_BUFFER_CLASS_SIZES[RECV_BUFFER_CLASSES - 1])
+        return; // Keep the pool small; large blocks are rare enough to allocate for each
+
+    for (size_t i = RECV_BUFFER_CLASSES; i-- > 0;) {
+        if (data.capacity() < RECV_BUFFER_CLASS_SIZES[i])
+            continue;
+        data.clear();
+        LOCK(cs_recvBufferPool);
+        if (vRecvBufferPool[i].size() < MAX_POOLED_RECV_BUFFERS[i]) {
+            vRecvBufferPool[i].push_back(CSerializeData());
+            vRecvBufferPool[i].back().swap(data);
+        }
+        return;
+    }
+}
+
 
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode* pnode)
@@ -834,6 +940,261 @@ void SocketSendData(CNode* pnode)
 
 static list<CNode*> vNodesDisconnected;
 
+#ifdef USE_EPOLL
+//! epoll instance of the socket handler, see InitSocketEvents()
+static int hEpoll = -1;
+//! eventfd registered with hEpoll, written to by WakeSocketHandler()
+static int hWakeEvent = -1;
+//! Longest epoll wait, which bounds the latency of timeouts and fDisconnect
+static const int SOCKET_WAIT_TIMEOUT_MS = 1000;
+//! Most events returned by a single epoll_wait; the rest are picked up by the next call
+static const int MAX_SOCKET_EVENTS = 1024;
+#endif
+
+/**
+ * Decide whether to wait for pnode's socket to become writable or readable:
+ * * If there is data to send, wait for sending data. As this only
+ *   happens when optimistic write failed, we choose to first drain the
+ *   write buffer in this case before receiving more. This avoids
+ *   needlessly queueing received data, if the remote peer is not themselves
+ *   receiving data. This means properly utilizing TCP flow control signalling.
+ * * Otherwise, if there is no (complete) message in the receive buffer,
+ *   or there is space left in the buffer, wait for receiving data.
+ * * (if neither of the above applies, there is certainly one message
+ *   in the receiver buffer ready to be processed).
+ * Together, that means that at least one of the following is always possible,
+ * so we don't deadlock:
+ * * We send some data.
+ * * We wait for data to be received (and disconnect after timeout).
+ * * We process a message in the buffer (message handler thread).
+ *
+ * Returns false if one of the locks was busy, in which case the answer may
+ * be incomplete.
+ */
+static bool GetSocketInterest(CNode* pnode, bool& fSend, bool& fRecv)
+{
+    fSend = false;
+    fRecv = false;
+    bool fComplete = true;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend && !pnode->vSendMsg.empty()) {
+            fSend = true;
+            return true;
+        }
+        if (!lockSend)
+            fComplete = false;
+    }
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv) {
+            fRecv = pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                    pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+            pnode->fPauseRecv = !fRecv;
+        } else {
+            fComplete = false;
+        }
+    }
+    return fComplete;
+}
+
+#ifdef USE_EPOLL
+static void InitSocketEvents()
+{
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1)
+        throw std::runtime_error(strprintf("%s : epoll_create1 failed: %s", __func__, NetworkErrorString(errno)));
+    hWakeEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (hWakeEvent == -1)
+        throw std::runtime_error(strprintf("%s : eventfd failed: %s", __func__, NetworkErrorString(errno)));
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = hWakeEvent;
+    epoll_ctl(hEpoll, EPOLL_CTL_ADD, hWakeEvent, &event);
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        event.data.fd = hListenSocket.socket;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+            LogPrintf("%s : unable to watch listening socket: %s\n", __func__, NetworkErrorString(errno));
+    }
+}
+
+static void CloseSocketEvents()
+{
+    if (hWakeEvent != -1)
+        close(hWakeEvent);
+    if (hEpoll != -1)
+        close(hEpoll);
+    hWakeEvent = -1;
+    hEpoll = -1;
+}
+
+//! Change the events hSocket is registered for, if they differ from nRegistered.
+static void UpdateSocketEvents(SOCKET hSocket, uint32_t& nRegistered, uint32_t nEvents)
+{
+    if (nRegistered == nEvents)
+        return;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = nEvents;
+    event.data.fd = hSocket;
+    int nRet = epoll_ctl(hEpoll, nRegistered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, hSocket, &event);
+    if (nRet != 0 && errno == EEXIST)
+        nRet = epoll_ctl(hEpoll, EPOLL_CTL_MOD, hSocket, &event);
+    if (nRet != 0) {
+        // Most likely closed by another thread; it is skipped from now on.
+        LogPrint("net", "epoll_ctl for socket %d failed: %s\n", hSocket, NetworkErrorString(errno));
+        return;
+    }
+    nRegistered = nEvents;
+}
+
+/**
+ * Wait for socket events with epoll. Sockets stay registered between calls and
+ * epoll_ctl is only needed when the events a peer waits for change, so neither
+ * we nor the kernel scan every socket on each pass, and descriptors are not
+ * limited by FD_SETSIZE.
+ *
+ * Registration is level-triggered: a peer that is left with unread data while
+ * its receive buffer is full simply stops waiting for EPOLLIN until the message
+ * handler drains it, which edge-triggered notification would lose.
+ */
+static void WaitSocketEvents(std::set<SOCKET>& setRecv, std::set<SOCKET>& setSend, std::set<SOCKET>& setError)
+{
+    std::set<SOCKET> setSockets;
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket)
+        setSockets.insert(hListenSocket.socket);
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            setSockets.insert(pnode->hSocket);
+
+            bool fSend, fRecv;
+            if (!GetSocketInterest(pnode, fSend, fRecv)) {
+                // Keep the current registration while the other threads hold the
+                // locks; they wake us when they leave data to be sent or received.
+                if (pnode->nSocketEvents != 0)
+                    continue;
+                fRecv = !fSend;
+            }
+            UpdateSocketEvents(pnode->hSocket, pnode->nSocketEvents, EPOLLERR | (fRecv ? (uint32_t)EPOLLIN : 0) | (fSend ? (uint32_t)EPOLLOUT : 0));
+        }
+    }
+
+    static std::vector<struct epoll_event> vEvents(MAX_SOCKET_EVENTS);
+    int nEvents = epoll_wait(hEpoll, &vEvents[0], vEvents.size(), SOCKET_WAIT_TIMEOUT_MS);
+    if (nEvents < 0) {
+        if (errno != EINTR) {
+            LogPrintf("socket epoll error %s\n", NetworkErrorString(errno));
+            MilliSleep(50);
+        }
+        return;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        const struct epoll_event& event = vEvents[i];
+        SOCKET hSocket = event.data.fd;
+        if (hSocket == (SOCKET)hWakeEvent) {
+            uint64_t nCount;
+            if (read(hWakeEvent, &nCount, sizeof(nCount)) != sizeof(nCount))
+                LogPrint("net", "%s : eventfd read failed\n", __func__);
+            continue;
+        }
+        if (!setSockets.count(hSocket)) {
+            // Registered for a socket that has since been closed and its
+            // descriptor reused by someone else
+            epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, NULL);
+            continue;
+        }
+        if (event.events & EPOLLIN)
+            setRecv.insert(hSocket);
+        if (event.events & EPOLLOUT)
+            setSend.insert(hSocket);
+        if (event.events & (EPOLLERR | EPOLLHUP))
+            setError.insert(hSocket);
+    }
+}
+#else
+static void WaitSocketEvents(std::set<SOCKET>& setRecv, std::set<SOCKET>& setSend, std::set<SOCKET>& setError)
+{
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    std::vector<SOCKET> vSockets;
+
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        vSockets.push_back(hListenSocket.socket);
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            vSockets.push_back(pnode->hSocket);
+
+            bool fSend, fRecv;
+            GetSocketInterest(pnode, fSend, fRecv);
+            if (fSend)
+                FD_SET(pnode->hSocket, &fdsetSend);
+            else if (fRecv)
+                FD_SET(pnode->hSocket, &fdsetRecv);
+        }
+    }
+
+    bool have_fds = !vSockets.empty();
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+        &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+
+    if (nSelect == SOCKET_ERROR) {
+        if (have_fds) {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            setRecv.insert(vSockets.begin(), vSockets.end());
+        }
+        MilliSleep(timeout.tv_usec / 1000);
+        return;
+    }
+
+    BOOST_FOREACH (SOCKET hSocket, vSockets) {
+        if (FD_ISSET(hSocket, &fdsetRecv))
+            setRecv.insert(hSocket);
+        if (FD_ISSET(hSocket, &fdsetSend))
+            setSend.insert(hSocket);
+        if (FD_ISSET(hSocket, &fdsetError))
+            setError.insert(hSocket);
+    }
+}
+#endif
+
+void WakeSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hWakeEvent != -1) {
+        uint64_t nOne = 1;
+        if (write(hWakeEvent, &nOne, sizeof(nOne)) != sizeof(nOne))
+            LogPrint("net", "%s : eventfd write failed\n", __func__);
+    }
+#endif
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
@@ -902,86 +1263,17 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodes) {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        std::set<SOCKET> setRecv;
+        std::set<SOCKET> setSend;
+        std::set<SOCKET> setError;
+        WaitSocketEvents(setRecv, setSend, setError);
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
-        }
-
         //
         // Accept new connections
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
+            if (hListenSocket.socket != INVALID_SOCKET && setRecv.count(hListenSocket.socket)) {
                 struct sockaddr_storage sockaddr;
                 socklen_t len = sizeof(sockaddr);
                 SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
@@ -1044,15 +1336,21 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
+            if (setRecv.count(pnode->hSocket) || setError.count(pnode->hSocket)) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv) {
                     {
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        // Receive the payload of a message that is partly in straight into its buffer
+                        unsigned int nSpace = 0;
+                        char* pchData = pnode->GetRecvDataBuffer(sizeof(pchBuf), nSpace);
+                        int nBytes = pchData ? recv(pnode->hSocket, pchData, nSpace, MSG_DONTWAIT) :
+                                               recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            if (pchData)
+                                pnode->ReceivedDataBytes(nBytes);
+                            else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
@@ -1080,7 +1378,7 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
+            if (setSend.count(pnode->hSocket)) {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
                     SocketSendData(pnode);
@@ -1268,10 +1566,18 @@ void ThreadDNSAddressSeed()
 
 void DumpAddresses()
 {
+    // Only the scheduler thread and shutdown dump the addresses, never at the same time
+    static uint64_t nLastDumpedChanges = 0;
+    uint64_t nChanges = addrman.GetChangeCount();
+    if (nChanges == nLastDumpedChanges)
+        return;
+
     int64_t nStart = GetTimeMillis();
 
     CAddrDB adb;
-    adb.Write(addrman);
+    if (!adb.Write(addrman))
+        return;
+    nLastDumpedChanges = nChanges;
 
     LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
         addrman.size(), GetTimeMillis() - nStart);
@@ -1525,8 +1831,12 @@ void ThreadMessageHandler()
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
+                    // Resume reading if the socket handler stopped because vRecvMsg was full
+                    if (pnode->fPauseRecv)
+                        WakeSocketHandler();
+
                     if (pnode->nSendSize < SendBufferSize()) {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
+                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete() && !pnode->fValidationBacklog)) {
                             fSleep = false;
                         }
                     }
@@ -1756,6 +2066,9 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
     // Send and receive from sockets, accept connections
+#ifdef USE_EPOLL
+    InitSocketEvents();
+#endif
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1770,6 +2083,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
 
+    int64_t nLogMessageStatsInterval = GetArg("-logmessagestats", 0);
+    if (nLogMessageStatsInterval > 0)
+        scheduler.scheduleEvery(boost::bind(&CMessageDispatcher::LogStats, &messageDispatcher), nLogMessageStatsInterval);
+
     // ppcoin:mint proof-of-stake blocks in the background
     if (GetBoolArg("-staking", true))
         threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "stakemint", &ThreadStakeMinter));
@@ -1815,6 +2132,9 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef USE_EPOLL
+        CloseSocketEvents();
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -1835,6 +2155,11 @@ void CExplicitNetCleanup::callCleanup()
     delete tmp; // Stroustrup's gonna kill me for that
 }
 
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
 void RelayTransaction(const CTransaction& tx)
 {
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
@@ -1976,12 +2301,12 @@ bool CAddrDB::Write(const CAddrMan& addr)
     uint256 hash = Hash(ssPeers.begin(), ssPeers.end());
     ssPeers << hash;
 
-    // open output file, and associate with CAutoFile
-    boost::filesystem::path pathAddr = GetDataDir() / "peers.dat";
-    FILE* file = fopen(pathAddr.string().c_str(), "wb");
+    // open temp output file, and associate with CAutoFile
+    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathAddr.string());
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
 
     // Write and commit header, data
     try {
@@ -1992,6 +2317,10 @@ bool CAddrDB::Write(const CAddrMan& addr)
     FileCommit(fileout.Get());
     fileout.fclose();
 
+    // replace existing peers.dat, if any, with new peers.dat.XXXX, so a crash never leaves a truncated file behind
+    if (!RenameOver(pathTmp, pathAddr))
+        return error("%s : Rename-into-place failed", __func__);
+
     return true;
 }
 
@@ -2055,6 +2384,9 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nServices = 0;
     hSocket = hSocketIn;
     nRecvVersion = INIT_PROTO_VERSION;
+    fPauseRecv = false;
+    fValidationBacklog = false;
+    nSocketEvents = 0;
     nLastSend = 0;
     nLastRecv = 0;
     nSendBytes = 0;
@@ -2080,6 +2412,7 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fGetAddr = false;
     fRelayTxes = false;
     setInventoryKnown.max_size(SendBufferSize() / 1000);
+    nNextInvSend = 0;
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
@@ -2192,13 +2525,23 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
+    {
+        const char* pchCommand = &ssSend[MESSAGE_START_SIZE];
+        LOCK(cs_msgStats);
+        mapSendBytesPerMsgCmd[std::string(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE))] += ssSend.size();
+    }
+
     std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
     ssSend.GetAndClear(*it);
     nSendSize += (*it).size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (it == vSendMsg.begin()) {
         SocketSendData(this);
+        // Let the socket handler wait for the socket to become writable
+        if (!vSendMsg.empty())
+            WakeSocketHandler();
+    }
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
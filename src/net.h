@@ -11,6 +11,7 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
+#include "messagedispatch.h"
 #include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -47,6 +48,8 @@ static const int PING_INTERVAL = 2 * 60;
 static const int TIMEOUT_INTERVAL = 20 * 60;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** Average delay between inventory announcements to an inbound peer, in seconds; outbound peers get them twice as often. */
+static const int INVENTORY_BROADCAST_INTERVAL = 2;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
@@ -65,6 +68,9 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
 
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 void AddressCurrentlyConnected(const CService& addr);
@@ -80,6 +86,8 @@ bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode* pnode);
+//! Interrupt the socket handler's wait, e.g. because a socket has data to send
+void WakeSocketHandler();
 
 typedef int NodeId;
 
@@ -170,6 +178,8 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    std::map<std::string, CMessageStats> mapRecvMsgStats;
+    std::map<std::string, uint64_t> mapSendBytesPerMsgCmd;
 };
 
 
@@ -187,6 +197,8 @@ public:
 
     int64_t nTime; // time (in microseconds) of message receipt.
 
+    bool fSigsChecked; // signatures were verified in a batch before the message got handled
+
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
     {
         hdrbuf.resize(24);
@@ -194,6 +206,7 @@ public:
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        fSigsChecked = false;
     }
 
     bool complete() const
@@ -211,6 +224,21 @@ public:
 
     int readHeader(const char* pch, unsigned int nBytes);
     int readData(const char* pch, unsigned int nBytes);
+
+    /**
+     * Room for up to nMax more bytes of the payload, for the socket handler
+     * to receive into directly. Call dataReceived with the number of bytes
+     * that were written there.
+     */
+    char* getDataBuffer(unsigned int nMax, unsigned int& nSpace);
+    void dataReceived(unsigned int nBytes);
+
+    //! Hand the payload buffer back for reuse by a later message, once this one was processed
+    void releaseData();
+
+private:
+    //! Make room for the next nBytes of the payload
+    void prepareData(unsigned int nBytes);
 };
 
 
@@ -295,6 +323,16 @@ public:
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
+    // Set by the socket handler while it stops reading because vRecvMsg is full
+    bool fPauseRecv;
+    // Set by ProcessMessages while it leaves blocks and transactions in vRecvMsg because the validation queue is full
+    bool fValidationBacklog;
+    // Events the socket is registered for with epoll, 0 if not registered yet
+    uint32_t nSocketEvents;
+    // Per-command counters of the messages handled from and sent to this peer
+    CCriticalSection cs_msgStats;
+    std::map<std::string, CMessageStats> mapRecvMsgStats;
+    std::map<std::string, uint64_t> mapSendBytesPerMsgCmd;
 
     int64_t nLastSend;
     int64_t nLastRecv;
@@ -364,7 +402,10 @@ public:
     mruset<CInv> setInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
+    // Time (in usec) after which the queued inventory is announced
+    int64_t nNextInvSend;
     std::multimap<int64_t, CInv> mapAskFor;
+    // Blocks asked for with getblocks after an unconnected block. Protected by cs_main.
     std::vector<uint256> vBlockRequested;
 
     // Ping time measurement:
@@ -414,6 +455,12 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    // Where the socket handler can receive the rest of the payload of the current message to without a copy, or NULL
+    char* GetRecvDataBuffer(unsigned int nMax, unsigned int& nSpace);
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedDataBytes(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -496,6 +543,19 @@ public:
         }
     }
 
+    //! Send a message whose payload is already serialized
+    void PushMessageRaw(const char* pszCommand, const char* pbegin, const char* pend)
+    {
+        try {
+            BeginMessage(pszCommand);
+            ssSend.write(pbegin, pend - pbegin);
+            EndMessage();
+        } catch (...) {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template <typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
@@ -716,6 +776,7 @@ public:
     static void SweepBanned();
 
     void copyStats(CNodeStats& stats);
+    void RecordReceivedMessage(const std::string& strCommand, size_t nBytes, int64_t nQueueMicros, int64_t nTimeMicros);
 
     static bool IsWhitelistedRange(const CNetAddr& ip);
     static void AddWhitelistedRange(const CSubNet& subnet);
@@ -4,18 +4,25 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "obfuscation.h"
+#include "checkqueue.h"
 #include "coincontrol.h"
+#include "crypto/sha256.h"
 #include "init.h"
+#include "masternodedb.h"
 #include "main.h"
 #include "masternodeman.h"
+#include "messagedispatch.h"
+#include "random.h"
 #include "script/sign.h"
 #include "swifttx.h"
 #include "ui_interface.h"
 #include "util.h"
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 #include <algorithm>
 #include <boost/assign/list_of.hpp>
@@ -43,6 +50,18 @@ CActiveMasternode activeMasternode;
         udjinm6   - udjinm6@dashpay.io
 */
 
+void CObfuscationPool::RegisterMessageHandlers(CMessageDispatcher& dispatcher)
+{
+    CMessageDispatcher::ExtensionHandler handler = boost::bind(&CObfuscationPool::ProcessMessageObfuscation, this, _1, _2, _3);
+    dispatcher.RegisterExtension("dsa", handler);
+    dispatcher.RegisterExtension("dsq", handler);
+    dispatcher.RegisterExtension("dsi", handler);
+    dispatcher.RegisterExtension("dssu", handler);
+    dispatcher.RegisterExtension("dss", handler);
+    dispatcher.RegisterExtension("dsf", handler);
+    dispatcher.RegisterExtension("dsc", handler);
+}
+
 void CObfuscationPool::ProcessMessageObfuscation(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
@@ -2107,6 +2126,12 @@ bool CObfuScationSigner::IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey)
     CScript payee2;
     payee2 = GetScriptForDestination(pubkey.GetID());
 
+    // The collateral is normally still unspent, which the UTXO set answers without reading blocks
+    CTxOut txout;
+    int nHeight;
+    if (GetUnspentOutput(vin.prevout, txout, nHeight) && IsMasternodeCollateral(txout.nValue) && txout.scriptPubKey == payee2)
+        return true;
+
     CTransaction txVin;
     uint256 hash;
     if (GetTransaction(vin.prevout.hash, txVin, hash, true)) {
@@ -2162,22 +2187,125 @@ bool CObfuScationSigner::SignMessage(std::string strMessage, std::string& errorM
     return true;
 }
 
+namespace
+{
+/**
+ * Checked masternode message signatures. The same broadcast, ping or vote is
+ * relayed to us by many peers, and a broadcast is checked against two message
+ * formats, so without the cache most of the key recoveries would be repeated.
+ * Invalid signatures are kept apart, so that a flood of them cannot evict the
+ * valid ones. Entries are salted so that peers cannot tell what is in the cache.
+ */
+class CMessageSignatureCache
+{
+private:
+    uint256 nonce;
+    std::set<uint256> setValid;
+    std::set<uint256> setInvalid;
+    boost::shared_mutex cs_sigcache;
+
+    static void Insert(std::set<uint256>& setEntries, const uint256& entry)
+    {
+        while (setEntries.size() >= OBFUSCATION_SIGCACHE_SIZE) {
+            // Evict a random entry, like the script signature cache does
+            std::set<uint256>::iterator it = setEntries.lower_bound(GetRandHash());
+            if (it == setEntries.end())
+                it = setEntries.begin();
+            setEntries.erase(it);
+        }
+        setEntries.insert(entry);
+    }
+
+public:
+    CMessageSignatureCache() : nonce(GetRandHash()) {}
+
+    uint256 GetEntry(const CKeyID& keyID, const uint256& hash, const std::vector<unsigned char>& vchSig) const
+    {
+        uint256 entry;
+        CSHA256().Write(nonce.begin(), 32).Write(keyID.begin(), keyID.size()).Write(hash.begin(), 32).Write(vchSig.data(), vchSig.size()).Finalize(entry.begin());
+        return entry;
+    }
+
+    //! Whether entry was checked before; fValid is set to the outcome if so
+    bool Get(const uint256& entry, bool& fValid)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        if (setValid.count(entry)) {
+            fValid = true;
+            return true;
+        }
+        if (setInvalid.count(entry)) {
+            fValid = false;
+            return true;
+        }
+        return false;
+    }
+
+    void Set(const uint256& entry, bool fValid)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        Insert(fValid ? setValid : setInvalid, entry);
+    }
+};
+
+CCheckQueue<CMessageSigCheck> messagesigcheckqueue(128);
+} // anon namespace
+
 bool CObfuScationSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    uint256 hash = ss.GetHash();
+
+    static CMessageSignatureCache messageSignatureCache;
+    uint256 entry = messageSignatureCache.GetEntry(pubkey.GetID(), hash, vchSig);
+    bool fValid;
+    if (messageSignatureCache.Get(entry, fValid)) {
+        if (!fValid)
+            errorMessage = "Invalid signature (cached).";
+        return fValid;
+    }
 
     CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
+    if (!pubkey2.RecoverCompact(hash, vchSig)) {
         errorMessage = _("Error recovering public key.");
+        messageSignatureCache.Set(entry, false);
         return false;
     }
 
-    if (fDebug && pubkey2.GetID() != pubkey.GetID())
-        LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
+    if (pubkey2.GetID() != pubkey.GetID()) {
+        if (fDebug)
+            LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
+        messageSignatureCache.Set(entry, false);
+        return false;
+    }
 
-    return (pubkey2.GetID() == pubkey.GetID());
+    messageSignatureCache.Set(entry, true);
+    return true;
+}
+
+void CObfuScationSigner::VerifyMessages(std::vector<CMessageSigCheck>& vChecks)
+{
+    if (!nScriptCheckThreads) {
+        BOOST_FOREACH (CMessageSigCheck& check, vChecks)
+            check();
+        return;
+    }
+
+    CCheckQueueControl<CMessageSigCheck> control(&messagesigcheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
+bool CMessageSigCheck::operator()()
+{
+    // The outcome is only needed in the signature cache. Failing would make the
+    // check queue skip the rest of the batch, so an invalid signature does not.
+    std::string errorMessage;
+    if (!obfuScationSigner.VerifyMessage(pubkey, vchSig, strMessage, errorMessage) && !strMessageOld.empty())
+        obfuScationSigner.VerifyMessage(pubkey, vchSig, strMessageOld, errorMessage);
+    return true;
 }
 
 bool CObfuscationQueue::Sign()
@@ -2281,6 +2409,12 @@ void CObfuscationPool::RelayCompletedTransaction(const int sessionID, const bool
 }
 
 //TODO: Rename/move to core
+void ThreadMessageSigCheck()
+{
+    RenameThread("gea-msgsigch");
+    messagesigcheckqueue.Thread();
+}
+
 void ThreadCheckObfuScationPool()
 {
     if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
@@ -2311,7 +2445,7 @@ void ThreadCheckObfuScationPool()
                 CleanTransactionLocksList();
             }
 
-            //if(c % MASTERNODES_DUMP_SECONDS == 0) DumpMasternodes();
+            if (c % MASTERNODES_DUMP_SECONDS == 0) FlushMasternodeCache();
 
             obfuScationPool.CheckTimeout();
             obfuScationPool.CheckForCompleteQueue();
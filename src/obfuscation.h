@@ -16,11 +16,13 @@
 class CTxIn;
 class CObfuscationPool;
 class CObfuScationSigner;
+class CMessageSigCheck;
 class CMasterNodeVote;
 class CBitcoinAddress;
 class CObfuscationQueue;
 class CObfuscationBroadcastTx;
 class CActiveMasternode;
+class CMessageDispatcher;
 
 // pool states for mixing
 #define POOL_STATUS_UNKNOWN 0              // waiting for update
@@ -46,6 +48,9 @@ class CActiveMasternode;
 #define OBFUSCATION_RELAY_OUT 2
 #define OBFUSCATION_RELAY_SIG 3
 
+// number of valid, and of invalid, message signatures remembered by CObfuScationSigner::VerifyMessage
+#define OBFUSCATION_SIGCACHE_SIZE 50000
+
 static const CAmount OBFUSCATION_COLLATERAL = (10 * COIN);
 static const CAmount OBFUSCATION_POOL_MAX = (99999.99 * COIN);
 
@@ -255,8 +260,36 @@ public:
     bool SetKey(std::string strSecret, std::string& errorMessage, CKey& key, CPubKey& pubkey);
     /// Sign the message, returns true if successful
     bool SignMessage(std::string strMessage, std::string& errorMessage, std::vector<unsigned char>& vchSig, CKey key);
-    /// Verify the message, returns true if succcessful
+    /// Verify the message, returns true if succcessful. The outcome is cached, so checking a signature again is cheap
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
+    /// Verify a batch of messages on the message signature check threads, caching the outcome of each
+    void VerifyMessages(std::vector<CMessageSigCheck>& vChecks);
+};
+
+/** A signed masternode message that is waiting to be verified by CObfuScationSigner::VerifyMessages
+ */
+class CMessageSigCheck
+{
+private:
+    CPubKey pubkey;
+    std::vector<unsigned char> vchSig;
+    std::string strMessage;
+    // the old message format a masternode broadcast may still be signed with, if any
+    std::string strMessageOld;
+
+public:
+    CMessageSigCheck() {}
+    CMessageSigCheck(const CPubKey& pubkeyIn, const std::vector<unsigned char>& vchSigIn, const std::string& strMessageIn, const std::string& strMessageOldIn = "") : pubkey(pubkeyIn), vchSig(vchSigIn), strMessage(strMessageIn), strMessageOld(strMessageOldIn) {}
+
+    bool operator()();
+
+    void swap(CMessageSigCheck& check)
+    {
+        std::swap(pubkey, check.pubkey);
+        vchSig.swap(check.vchSig);
+        strMessage.swap(check.strMessage);
+        strMessageOld.swap(check.strMessageOld);
+    }
 };
 
 /** Used to keep track of current status of Obfuscation pool
@@ -361,6 +394,7 @@ public:
      * \param vRecv
      */
     void ProcessMessageObfuscation(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+    void RegisterMessageHandlers(CMessageDispatcher& dispatcher);
 
     void InitCollateralAddress()
     {
@@ -512,5 +546,6 @@ public:
 };
 
 void ThreadCheckObfuScationPool();
+void ThreadMessageSigCheck();
 
 #endif
@@ -590,6 +590,12 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"assumevalid\": {          (object) verification skipped because of -assumevalid\n"
+            "     \"hash\": \"...\",          (string) the -assumevalid block hash, 0 if disabled\n"
+            "     \"skippedblocks\": xxxx,    (numeric) blocks connected without script checks\n"
+            "     \"skippedinputs\": xxxx,    (numeric) transaction inputs whose scripts were not verified\n"
+            "     \"skippedzerocoinspends\": xxxx (numeric) zerocoin spends whose proofs were not verified\n"
+            "  }\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -605,6 +611,12 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty", (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork", chainActive.Tip()->nChainWork.GetHex()));
+    UniValue assumevalid(UniValue::VOBJ);
+    assumevalid.push_back(Pair("hash", hashAssumeValid.GetHex()));
+    assumevalid.push_back(Pair("skippedblocks", assumeValidStats.nBlocks));
+    assumevalid.push_back(Pair("skippedinputs", assumeValidStats.nInputs));
+    assumevalid.push_back(Pair("skippedzerocoinspends", assumeValidStats.nZerocoinSpends));
+    obj.push_back(Pair("assumevalid", assumevalid));
     return obj;
 }
 
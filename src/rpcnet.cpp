@@ -8,6 +8,7 @@
 
 #include "clientversion.h"
 #include "main.h"
+#include "messagedispatch.h"
 #include "net.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -76,6 +77,21 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static UniValue MessageStatsToJSON(const CMessageStats& stats)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("count", stats.nCount));
+    obj.push_back(Pair("bytes", stats.nBytes));
+    obj.push_back(Pair("timemicros", stats.nTimeMicros));
+    obj.push_back(Pair("maxtimemicros", stats.nMaxTimeMicros));
+    obj.push_back(Pair("queuemicros", stats.nQueueMicros));
+    UniValue histogram(UniValue::VARR);
+    for (int i = 0; i < MESSAGE_TIME_BUCKETS; i++)
+        histogram.push_back(stats.vTimeHistogram[i]);
+    obj.push_back(Pair("timehistogram", histogram));
+    return obj;
+}
+
 UniValue getpeerinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -108,7 +124,15 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"bytessent_per_msg\": {\n"
+            "       \"command\": n,           (numeric) The total bytes sent to this peer in messages of this command\n"
+            "       ...\n"
+            "    },\n"
+            "    \"recv_per_msg\": {\n"
+            "       \"command\": {...},       (object) The counters of the messages of this command handled from this peer,\n"
+            "       ...                       as in getmessagestats\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -160,6 +184,16 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
+        UniValue sendPerMsg(UniValue::VOBJ);
+        for (std::map<std::string, uint64_t>::const_iterator it = stats.mapSendBytesPerMsgCmd.begin(); it != stats.mapSendBytesPerMsgCmd.end(); ++it)
+            sendPerMsg.push_back(Pair(it->first, it->second));
+        obj.push_back(Pair("bytessent_per_msg", sendPerMsg));
+
+        UniValue recvPerMsg(UniValue::VOBJ);
+        for (std::map<std::string, CMessageStats>::const_iterator it = stats.mapRecvMsgStats.begin(); it != stats.mapRecvMsgStats.end(); ++it)
+            recvPerMsg.push_back(Pair(it->first, MessageStatsToJSON(it->second)));
+        obj.push_back(Pair("recv_per_msg", recvPerMsg));
+
         ret.push_back(obj);
     }
 
@@ -367,6 +401,40 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getmessagestats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getmessagestats\n"
+            "\nReturns, for every P2P command this node handles, how many messages were received,\n"
+            "their size and the time spent processing them.\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {             (object) The P2P command\n"
+            "    \"count\": n,            (numeric) Number of messages processed\n"
+            "    \"bytes\": n,            (numeric) Total payload size of these messages\n"
+            "    \"timemicros\": n,       (numeric) Total time spent deserializing and processing them, in microseconds\n"
+            "    \"maxtimemicros\": n,    (numeric) Longest time spent on one of them\n"
+            "    \"queuemicros\": n,      (numeric) Total time they waited between arriving and being processed\n"
+            "    \"timehistogram\": [     (array) Number of messages processed in less than 10us, 100us, 1ms,\n"
+            "      n, ...                 10ms, 100ms, 1s, and in 1s or more\n"
+            "    ]\n"
+            "  }, ...\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getmessagestats", "") + HelpExampleRpc("getmessagestats", ""));
+
+    std::map<std::string, CMessageStats> mapStats;
+    messageDispatcher.GetStats(mapStats);
+
+    UniValue ret(UniValue::VOBJ);
+    for (std::map<std::string, CMessageStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+        ret.push_back(Pair(it->first, MessageStatsToJSON(it->second)));
+    return ret;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
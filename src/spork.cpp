@@ -8,6 +8,7 @@
 #include "key.h"
 #include "main.h"
 #include "masternode-budget.h"
+#include "messagedispatch.h"
 #include "net.h"
 #include "protocol.h"
 #include "sync.h"
@@ -57,6 +58,12 @@ void LoadSporksFromDB()
     }
 }
 
+void RegisterSporkMessageHandlers(CMessageDispatcher& dispatcher)
+{
+    dispatcher.RegisterExtension("spork", &ProcessSpork);
+    dispatcher.RegisterExtension("getsporks", &ProcessSpork);
+}
+
 void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all obfuscation/masternode related functionality
@@ -60,6 +60,7 @@ using namespace boost;
 
 class CSporkMessage;
 class CSporkManager;
+class CMessageDispatcher;
 
 extern std::map<uint256, CSporkMessage> mapSporks;
 extern std::map<int, CSporkMessage> mapSporksActive;
@@ -67,6 +68,7 @@ extern CSporkManager sporkManager;
 
 void LoadSporksFromDB();
 void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+void RegisterSporkMessageHandlers(CMessageDispatcher& dispatcher);
 int64_t GetSporkValue(int nSporkID);
 bool IsSporkActive(int nSporkID);
 void ExecuteSpork(int nSporkID, int nValue);
@@ -124,6 +124,12 @@ public:
         vch.clear();
         nReadPos = 0;
     }
+    //! Exchange the underlying buffer, e.g. to reuse its allocation once the stream is no longer needed
+    void swap(vector_type& other)
+    {
+        vch.swap(other);
+        nReadPos = 0;
+    }
     iterator insert(iterator it, const char& x = char()) { return vch.insert(it, x); }
     void insert(iterator it, size_type n, const char& x) { vch.insert(it, n, x); }
 
@@ -290,6 +296,58 @@ public:
 };
 
 
+/** Read-only stream over a contiguous range of memory owned by someone else.
+ *
+ * Unlike CDataStream no copy of the data is made, so the caller has to keep
+ * the underlying buffer alive for as long as the reader is used.
+ */
+class CMemoryReader
+{
+private:
+    const char* pbegin;
+    const char* pend;
+    const char* pcur;
+    int nType;
+    int nVersion;
+
+public:
+    CMemoryReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) : pbegin(pbeginIn), pend(pendIn), pcur(pbeginIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    int GetType() { return nType; }
+    int GetVersion() { return nVersion; }
+
+    bool eof() const { return pcur == pend; }
+    size_t size() const { return pend - pcur; }
+    //! Number of bytes consumed since construction
+    size_t GetPos() const { return pcur - pbegin; }
+
+    CMemoryReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::read() : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CMemoryReader& ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::ignore() : end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template <typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+
 /** Non-refcounted RAII wrapper for FILE*
  *
  * Will automatically close the file when it goes out of scope if not null.
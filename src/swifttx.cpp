@@ -9,6 +9,7 @@
 #include "base58.h"
 #include "key.h"
 #include "masternodeman.h"
+#include "messagedispatch.h"
 #include "net.h"
 #include "obfuscation.h"
 #include "protocol.h"
@@ -37,6 +38,12 @@ int nCompleteTXLocks;
 //         Send "txvote", CTransaction, Signature, Approve
 //step 3.) Top 1 masternode, waits for SWIFTTX_SIGNATURES_REQUIRED messages. Upon success, sends "txlock'
 
+void RegisterSwiftTXMessageHandlers(CMessageDispatcher& dispatcher)
+{
+    dispatcher.RegisterExtension("ix", &ProcessMessageSwiftTX);
+    dispatcher.RegisterExtension("txlvote", &ProcessMessageSwiftTX);
+}
+
 void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all obfuscation/masternode related functionality
@@ -478,10 +485,15 @@ uint256 CConsensusVote::GetHash() const
 }
 
 
+std::string CConsensusVote::GetStrMessage()
+{
+    return txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+}
+
 bool CConsensusVote::SignatureValid()
 {
     std::string errorMessage;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetStrMessage();
     //LogPrintf("verify strMessage %s \n", strMessage.c_str());
 
     CMasternode* pmn = mnodeman.Find(vinMasternode);
@@ -505,7 +517,7 @@ bool CConsensusVote::Sign()
 
     CKey key2;
     CPubKey pubkey2;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetStrMessage();
     //LogPrintf("signing strMessage %s \n", strMessage.c_str());
     //LogPrintf("signing privkey %s \n", strMasterNodePrivKey.c_str());
 
@@ -32,6 +32,7 @@ using namespace boost;
 class CConsensusVote;
 class CTransaction;
 class CTransactionLock;
+class CMessageDispatcher;
 
 static const int MIN_SWIFTTX_PROTO_VERSION = 70103;
 
@@ -51,6 +52,7 @@ bool IsIXTXValid(const CTransaction& txCollateral);
 bool CheckForConflictingLocks(CTransaction& tx);
 
 void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+void RegisterSwiftTXMessageHandlers(CMessageDispatcher& dispatcher);
 
 //check if we need to vote on this transaction
 void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight);
@@ -76,6 +78,7 @@ public:
 
     uint256 GetHash() const;
 
+    std::string GetStrMessage();
     bool SignatureValid();
     bool Sign();
 
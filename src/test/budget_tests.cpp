@@ -3,9 +3,12 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "masternode-budget.h"
+#include "random.h"
 #include "tinyformat.h"
 #include "utilmoneystr.h"
 
+#include <vector>
+
 #include <boost/test/unit_test.hpp>
 
 BOOST_AUTO_TEST_SUITE(budget_tests)
@@ -29,4 +32,83 @@ BOOST_AUTO_TEST_CASE(budget_value)
     CheckBudgetValue(nHeightTest, "mainnet", 43200*COIN);
 }
 
+static CBudgetVote RandomVote(const uint256& hashProposal)
+{
+    return CBudgetVote(CTxIn(GetRandHash(), 0), hashProposal, VOTE_YES);
+}
+
+BOOST_AUTO_TEST_CASE(budget_orphan_release)
+{
+    CBudgetOrphanVotes<CBudgetVote> orphans;
+    uint256 hashFirst = GetRandHash();
+    uint256 hashSecond = GetRandHash();
+
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK(orphans.Add(hashFirst, RandomVote(hashFirst), 1, 1000));
+    CBudgetVote vote = RandomVote(hashSecond);
+    BOOST_CHECK(orphans.Add(hashSecond, vote, 2, 1000));
+    // the same vote is only queued once
+    BOOST_CHECK(!orphans.Add(hashSecond, vote, 3, 1000));
+    BOOST_CHECK_EQUAL(orphans.size(), 4U);
+    BOOST_CHECK_EQUAL(orphans.CountFor(hashFirst), 3U);
+
+    std::vector<CBudgetVote> vVotes;
+    orphans.Release(hashFirst, vVotes);
+    BOOST_CHECK_EQUAL(vVotes.size(), 3U);
+    for (unsigned int i = 0; i < vVotes.size(); i++)
+        BOOST_CHECK(vVotes[i].nProposalHash == hashFirst);
+    BOOST_CHECK_EQUAL(orphans.size(), 1U);
+    BOOST_CHECK_EQUAL(orphans.CountFor(hashFirst), 0U);
+
+    // nothing is left for a parent that was released
+    vVotes.clear();
+    orphans.Release(hashFirst, vVotes);
+    BOOST_CHECK(vVotes.empty());
+}
+
+BOOST_AUTO_TEST_CASE(budget_orphan_limits)
+{
+    CBudgetOrphanVotes<CBudgetVote> orphans;
+    uint256 hash = GetRandHash();
+
+    for (unsigned int i = 0; i < BUDGET_ORPHAN_VOTES_PER_PEER; i++)
+        BOOST_CHECK(orphans.Add(hash, RandomVote(hash), 1, 1000));
+    // one peer cannot fill the queue, but others still can
+    BOOST_CHECK(!orphans.Add(hash, RandomVote(hash), 1, 1000));
+    BOOST_CHECK(orphans.Add(hash, RandomVote(hash), 2, 2000));
+
+    // the votes of the first peer expire first
+    BOOST_CHECK_EQUAL(orphans.Expire(1000 + BUDGET_ORPHAN_VOTE_EXPIRY), BUDGET_ORPHAN_VOTES_PER_PEER);
+    BOOST_CHECK_EQUAL(orphans.size(), 1U);
+    BOOST_CHECK(orphans.Add(hash, RandomVote(hash), 1, 3000));
+    BOOST_CHECK_EQUAL(orphans.Expire(3000 + BUDGET_ORPHAN_VOTE_EXPIRY), 2U);
+    BOOST_CHECK_EQUAL(orphans.size(), 0U);
+
+    // the queue never grows beyond its limit
+    for (unsigned int i = 0; i < BUDGET_ORPHAN_VOTES_MAX + 10; i++)
+        orphans.Add(hash, RandomVote(hash), i % 100, 1000);
+    BOOST_CHECK_EQUAL(orphans.size(), BUDGET_ORPHAN_VOTES_MAX);
+    BOOST_CHECK_EQUAL(orphans.CountFor(hash), BUDGET_ORPHAN_VOTES_MAX);
+}
+
+BOOST_AUTO_TEST_CASE(budget_orphan_restore)
+{
+    CBudgetOrphanVotes<CBudgetVote> orphans;
+    uint256 hash = GetRandHash();
+
+    // votes from the cache keep their expiry and are not held to the per-peer limit
+    for (unsigned int i = 0; i < BUDGET_ORPHAN_VOTES_PER_PEER; i++)
+        BOOST_CHECK(orphans.Add(hash, RandomVote(hash), 1, 1000 + i % 2));
+    CBudgetOrphanVotes<CBudgetVote> restored;
+    std::map<uint256, std::pair<CBudgetVote, int64_t> > mapVotes = orphans.GetVotes();
+    for (std::map<uint256, std::pair<CBudgetVote, int64_t> >::iterator it = mapVotes.begin(); it != mapVotes.end(); ++it)
+        BOOST_CHECK(restored.Restore(hash, it->second.first, it->second.second));
+    BOOST_CHECK(restored.Restore(hash, RandomVote(hash), 1000 + BUDGET_ORPHAN_VOTE_EXPIRY));
+    BOOST_CHECK_EQUAL(restored.size(), BUDGET_ORPHAN_VOTES_PER_PEER + 1);
+
+    BOOST_CHECK_EQUAL(restored.Expire(1000 + BUDGET_ORPHAN_VOTE_EXPIRY), BUDGET_ORPHAN_VOTES_PER_PEER / 2 + 1);
+    BOOST_CHECK_EQUAL(restored.Expire(1001 + BUDGET_ORPHAN_VOTE_EXPIRY), BUDGET_ORPHAN_VOTES_PER_PEER / 2);
+    BOOST_CHECK_EQUAL(restored.size(), 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,79 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternodedb.h"
+
+#include <map>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(masternodedb_tests)
+
+BOOST_AUTO_TEST_CASE(masternodedb_flush)
+{
+    CMasternodeCacheDB db(1 << 20, true, true);
+
+    std::map<int, std::string> mapFirst;
+    mapFirst[1] = "one";
+    mapFirst[2] = "two";
+    mapFirst[3] = "three";
+    std::map<int, std::string> mapSecond;
+    mapSecond[1] = "other";
+
+    db.BeginFlush();
+    db.WriteTable('x', mapFirst);
+    db.WriteTable('y', mapSecond);
+    BOOST_CHECK(db.Commit());
+
+    std::map<int, std::string> mapRead;
+    BOOST_CHECK(db.ReadTable('x', mapRead));
+    BOOST_CHECK(mapRead == mapFirst);
+    mapRead.clear();
+    BOOST_CHECK(db.ReadTable('y', mapRead));
+    BOOST_CHECK(mapRead == mapSecond);
+
+    // Entries that changed are rewritten, the ones that are gone are erased
+    mapFirst[2] = "changed";
+    mapFirst.erase(3);
+    db.BeginFlush();
+    db.WriteTable('x', mapFirst);
+    BOOST_CHECK(db.Commit());
+
+    mapRead.clear();
+    BOOST_CHECK(db.ReadTable('x', mapRead));
+    BOOST_CHECK(mapRead == mapFirst);
+    // The second table was not written by the last flush, so it is empty now
+    mapRead.clear();
+    BOOST_CHECK(db.ReadTable('y', mapRead));
+    BOOST_CHECK(mapRead.empty());
+}
+
+BOOST_AUTO_TEST_CASE(masternodedb_added_entries)
+{
+    CMasternodeCacheDB db(1 << 20, true, true);
+
+    std::map<int, std::string> mapTable;
+    mapTable[1] = "one";
+    mapTable[2] = "two";
+    db.BeginFlush();
+    db.WriteAddedEntries('x', mapTable);
+    BOOST_CHECK(db.Commit());
+
+    // Entries that are in the database already are kept as they were written
+    std::map<int, std::string> mapNext;
+    mapNext[1] = "not written";
+    mapNext[3] = "three";
+    db.BeginFlush();
+    db.WriteAddedEntries('x', mapNext);
+    BOOST_CHECK(db.Commit());
+
+    std::map<int, std::string> mapRead;
+    BOOST_CHECK(db.ReadTable('x', mapRead));
+    BOOST_CHECK_EQUAL(mapRead.size(), 2U);
+    BOOST_CHECK_EQUAL(mapRead[1], "one");
+    BOOST_CHECK_EQUAL(mapRead[3], "three");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
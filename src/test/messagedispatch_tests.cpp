@@ -0,0 +1,86 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "messagedispatch.h"
+#include "streams.h"
+#include "version.h"
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(messagedispatch_tests)
+
+static bool CountMessage(int* pnCalls, bool fRet, CNode* pfrom, std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    (*pnCalls)++;
+    return fRet;
+}
+
+static void CountExtensionMessage(int* pnCalls, CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
+    (*pnCalls)++;
+}
+
+BOOST_AUTO_TEST_CASE(dispatch_by_command)
+{
+    CMessageDispatcher dispatcher;
+    int nPing = 0, nPong = 0, nSpork = 0;
+    dispatcher.Register("ping", boost::bind(&CountMessage, &nPing, true, _1, _2, _3, _4));
+    dispatcher.Register("pong", boost::bind(&CountMessage, &nPong, false, _1, _2, _3, _4));
+    dispatcher.RegisterExtension("spork", boost::bind(&CountExtensionMessage, &nSpork, _1, _2, _3));
+
+    CDataStream vRecv(SER_NETWORK, PROTOCOL_VERSION);
+    vRecv << (uint64_t)42;
+    std::string strCommand = "ping";
+    BOOST_CHECK(dispatcher.Dispatch(NULL, strCommand, vRecv, 0));
+    strCommand = "pong";
+    BOOST_CHECK(!dispatcher.Dispatch(NULL, strCommand, vRecv, 0));
+    strCommand = "spork";
+    BOOST_CHECK(dispatcher.Dispatch(NULL, strCommand, vRecv, 0));
+    BOOST_CHECK(dispatcher.Dispatch(NULL, strCommand, vRecv, 0));
+
+    // Unknown commands and commands that only share a prefix with a registered one are ignored
+    strCommand = "pin";
+    BOOST_CHECK(dispatcher.Dispatch(NULL, strCommand, vRecv, 0));
+    strCommand = "pingpingpingping";
+    BOOST_CHECK(dispatcher.Dispatch(NULL, strCommand, vRecv, 0));
+
+    BOOST_CHECK_EQUAL(nPing, 1);
+    BOOST_CHECK_EQUAL(nPong, 1);
+    BOOST_CHECK_EQUAL(nSpork, 2);
+
+    std::map<std::string, CMessageStats> mapStats;
+    dispatcher.GetStats(mapStats);
+    BOOST_CHECK_EQUAL(mapStats.size(), 3U);
+    BOOST_CHECK_EQUAL(mapStats["ping"].nCount, 1U);
+    BOOST_CHECK_EQUAL(mapStats["ping"].nBytes, 8U);
+    BOOST_CHECK_EQUAL(mapStats["spork"].nCount, 2U);
+    BOOST_CHECK_EQUAL(mapStats["spork"].nBytes, 16U);
+}
+
+BOOST_AUTO_TEST_CASE(stats_histogram)
+{
+    CMessageStats stats;
+    stats.Add(100, 5, 0);
+    stats.Add(100, 5, 9);
+    stats.Add(100, 5, 10);
+    stats.Add(100, 5, 2500);
+    stats.Add(100, 5, 999999);
+    stats.Add(100, 5, 1000000);
+    stats.Add(100, 5, 60000000);
+
+    BOOST_CHECK_EQUAL(stats.nCount, 7U);
+    BOOST_CHECK_EQUAL(stats.nBytes, 700U);
+    BOOST_CHECK_EQUAL(stats.nQueueMicros, 35);
+    BOOST_CHECK_EQUAL(stats.nMaxTimeMicros, 60000000);
+    BOOST_CHECK_EQUAL(stats.vTimeHistogram[0], 2U);
+    BOOST_CHECK_EQUAL(stats.vTimeHistogram[1], 1U);
+    BOOST_CHECK_EQUAL(stats.vTimeHistogram[2], 0U);
+    BOOST_CHECK_EQUAL(stats.vTimeHistogram[3], 1U);
+    BOOST_CHECK_EQUAL(stats.vTimeHistogram[4], 0U);
+    BOOST_CHECK_EQUAL(stats.vTimeHistogram[5], 1U);
+    BOOST_CHECK_EQUAL(stats.vTimeHistogram[6], 2U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,6 +6,7 @@
 
 #include "txdb.h"
 
+#include "blockfilter.h"
 #include "main.h"
 #include "pow.h"
 #include "uint256.h"
@@ -60,8 +61,12 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
-            changed++;
+            // A fresh entry that ended up pruned was never written to the
+            // database, so there is nothing to erase for it.
+            if (!(it->second.flags & CCoinsCacheEntry::FRESH) || !it->second.coins.IsPruned()) {
+                BatchWriteCoins(batch, it->first, it->second.coins);
+                changed++;
+            }
         }
         count++;
         CCoinsMap::iterator itOld = it++;
@@ -290,6 +295,39 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     return true;
 }
 
+CBlockFilterDB::CBlockFilterDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "filter", nCacheSize, fMemory, fWipe)
+{
+}
+
+bool CBlockFilterDB::WriteFilter(const CBlockFilter& filter, const uint256& hashHeader)
+{
+    CLevelDBBatch batch;
+    batch.Write(make_pair('f', filter.GetBlockHash()), filter.GetEncoded());
+    batch.Write(make_pair('h', filter.GetBlockHash()), make_pair(filter.GetHash(), hashHeader));
+    batch.Write('B', filter.GetBlockHash());
+    return WriteBatch(batch);
+}
+
+bool CBlockFilterDB::ReadFilter(const uint256& hashBlock, std::vector<unsigned char>& vchFilter)
+{
+    return Read(make_pair('f', hashBlock), vchFilter);
+}
+
+bool CBlockFilterDB::ReadFilterHashes(const uint256& hashBlock, uint256& hashFilter, uint256& hashHeader)
+{
+    std::pair<uint256, uint256> hashes;
+    if (!Read(make_pair('h', hashBlock), hashes))
+        return false;
+    hashFilter = hashes.first;
+    hashHeader = hashes.second;
+    return true;
+}
+
+bool CBlockFilterDB::ReadBestBlock(uint256& hashBlock)
+{
+    return Read('B', hashBlock);
+}
+
 CZerocoinDB::CZerocoinDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "zerocoin", nCacheSize, fMemory, fWipe)
 {
 }
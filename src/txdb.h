@@ -16,6 +16,7 @@
 #include <utility>
 #include <vector>
 
+class CBlockFilter;
 class CCoins;
 class uint256;
 
@@ -69,6 +70,24 @@ public:
     bool LoadBlockIndexGuts();
 };
 
+/** Index of BIP 158 block filters (blocks/filter/) */
+class CBlockFilterDB : public CLevelDBWrapper
+{
+public:
+    CBlockFilterDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+private:
+    CBlockFilterDB(const CBlockFilterDB&);
+    void operator=(const CBlockFilterDB&);
+
+public:
+    /** Store the filter of a block and its header, and move the best indexed block to it */
+    bool WriteFilter(const CBlockFilter& filter, const uint256& hashHeader);
+    bool ReadFilter(const uint256& hashBlock, std::vector<unsigned char>& vchFilter);
+    bool ReadFilterHashes(const uint256& hashBlock, uint256& hashFilter, uint256& hashHeader);
+    bool ReadBestBlock(uint256& hashBlock);
+};
+
 /** Zerocoin database (zerocoin/) */
 class CZerocoinDB : public CLevelDBWrapper
 {
@@ -0,0 +1,90 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "validationqueue.h"
+
+#include "util.h"
+
+#include <boost/thread/thread.hpp>
+
+void CValidationQueue::Push(const uint256& hash, const Callback& fnValidate, const Callback& fnDone, size_t nSize)
+{
+    Item item = {hash, fnValidate, fnDone, nSize};
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queue.push_back(item);
+        setQueued.insert(hash);
+        nQueuedSize += nSize;
+    }
+    cond.notify_one();
+}
+
+bool CValidationQueue::IsFull()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return nQueuedSize >= MAX_VALIDATION_QUEUE_SIZE;
+}
+
+size_t CValidationQueue::size()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return queue.size();
+}
+
+bool CValidationQueue::Contains(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return setQueued.count(hash) > 0;
+}
+
+void CValidationQueue::Clear()
+{
+    std::deque<Item> queueDropped;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queueDropped.swap(queue);
+        setQueued.clear();
+        nQueuedSize = 0;
+    }
+    for (std::deque<Item>::iterator it = queueDropped.begin(); it != queueDropped.end(); ++it)
+        it->fnDone();
+}
+
+void CValidationQueue::Thread()
+{
+    try {
+        while (true) {
+            Item item;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queue.empty())
+                    cond.wait(lock); // interruption point
+                item = queue.front();
+                queue.pop_front();
+            }
+
+            try {
+                item.fnValidate();
+            } catch (boost::thread_interrupted) {
+                item.fnDone();
+                throw;
+            } catch (std::exception& e) {
+                PrintExceptionContinue(&e, "CValidationQueue::Thread()");
+            } catch (...) {
+                PrintExceptionContinue(NULL, "CValidationQueue::Thread()");
+            }
+            item.fnDone();
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                setQueued.erase(setQueued.find(item.hash));
+                nQueuedSize -= item.nSize;
+            }
+        }
+    } catch (boost::thread_interrupted) {
+        // Nothing else runs the work left behind; let go of what it holds on to
+        Clear();
+        throw;
+    }
+}
@@ -0,0 +1,74 @@
+// Copyright (c) 2018 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef GEA_VALIDATIONQUEUE_H
+#define GEA_VALIDATIONQUEUE_H
+
+#include "uint256.h"
+
+#include <deque>
+#include <set>
+#include <stddef.h>
+
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+//! Size of the messages waiting for validation above which no more blocks and transactions are taken from peers
+static const size_t MAX_VALIDATION_QUEUE_SIZE = 32 * 1024 * 1024;
+
+/**
+ * Work queue of the validation thread.
+ *
+ * The message handler hands blocks and transactions received from peers to
+ * this queue instead of validating them inline, so that a slow block connect
+ * does not hold up getdata, ping and inventory processing for every other
+ * peer. Work is run in the order it was queued, so a transaction that follows
+ * a block from the same peer is still validated against that block.
+ */
+class CValidationQueue
+{
+public:
+    typedef boost::function<void()> Callback;
+
+private:
+    struct Item {
+        uint256 hash;
+        Callback fnValidate;
+        Callback fnDone;
+        size_t nSize;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<Item> queue;
+    //! Hashes of the blocks and transactions queued or being validated
+    std::multiset<uint256> setQueued;
+    size_t nQueuedSize;
+
+    //! Drop all queued work, calling fnDone for each item.
+    void Clear();
+
+public:
+    CValidationQueue() : nQueuedSize(0) {}
+
+    /**
+     * Queue fnValidate for the validation thread. fnDone is called on that
+     * thread once fnValidate returned, also if it threw, or when the thread
+     * stops before getting to it. hash identifies the block or transaction,
+     * nSize is the size of its message, counted against MAX_VALIDATION_QUEUE_SIZE.
+     */
+    void Push(const uint256& hash, const Callback& fnValidate, const Callback& fnDone, size_t nSize);
+
+    //! Whether the message handler should stop handing over work for now
+    bool IsFull();
+    size_t size();
+    //! Whether the block or transaction hash is waiting for or under validation
+    bool Contains(const uint256& hash);
+
+    //! Run queued work until the thread is interrupted.
+    void Thread();
+};
+
+#endif // GEA_VALIDATIONQUEUE_H